@@ -0,0 +1,740 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+/*
+    ftpbench - drives concurrent scripted FTP sessions against a running server
+    and reports throughput and command latency.  See bench/Makefile and README.txt.
+*/
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SESSIONS 16
+#define MAX_SWEEP 16
+#define REPLY_SIZE 1024
+#define DATA_BUFFER_SIZE 65536
+#define LIST_FILES 200
+#define STORM_FILE_SIZE 1024
+#define ABORT_PIPELINE 256 // NOOPs sent behind an aborted download, more than the server's command buffer holds
+#define ABORT_TIMEOUT 10
+#define RMTREE_FILES 16 // files uploaded to each tree that is removed, half of them in a subdirectory
+
+typedef enum { W_LIST, W_RETR, W_STOR, W_STORM, W_MIX, W_ABORT, W_RMTREE, MAX_WORKLOADS } workload_t;
+
+static const char *workload_names[MAX_WORKLOADS] = { "list", "retr", "stor", "storm", "mix", "abort", "rmtree" };
+
+typedef struct {
+    workload_t workload;
+    u_int clients;
+    u_int size;
+    u_int bufsize;
+} scenario_t;
+
+typedef struct {
+    char key[64];
+    double kbps;
+    double p50_us;
+    double p99_us;
+    u_long ops;
+    u_long errors;
+} result_t;
+
+typedef struct {
+    uint32_t *values;
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+typedef struct {
+    int control;
+    char buf[REPLY_SIZE * 4];
+    size_t buffered;
+    char reply[REPLY_SIZE];
+    struct sockaddr_in local;
+    samples_t latencies;
+    unsigned long long bytes;
+    u_long ops;
+    u_long errors;
+    u_int id;
+    u_int seq;
+    unsigned rand_state;
+} session_t;
+
+typedef struct {
+    session_t *session;
+    const scenario_t *scenario;
+    double deadline;
+} worker_arg_t;
+
+static struct sockaddr_in server_address;
+static const char *user = "ftpii";
+static const char *password = "";
+static const char *root = "/sd/ftpbench";
+static bool passive = true;
+static double duration = 5;
+static bool verbose = false;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_sample(samples_t *samples, uint32_t value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        uint32_t *values = realloc(samples->values, capacity * sizeof(uint32_t));
+        if (!values) return;
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(samples_t *samples, double p) {
+    if (!samples->count) return 0;
+    size_t index = (size_t)(p * (samples->count - 1) + 0.5);
+    return samples->values[index];
+}
+
+static int connect_to(struct sockaddr_in *address, u_int bufsize) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    if (bufsize) {
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    }
+    if (connect(s, (struct sockaddr *)address, sizeof(*address))) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static bool send_all(int s, const char *buf, size_t length) {
+    while (length) {
+        ssize_t sent = send(s, buf, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            return false;
+        }
+        buf += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/*
+    Reads one line into session->reply, without the CRLF.
+*/
+static bool read_line(session_t *session) {
+    while (1) {
+        char *end = memchr(session->buf, '\n', session->buffered);
+        if (end) {
+            size_t length = end - session->buf;
+            size_t copy = length < REPLY_SIZE ? length : REPLY_SIZE - 1;
+            memcpy(session->reply, session->buf, copy);
+            if (copy && session->reply[copy - 1] == '\r') copy--;
+            session->reply[copy] = '\0';
+            session->buffered -= length + 1;
+            memmove(session->buf, end + 1, session->buffered);
+            return true;
+        }
+        if (session->buffered == sizeof(session->buf)) session->buffered = 0; // discard an over-long line
+        ssize_t received = recv(session->control, session->buf + session->buffered, sizeof(session->buf) - session->buffered, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) continue;
+            return false;
+        }
+        session->buffered += received;
+    }
+}
+
+/*
+    Returns the reply code, skipping the intermediate lines of multi-line replies, or -1 on error.
+*/
+static int read_reply(session_t *session) {
+    if (!read_line(session)) return -1;
+    int code = atoi(session->reply);
+    if (strlen(session->reply) >= 4 && session->reply[3] == '-') {
+        char terminator[5];
+        snprintf(terminator, sizeof(terminator), "%03d ", code);
+        do {
+            if (!read_line(session)) return -1;
+        } while (strncmp(session->reply, terminator, 4));
+    }
+    if (verbose) printf("[%u] %s\n", session->id, session->reply);
+    return code;
+}
+
+static bool send_command(session_t *session, const char *format, va_list args) {
+    char line[REPLY_SIZE];
+    int length = vsnprintf(line, sizeof(line) - 2, format, args);
+    if (length < 0 || length >= (int)sizeof(line) - 2) return false;
+    strcpy(line + length, "\r\n");
+    return send_all(session->control, line, length + 2);
+}
+
+/*
+    Sends a command and returns the code of its reply, recording the round trip latency.
+*/
+static int command(session_t *session, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    double started = now();
+    bool sent = send_command(session, format, args);
+    va_end(args);
+    int code = sent ? read_reply(session) : -1;
+    if (code > 0) add_sample(&session->latencies, (uint32_t)((now() - started) * 1e6));
+    return code;
+}
+
+static void init_session(session_t *session, u_int id) {
+    memset(session, 0, sizeof(*session));
+    session->control = -1;
+    session->id = id;
+    session->rand_state = id * 2654435761u + 1;
+}
+
+/*
+    Connects and logs in, keeping the statistics gathered by any previous connection.
+*/
+static bool open_session(session_t *session) {
+    session->buffered = 0;
+    *session->reply = '\0';
+    if ((session->control = connect_to(&server_address, 0)) < 0) return false;
+    int one = 1;
+    setsockopt(session->control, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    socklen_t length = sizeof(session->local);
+    getsockname(session->control, (struct sockaddr *)&session->local, &length);
+    if (read_reply(session) != 220) return false;
+    int code = command(session, "USER %s", user);
+    if (code == 331) code = command(session, "PASS %s", password);
+    if (code != 230) return false;
+    return command(session, "TYPE I") == 200;
+}
+
+static void close_session(session_t *session) {
+    if (session->control >= 0) {
+        command(session, "QUIT");
+        close(session->control);
+    }
+    session->control = -1;
+}
+
+/*
+    Sets up a data connection for a transfer command, returning the connected data socket
+    once the 150 reply has been received, or -1.
+*/
+static int open_data(session_t *session, u_int bufsize, const char *format, ...) {
+    int listener = -1, data = -1;
+    if (passive) {
+        if (command(session, "PASV") != 227) return -1;
+        char *numbers = strchr(session->reply, '(');
+        u_int h1, h2, h3, h4, p1, p2;
+        if (!numbers || sscanf(numbers, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) return -1;
+        struct sockaddr_in address = server_address;
+        address.sin_port = htons(p1 << 8 | p2);
+        if ((data = connect_to(&address, bufsize)) < 0) return -1;
+    } else {
+        struct sockaddr_in address = session->local;
+        address.sin_port = 0;
+        socklen_t length = sizeof(address);
+        if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+        if (bufsize) {
+            setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+            setsockopt(listener, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+        }
+        if (bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, 1) ||
+            getsockname(listener, (struct sockaddr *)&address, &length)) goto error;
+        uint32_t ip = ntohl(address.sin_addr.s_addr);
+        u_int port = ntohs(address.sin_port);
+        if (command(session, "PORT %u,%u,%u,%u,%u,%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, port >> 8, port & 0xff) != 200) goto error;
+    }
+
+    va_list args;
+    va_start(args, format);
+    bool sent = send_command(session, format, args);
+    va_end(args);
+    if (!sent || read_reply(session) != 150) goto error;
+
+    if (listener >= 0) {
+        data = accept(listener, NULL, NULL);
+        close(listener);
+    }
+    return data;
+
+    error:
+    if (listener >= 0) close(listener);
+    if (data >= 0) close(data);
+    return -1;
+}
+
+/*
+    Performs a whole transfer, from sending the command to the final reply, which is recorded as
+    the command latency.  Downloads are discarded and uploads are filled with size bytes.
+*/
+static bool transfer(session_t *session, u_int bufsize, bool upload, u_int size, const char *format, const char *path) {
+    static char buf[DATA_BUFFER_SIZE];
+    double started = now();
+    int data = open_data(session, bufsize, format, path);
+    if (data < 0) return false;
+    unsigned long long bytes = 0;
+    bool ok = true;
+    if (upload) {
+        while (ok && bytes < size) {
+            size_t length = size - bytes < sizeof(buf) ? size - bytes : sizeof(buf);
+            ok = send_all(data, buf, length);
+            bytes += length;
+        }
+    } else {
+        ssize_t received;
+        char rbuf[DATA_BUFFER_SIZE];
+        while ((received = recv(data, rbuf, sizeof(rbuf), 0)) > 0) bytes += received;
+        ok = received == 0;
+    }
+    close(data);
+    if (read_reply(session) != 226) ok = false;
+    if (ok) {
+        session->bytes += bytes;
+        add_sample(&session->latencies, (uint32_t)((now() - started) * 1e6));
+    }
+    return ok;
+}
+
+static void fixture_path(char *path, const char *name, u_int size) {
+    sprintf(path, "%s/%s-%u", root, name, size);
+}
+
+static bool op_list(session_t *session, const scenario_t *scenario) {
+    char path[256];
+    sprintf(path, "%s/list", root);
+    return transfer(session, scenario->bufsize, false, 0, "LIST %s", path);
+}
+
+static bool op_retr(session_t *session, const scenario_t *scenario) {
+    char path[256];
+    fixture_path(path, "fixture", scenario->size);
+    return transfer(session, scenario->bufsize, false, 0, "RETR %s", path);
+}
+
+static bool op_stor(session_t *session, const scenario_t *scenario) {
+    char path[256];
+    sprintf(path, "%s/stor-%u", root, session->id);
+    return transfer(session, scenario->bufsize, true, scenario->size, "STOR %s", path);
+}
+
+/*
+    A small-file storm: each operation creates, inspects and deletes a small file.
+*/
+static bool op_storm(session_t *session, const scenario_t *scenario) {
+    char path[256];
+    sprintf(path, "%s/storm-%u-%u", root, session->id, session->seq++);
+    return transfer(session, scenario->bufsize, true, STORM_FILE_SIZE, "STOR %s", path) &&
+        command(session, "SIZE %s", path) == 213 &&
+        command(session, "DELE %s", path) == 250;
+}
+
+/*
+    Starts a download, stops reading it, and pipelines more commands than the server can queue behind it
+    followed by ABOR, which must still be answered.  The ABOR round trip is recorded as the latency.
+*/
+static bool op_abort(session_t *session, const scenario_t *scenario) {
+    char path[256];
+    fixture_path(path, "fixture", scenario->size);
+    int data = open_data(session, scenario->bufsize, "RETR %s", path);
+    if (data < 0) return false;
+    char pipeline[ABORT_PIPELINE * 6];
+    u_int i;
+    for (i = 0; i < ABORT_PIPELINE; i++) memcpy(pipeline + i * 6, "NOOP\r\n", 6);
+    char rbuf[DATA_BUFFER_SIZE];
+    bool ok = recv(data, rbuf, sizeof(rbuf), 0) > 0 && send_all(session->control, pipeline, sizeof(pipeline));
+    double started = now();
+    ok = ok && send_all(session->control, "\xff\xf4\xff\xf2" "ABOR\r\n", 10);
+
+    struct timeval timeout = { ABORT_TIMEOUT, 0 };
+    setsockopt(session->control, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    u_int replies = 0, abort_replies = 0;
+    while (ok && replies < ABORT_PIPELINE + 2) {
+        int code = read_reply(session);
+        if (code == 426 || code == 226) {
+            // the transfer's reply and ABOR's own, unless it finished first
+            if (++abort_replies == 2) add_sample(&session->latencies, (uint32_t)((now() - started) * 1e6));
+        } else if (code != 200 && code != 450) {
+            ok = false; // 450 refuses NOOPs that did not fit in the queue
+        }
+        replies++;
+    }
+    timeout.tv_sec = 0;
+    setsockopt(session->control, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    close(data);
+    return ok && abort_replies == 2;
+}
+
+/*
+    Uploads a small tree and removes it with SITE RMTREE, which must delete every entry, then checks it is gone.
+    Use e.g. -r /ram/ftpbench to exercise a particular filesystem's directory iteration.
+*/
+static bool op_rmtree(session_t *session, const scenario_t *scenario) {
+    char dir[256], path[300];
+    sprintf(dir, "%s/rmtree-%u-%u", root, session->id, session->seq++);
+    if (command(session, "MKD %s", dir) != 257) return false;
+    sprintf(path, "%s/sub", dir);
+    if (command(session, "MKD %s", path) != 257) return false;
+    u_int i;
+    for (i = 0; i < RMTREE_FILES; i++) {
+        sprintf(path, i % 2 ? "%s/sub/file-%u" : "%s/file-%u", dir, i);
+        if (!transfer(session, scenario->bufsize, true, STORM_FILE_SIZE, "STOR %s", path)) return false;
+    }
+    return command(session, "SITE RMTREE %s", dir) == 250 &&
+        command(session, "SIZE %s/file-0", dir) == 550 &&
+        command(session, "CWD %s", dir) == 550;
+}
+
+static bool run_op(session_t *session, const scenario_t *scenario, workload_t workload) {
+    switch (workload) {
+        case W_LIST: return op_list(session, scenario);
+        case W_RETR: return op_retr(session, scenario);
+        case W_STOR: return op_stor(session, scenario);
+        case W_STORM: return op_storm(session, scenario);
+        case W_ABORT: return op_abort(session, scenario);
+        case W_RMTREE: return op_rmtree(session, scenario);
+        default: return run_op(session, scenario, rand_r(&session->rand_state) % W_MIX);
+    }
+}
+
+static void *worker(void *void_arg) {
+    worker_arg_t *arg = void_arg;
+    session_t *session = arg->session;
+    while (now() < arg->deadline) {
+        if (run_op(session, arg->scenario, arg->scenario->workload)) {
+            session->ops++;
+        } else {
+            session->errors++;
+            if (session->control < 0 || verbose) fprintf(stderr, "[%u] operation failed: %s\n", session->id, session->reply);
+            close(session->control);
+            if (!open_session(session)) break;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Creates the fixtures a scenario needs: the file it downloads, or the directory it lists.
+*/
+static bool prepare(session_t *session, const scenario_t *scenario) {
+    char path[256];
+    if (scenario->workload == W_RETR || scenario->workload == W_MIX || scenario->workload == W_ABORT) {
+        fixture_path(path, "fixture", scenario->size);
+        if (command(session, "SIZE %s", path) != 213 || (u_int)atoll(session->reply + 4) != scenario->size) {
+            if (!transfer(session, 0, true, scenario->size, "STOR %s", path)) return false;
+        }
+    }
+    if (scenario->workload == W_LIST || scenario->workload == W_MIX) {
+        sprintf(path, "%s/list", root);
+        if (command(session, "CWD %s", path) != 250) {
+            if (command(session, "MKD %s", path) != 257) return false;
+            u_int i;
+            for (i = 0; i < LIST_FILES; i++) {
+                sprintf(path, "%s/list/file-%03u", root, i);
+                if (!transfer(session, 0, true, 0, "STOR %s", path)) return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool run_scenario(const scenario_t *scenario, result_t *result) {
+    session_t *sessions = calloc(scenario->clients, sizeof(session_t));
+    worker_arg_t *args = calloc(scenario->clients, sizeof(worker_arg_t));
+    pthread_t threads[MAX_SESSIONS];
+    bool ok = sessions && args;
+    u_int i;
+    for (i = 0; sessions && i < scenario->clients; i++) init_session(sessions + i, i);
+    for (i = 0; ok && i < scenario->clients; i++) {
+        if (!(ok = open_session(sessions + i))) fprintf(stderr, "Unable to log in session %u: %s\n", i, sessions[i].reply);
+    }
+    if (ok && !(ok = prepare(sessions, scenario))) fprintf(stderr, "Unable to create fixtures: %s\n", sessions->reply);
+    if (ok) {
+        for (i = 0; i < scenario->clients; i++) {
+            sessions[i].latencies.count = 0;
+            sessions[i].bytes = 0;
+        }
+        double started = now();
+        for (i = 0; i < scenario->clients; i++) {
+            args[i].session = sessions + i;
+            args[i].scenario = scenario;
+            args[i].deadline = started + duration;
+            pthread_create(threads + i, NULL, worker, args + i);
+        }
+        for (i = 0; i < scenario->clients; i++) pthread_join(threads[i], NULL);
+        double elapsed = now() - started;
+
+        samples_t all = { NULL, 0, 0 };
+        unsigned long long bytes = 0;
+        memset(result, 0, sizeof(*result));
+        for (i = 0; i < scenario->clients; i++) {
+            size_t j;
+            for (j = 0; j < sessions[i].latencies.count; j++) add_sample(&all, sessions[i].latencies.values[j]);
+            bytes += sessions[i].bytes;
+            result->ops += sessions[i].ops;
+            result->errors += sessions[i].errors;
+        }
+        qsort(all.values, all.count, sizeof(uint32_t), compare_samples);
+        result->kbps = bytes / 1024.0 / elapsed;
+        result->p50_us = percentile(&all, 0.50);
+        result->p99_us = percentile(&all, 0.99);
+        free(all.values);
+    }
+    for (i = 0; sessions && i < scenario->clients; i++) {
+        close_session(sessions + i);
+        free(sessions[i].latencies.values);
+    }
+    free(sessions);
+    free(args);
+    snprintf(result->key, sizeof(result->key), "%s/c%u/s%u/b%u", workload_names[scenario->workload], scenario->clients, scenario->size, scenario->bufsize);
+    return ok;
+}
+
+static void cleanup_root() {
+    session_t session;
+    init_session(&session, 0);
+    if (open_session(&session)) {
+        if (command(&session, "SITE RMTREE %s", root) != 250) fprintf(stderr, "Unable to remove %s: %s\n", root, session.reply);
+        close_session(&session);
+    }
+    free(session.latencies.values);
+}
+
+/*
+    Baseline files hold one "<key> <kbps> <p50_us> <p99_us>" line per scenario; '#' starts a comment.
+    A scenario regresses when its throughput drops, or its p99 latency rises, by more than tolerance percent.
+*/
+static int compare_baseline(const char *filename, result_t *results, u_int num_results, double tolerance) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return -1;
+    }
+    char line[256];
+    int regressions = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char key[64];
+        double kbps, p50_us, p99_us;
+        if (*line == '#' || sscanf(line, "%63s %lf %lf %lf", key, &kbps, &p50_us, &p99_us) != 4) continue;
+        u_int i;
+        for (i = 0; i < num_results; i++) {
+            result_t *result = results + i;
+            if (strcmp(result->key, key)) continue;
+            if (result->kbps < kbps * (1 - tolerance / 100)) {
+                printf("REGRESSION %s: throughput %.0f KB/s, baseline %.0f KB/s\n", key, result->kbps, kbps);
+                regressions++;
+            }
+            if (result->p99_us > p99_us * (1 + tolerance / 100)) {
+                printf("REGRESSION %s: p99 latency %.0f us, baseline %.0f us\n", key, result->p99_us, p99_us);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+static bool write_baseline(const char *filename, result_t *results, u_int num_results) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+    fprintf(f, "# ftpbench baseline, recorded against %s:%u with: -d %g%s\n", inet_ntoa(server_address.sin_addr), ntohs(server_address.sin_port), duration, passive ? "" : " -a");
+    fprintf(f, "# %-30s %12s %10s %10s\n", "scenario", "kbps", "p50_us", "p99_us");
+    u_int i;
+    for (i = 0; i < num_results; i++) {
+        fprintf(f, "%-32s %12.0f %10.0f %10.0f\n", results[i].key, results[i].kbps, results[i].p50_us, results[i].p99_us);
+    }
+    return !fclose(f);
+}
+
+/*
+    Parses a comma-separated list of sizes, each optionally suffixed with k or m.
+*/
+static u_int parse_list(char *s, u_int *values) {
+    u_int count = 0;
+    char *token;
+    for (token = strtok(s, ","); token && count < MAX_SWEEP; token = strtok(NULL, ",")) {
+        char *end;
+        unsigned long value = strtoul(token, &end, 0);
+        if (*end == 'k' || *end == 'K') value <<= 10;
+        else if (*end == 'm' || *end == 'M') value <<= 20;
+        values[count++] = value;
+    }
+    return count;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -h host       server address (default 127.0.0.1)\n"
+        "  -p port       server port (default 21)\n"
+        "  -u user -P password\n"
+        "  -r dir        scratch directory on the server (default /sd/ftpbench), removed afterwards\n"
+        "  -a            use active mode (PORT) instead of PASV\n"
+        "  -d seconds    duration of each scenario (default 5)\n"
+        "  -w workloads  comma-separated list of list,retr,stor,storm,mix,abort,rmtree (default: the standard suite)\n"
+        "  -c clients    comma-separated sweep of concurrent sessions\n"
+        "  -s sizes      comma-separated sweep of file sizes for retr, stor, mix and abort, e.g. 64k,4m\n"
+        "  -b bufsizes   comma-separated sweep of data socket buffer sizes, 0 for the system default\n"
+        "  -B file       compare against a baseline file, and exit with status 1 on regression\n"
+        "  -t percent    regression tolerance (default 25)\n"
+        "  -W file       write the results as a baseline file\n"
+        "  -v            print every reply\n", program);
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    u_int port = 21;
+    const char *baseline = NULL, *record = NULL;
+    double tolerance = 25;
+    u_int workloads[MAX_SWEEP], clients[MAX_SWEEP] = { 1, 4 }, sizes[MAX_SWEEP] = { 65536, 4194304 }, bufsizes[MAX_SWEEP] = { 0 };
+    u_int num_workloads = 0, num_clients = 2, num_sizes = 2, num_bufsizes = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:P:r:ad:w:c:s:b:B:t:W:v")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'u': user = optarg; break;
+            case 'P': password = optarg; break;
+            case 'r': root = optarg; break;
+            case 'a': passive = false; break;
+            case 'd': duration = atof(optarg); break;
+            case 'w': {
+                char *token;
+                for (token = strtok(optarg, ","); token && num_workloads < MAX_SWEEP; token = strtok(NULL, ",")) {
+                    u_int i;
+                    for (i = 0; i < MAX_WORKLOADS && strcmp(token, workload_names[i]); i++);
+                    if (i == MAX_WORKLOADS) {
+                        fprintf(stderr, "Unknown workload: %s\n", token);
+                        return 2;
+                    }
+                    workloads[num_workloads++] = i;
+                }
+                break;
+            }
+            case 'c': num_clients = parse_list(optarg, clients); break;
+            case 's': num_sizes = parse_list(optarg, sizes); break;
+            case 'b': num_bufsizes = parse_list(optarg, bufsizes); break;
+            case 'B': baseline = optarg; break;
+            case 't': tolerance = atof(optarg); break;
+            case 'W': record = optarg; break;
+            case 'v': verbose = true; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+
+    struct hostent *he = gethostbyname(host);
+    if (!he) {
+        fprintf(stderr, "Unknown host: %s\n", host);
+        return 2;
+    }
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    memcpy(&server_address.sin_addr, he->h_addr_list[0], sizeof(server_address.sin_addr));
+
+    if (!num_workloads) {
+        u_int i;
+        for (i = 0; i < MAX_WORKLOADS; i++) workloads[num_workloads++] = i;
+    }
+
+    scenario_t scenarios[MAX_SWEEP * MAX_SWEEP];
+    u_int num_scenarios = 0;
+    u_int w, c, s, b;
+    for (w = 0; w < num_workloads; w++) {
+        bool sized = workloads[w] == W_RETR || workloads[w] == W_STOR || workloads[w] == W_MIX || workloads[w] == W_ABORT;
+        for (c = 0; c < num_clients; c++) {
+            if (clients[c] < 1 || clients[c] > MAX_SESSIONS) continue;
+            for (s = 0; s < (sized ? num_sizes : 1); s++) {
+                for (b = 0; b < num_bufsizes && num_scenarios < sizeof(scenarios) / sizeof(scenario_t); b++) {
+                    scenario_t *scenario = scenarios + num_scenarios++;
+                    scenario->workload = workloads[w];
+                    scenario->clients = clients[c];
+                    scenario->size = sized ? sizes[s] : 0;
+                    scenario->bufsize = bufsizes[b];
+                }
+            }
+        }
+    }
+
+    session_t setup;
+    init_session(&setup, 0);
+    if (!open_session(&setup)) {
+        fprintf(stderr, "Unable to log in to %s:%u: %s\n", host, port, setup.reply);
+        return 1;
+    }
+    command(&setup, "MKD %s", root);
+    close_session(&setup);
+    free(setup.latencies.values);
+
+    result_t results[MAX_SWEEP * MAX_SWEEP];
+    u_int num_results = 0, failures = 0, i;
+    printf("%-32s %8s %8s %12s %10s %10s\n", "scenario", "ops", "errors", "KB/s", "p50_us", "p99_us");
+    for (i = 0; i < num_scenarios; i++) {
+        result_t *result = results + num_results;
+        if (!run_scenario(scenarios + i, result)) {
+            printf("%-32s failed\n", result->key);
+            failures++;
+            continue;
+        }
+        printf("%-32s %8lu %8lu %12.0f %10.0f %10.0f\n", result->key, result->ops, result->errors, result->kbps, result->p50_us, result->p99_us);
+        fflush(stdout);
+        num_results++;
+    }
+    cleanup_root();
+
+    if (record && !write_baseline(record, results, num_results)) return 1;
+    if (baseline) {
+        int regressions = compare_baseline(baseline, results, num_results, tolerance);
+        if (regressions < 0) return 1;
+        printf("%d regression(s) against %s\n", regressions, baseline);
+        if (regressions) return 1;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/dir.h>
+
+typedef struct {
+    DIR *dir;
+    char path[MAXPATHLEN];
+} host_dir_t;
+
+DIR_ITER *diropen(const char *path) {
+    if (strlen(path) >= MAXPATHLEN) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) return NULL;
+    DIR_ITER *iter = malloc(sizeof(DIR_ITER));
+    host_dir_t *state = malloc(sizeof(host_dir_t));
+    if (!iter || !state) {
+        free(iter);
+        free(state);
+        closedir(dir);
+        errno = ENOMEM;
+        return NULL;
+    }
+    state->dir = dir;
+    strcpy(state->path, path);
+    iter->device = 0;
+    iter->dirStruct = state;
+    return iter;
+}
+
+int dirreset(DIR_ITER *dirState) {
+    rewinddir(((host_dir_t *)dirState->dirStruct)->dir);
+    return 0;
+}
+
+int dirnext(DIR_ITER *dirState, char *filename, struct stat *filestat) {
+    host_dir_t *state = dirState->dirStruct;
+    struct dirent *entry = readdir(state->dir);
+    if (!entry) {
+        errno = ENOENT;
+        return -1;
+    }
+    strcpy(filename, entry->d_name);
+    char entry_path[MAXPATHLEN * 2];
+    snprintf(entry_path, sizeof(entry_path), "%s/%s", state->path, entry->d_name);
+    if (stat(entry_path, filestat)) memset(filestat, 0, sizeof(*filestat));
+    return 0;
+}
+
+int dirclose(DIR_ITER *dirState) {
+    host_dir_t *state = dirState->dirStruct;
+    closedir(state->dir);
+    free(state);
+    free(dirState);
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include <sys/dir.h>
+
+#include "discindex.h"
+#include "fs.h"
+#include "isfscache.h"
+
+/*
+    On the host every virtual partition is a plain directory named after its
+    devoptab prefix (e.g. "sd:") inside the server's working directory, so the
+    real paths produced by to_real_path() resolve with the ordinary libc calls.
+    A partition is "mounted" when its directory exists.
+*/
+VIRTUAL_PARTITION VIRTUAL_PARTITIONS[] = {
+    { "SD Gecko A", "/carda", "carda", "carda:/", false, false, NULL, DEVICE_GCSDA },
+    { "SD Gecko B", "/cardb", "cardb", "cardb:/", false, false, NULL, DEVICE_GCSDB },
+    { "Front SD", "/sd", "sd", "sd:/", false, false, NULL, DEVICE_SD },
+    { "USB storage device", "/usb", "usb", "usb:/", false, false, NULL, DEVICE_USB },
+    { "ISO9660 filesystem", "/dvd", "dvd", "dvd:/", false, false, NULL, DEVICE_DVD },
+    { "Wii disc image", "/wod", "wod", "wod:/", false, false, NULL, DEVICE_DVD },
+    { "Wii disc filesystem", "/fst", "fst", "fst:/", false, false, NULL, DEVICE_DVD },
+    { "NAND images", "/nand", "nand", "nand:/", false, false, NULL, DEVICE_NAND },
+    { "NAND filesystem", "/isfs", "isfs", "isfs:/", false, false, NULL, DEVICE_NAND },
+    { "OTP filesystem", "/otp", "otp", "otp:/", false, false, NULL, DEVICE_NAND },
+    { "SEEPROM filesystem", "/seeprom", "seeprom", "seeprom:/", false, false, NULL, DEVICE_NAND },
+    { "RAM disk", "/ram", "ram", "ram:/", false, false, NULL, DEVICE_RAM }
+};
+const u32 MAX_VIRTUAL_PARTITIONS = (sizeof(VIRTUAL_PARTITIONS) / sizeof(VIRTUAL_PARTITION));
+
+VIRTUAL_PARTITION *PA_GCSDA   = VIRTUAL_PARTITIONS + 0;
+VIRTUAL_PARTITION *PA_GCSDB   = VIRTUAL_PARTITIONS + 1;
+VIRTUAL_PARTITION *PA_SD      = VIRTUAL_PARTITIONS + 2;
+VIRTUAL_PARTITION *PA_USB     = VIRTUAL_PARTITIONS + 3;
+VIRTUAL_PARTITION *PA_DVD     = VIRTUAL_PARTITIONS + 4;
+VIRTUAL_PARTITION *PA_WOD     = VIRTUAL_PARTITIONS + 5;
+VIRTUAL_PARTITION *PA_FST     = VIRTUAL_PARTITIONS + 6;
+VIRTUAL_PARTITION *PA_NAND    = VIRTUAL_PARTITIONS + 7;
+VIRTUAL_PARTITION *PA_ISFS    = VIRTUAL_PARTITIONS + 8;
+VIRTUAL_PARTITION *PA_OTP     = VIRTUAL_PARTITIONS + 9;
+VIRTUAL_PARTITION *PA_SEEPROM = VIRTUAL_PARTITIONS + 10;
+VIRTUAL_PARTITION *PA_RAM     = VIRTUAL_PARTITIONS + 11;
+
+static VIRTUAL_PARTITION *to_virtual_partition(const char *virtual_prefix) {
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++)
+        if (!strcasecmp(VIRTUAL_PARTITIONS[i].alias, virtual_prefix))
+            return &VIRTUAL_PARTITIONS[i];
+    return NULL;
+}
+
+bool mounted(VIRTUAL_PARTITION *partition) {
+    DIR_ITER *dir = diropen(partition->prefix);
+    if (dir) {
+        dirclose(dir);
+        return true;
+    }
+    return false;
+}
+
+bool mount(VIRTUAL_PARTITION *partition) {
+    return partition && mounted(partition);
+}
+
+bool mount_virtual(const char *dir) {
+    return mount(to_virtual_partition(dir));
+}
+
+bool deferred(VIRTUAL_PARTITION *partition) {
+    return false;
+}
+
+void mount_if_deferred(VIRTUAL_PARTITION *partition) {
+}
+
+bool unmount(VIRTUAL_PARTITION *partition) {
+    return false;
+}
+
+bool unmount_virtual(const char *dir) {
+    return unmount(to_virtual_partition(dir));
+}
+
+void check_removable_devices(u64 now) {
+}
+
+void process_remount_event() {
+}
+
+void process_device_select_event(u32 pressed) {
+}
+
+void check_mount_timer(u64 now) {
+}
+
+/*
+    The disc partitions' directories stand in for discs that are mounted at startup.
+*/
+void initialise_fs() {
+    initialise_disc_index();
+    initialise_isfs_cache();
+    VIRTUAL_PARTITION *discs[] = { PA_DVD, PA_WOD, PA_FST };
+    u32 i;
+    for (i = 0; i < 3; i++) {
+        if (mounted(discs[i])) build_disc_index(discs[i]);
+    }
+}
+
+/*
+    Returns a copy of path up to the last '/' character,
+    If path does not contain '/', returns "".
+    Returns a pointer to internal static storage space that will be overwritten by subsequent calls.
+    This function is not thread-safe.
+*/
+char *dirname(char *path) {
+    static char result[MAXPATHLEN];
+    strncpy(result, path, MAXPATHLEN - 1);
+    result[MAXPATHLEN - 1] = '\0';
+    s32 i;
+    for (i = strlen(result) - 1; i >= 0; i--) {
+        if (result[i] == '/') {
+            result[i] = '\0';
+            return result;
+        }
+    }
+    return "";
+}
+
+/*
+    Returns a pointer into path, starting after the right-most '/' character.
+    If path does not contain '/', returns path.
+*/
+char *basename(char *path) {
+    s32 i;
+    for (i = strlen(path) - 1; i >= 0; i--) {
+        if (path[i] == '/') {
+            return path + i + 1;
+        }
+    }
+    return path;
+}
@@ -0,0 +1,219 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <ogc/cond.h>
+#include <ogc/lwp.h>
+#include <ogc/mutex.h>
+#include <ogc/semaphore.h>
+#include <pthread.h>
+
+/*
+    LWP threads, semaphores, mutexes and condition variables on top of pthreads.  Handles index fixed tables, as libogc's do;
+    the main thread is handle 0.  Priorities and stacks are left to the host scheduler.
+*/
+#define MAX_THREADS 16
+#define MAX_SEMAPHORES 16
+#define MAX_MUTEXES 16
+#define MAX_CONDS 16
+
+static pthread_t threads[MAX_THREADS];
+static u32 num_threads = 1;
+static __thread lwp_t self = 0;
+
+typedef struct {
+    void *(*entry)(void *);
+    void *arg;
+    lwp_t handle;
+} thread_start;
+
+static thread_start starts[MAX_THREADS];
+
+static void *run_thread(void *arg) {
+    thread_start *start = arg;
+    self = start->handle;
+    return start->entry(start->arg);
+}
+
+s32 LWP_CreateThread(lwp_t *thethread, void *(*entry)(void *), void *arg, void *stackbase, u32 stack_size, u8 prio) {
+    if (num_threads == MAX_THREADS) return -1;
+    lwp_t handle = num_threads;
+    thread_start *start = starts + handle;
+    start->entry = entry;
+    start->arg = arg;
+    start->handle = handle;
+    if (pthread_create(threads + handle, NULL, run_thread, start)) return -1;
+    num_threads++;
+    *thethread = handle;
+    return 0;
+}
+
+s32 LWP_JoinThread(lwp_t thethread, void **value_ptr) {
+    if (thethread == 0 || thethread >= num_threads) return -1;
+    return pthread_join(threads[thethread], value_ptr) ? -1 : 0;
+}
+
+lwp_t LWP_GetSelf() {
+    return self;
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    u32 count;
+    u32 max;
+    bool used;
+} semaphore;
+
+static semaphore semaphores[MAX_SEMAPHORES];
+
+s32 LWP_SemInit(sem_t *sem, u32 start, u32 max) {
+    u32 i;
+    for (i = 0; i < MAX_SEMAPHORES; i++) {
+        semaphore *s = semaphores + i;
+        if (!s->used) {
+            pthread_mutex_init(&s->mutex, NULL);
+            pthread_cond_init(&s->cond, NULL);
+            s->count = start;
+            s->max = max;
+            s->used = true;
+            *sem = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+s32 LWP_SemDestroy(sem_t sem) {
+    if (sem >= MAX_SEMAPHORES || !semaphores[sem].used) return -1;
+    semaphore *s = semaphores + sem;
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    s->used = false;
+    return 0;
+}
+
+s32 LWP_SemWait(sem_t sem) {
+    if (sem >= MAX_SEMAPHORES || !semaphores[sem].used) return -1;
+    semaphore *s = semaphores + sem;
+    pthread_mutex_lock(&s->mutex);
+    while (!s->count) pthread_cond_wait(&s->cond, &s->mutex);
+    s->count--;
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+s32 LWP_SemPost(sem_t sem) {
+    if (sem >= MAX_SEMAPHORES || !semaphores[sem].used) return -1;
+    semaphore *s = semaphores + sem;
+    pthread_mutex_lock(&s->mutex);
+    if (s->count < s->max) s->count++;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    bool used;
+} lwp_mutex;
+
+static lwp_mutex mutexes[MAX_MUTEXES];
+
+s32 LWP_MutexInit(mutex_t *mutex, bool use_recursive) {
+    u32 i;
+    for (i = 0; i < MAX_MUTEXES; i++) {
+        lwp_mutex *m = mutexes + i;
+        if (!m->used) {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            if (use_recursive) pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+            pthread_mutex_init(&m->mutex, &attr);
+            pthread_mutexattr_destroy(&attr);
+            m->used = true;
+            *mutex = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+s32 LWP_MutexDestroy(mutex_t mutex) {
+    if (mutex >= MAX_MUTEXES || !mutexes[mutex].used) return -1;
+    pthread_mutex_destroy(&mutexes[mutex].mutex);
+    mutexes[mutex].used = false;
+    return 0;
+}
+
+s32 LWP_MutexLock(mutex_t mutex) {
+    if (mutex >= MAX_MUTEXES || !mutexes[mutex].used) return -1;
+    return pthread_mutex_lock(&mutexes[mutex].mutex) ? -1 : 0;
+}
+
+s32 LWP_MutexUnlock(mutex_t mutex) {
+    if (mutex >= MAX_MUTEXES || !mutexes[mutex].used) return -1;
+    return pthread_mutex_unlock(&mutexes[mutex].mutex) ? -1 : 0;
+}
+
+typedef struct {
+    pthread_cond_t cond;
+    bool used;
+} lwp_cond;
+
+static lwp_cond conds[MAX_CONDS];
+
+s32 LWP_CondInit(cond_t *cond) {
+    u32 i;
+    for (i = 0; i < MAX_CONDS; i++) {
+        lwp_cond *c = conds + i;
+        if (!c->used) {
+            pthread_cond_init(&c->cond, NULL);
+            c->used = true;
+            *cond = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+s32 LWP_CondWait(cond_t cond, mutex_t mutex) {
+    if (cond >= MAX_CONDS || !conds[cond].used || mutex >= MAX_MUTEXES || !mutexes[mutex].used) return -1;
+    return pthread_cond_wait(&conds[cond].cond, &mutexes[mutex].mutex) ? -1 : 0;
+}
+
+s32 LWP_CondSignal(cond_t cond) {
+    if (cond >= MAX_CONDS || !conds[cond].used) return -1;
+    return pthread_cond_signal(&conds[cond].cond) ? -1 : 0;
+}
+
+s32 LWP_CondBroadcast(cond_t cond) {
+    if (cond >= MAX_CONDS || !conds[cond].used) return -1;
+    return pthread_cond_broadcast(&conds[cond].cond) ? -1 : 0;
+}
+
+s32 LWP_CondDestroy(cond_t cond) {
+    if (cond >= MAX_CONDS || !conds[cond].used) return -1;
+    pthread_cond_destroy(&conds[cond].cond);
+    conds[cond].used = false;
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <network.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dvdcache.h"
+#include "fs.h"
+#include "ftp.h"
+#include "net.h"
+#include "reset.h"
+#include "stats.h"
+#include "worker.h"
+
+/*
+    ftpii-host [-p port] [-r root] [-i idle_seconds] [-s stall_seconds] [password]
+
+    Serves the directories "sd:", "usb:", etc. found under root (default ".") as
+    the corresponding virtual partitions.  -i and -s set the control-idle and
+    transfer-stall timeouts, as SITE TIMEOUT does.
+*/
+
+static void handle_signal(int signum) {
+    set_reset_flag();
+}
+
+int main(int argc, char **argv) {
+    u16 port = 2121;
+    const char *root = ".";
+    u32 idle_timeout = DEFAULT_IDLE_TIMEOUT, stall_timeout = DEFAULT_NET_TIMEOUT;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:r:i:s:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'r': root = optarg; break;
+            case 'i': idle_timeout = atoi(optarg); break;
+            case 's': stall_timeout = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-r root] [-i idle_seconds] [-s stall_seconds] [password]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind < argc) set_ftp_password(argv[optind]);
+    set_ftp_timeouts(idle_timeout, stall_timeout);
+    if (chdir(root)) {
+        perror(root);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    start_network_initialisation();
+    initialise_fs();
+    initialise_stats();
+    initialise_dvd_cache();
+    initialise_workers();
+    finish_network_initialisation();
+    s32 server = create_server(port);
+    if (server < 0) return 1;
+    printf("Listening on TCP port %u...\n", port);
+
+    while (!reset()) {
+        if (process_ftp_events(server)) break;
+        usleep(100);
+    }
+    cleanup_ftp();
+    cleanup_workers();
+    net_close(server);
+    printf("\nKTHXBYE\n");
+    return 0;
+}
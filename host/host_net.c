@@ -0,0 +1,122 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#define _GNU_SOURCE // accept4
+#include <errno.h>
+#include <fcntl.h>
+#include <network.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+    libogc's net_* calls return -errno on failure, and use lwIP's value of O_NONBLOCK.
+*/
+#define LWIP_O_NONBLOCK 4
+
+static s32 result_or_errno(s32 result) {
+    return result < 0 ? -errno : result;
+}
+
+s32 net_init() {
+    return 0;
+}
+
+void net_deinit() {
+}
+
+/*
+    Returns the address in the same byte order net_gethostip() uses on the Wii,
+    i.e. the most-significant byte is the first octet.
+*/
+u32 net_gethostip() {
+    return INADDR_LOOPBACK;
+}
+
+s32 net_socket(u32 domain, u32 type, u32 protocol) {
+    s32 s = result_or_errno(socket(domain, type, protocol));
+    if (s >= 0) {
+        int yes = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    }
+    return s;
+}
+
+s32 net_bind(s32 s, struct sockaddr *name, socklen_t namelen) {
+    return result_or_errno(bind(s, name, namelen));
+}
+
+s32 net_listen(s32 s, u32 backlog) {
+    return result_or_errno(listen(s, backlog));
+}
+
+s32 net_accept(s32 s, struct sockaddr *addr, socklen_t *addrlen) {
+    int flags = fcntl(s, F_GETFL, 0);
+    return result_or_errno(accept4(s, addr, addrlen, (flags & O_NONBLOCK) ? SOCK_NONBLOCK : 0));
+}
+
+s32 net_connect(s32 s, struct sockaddr *addr, socklen_t addrlen) {
+    return result_or_errno(connect(s, addr, addrlen));
+}
+
+s32 net_write(s32 s, const void *data, s32 size) {
+    return result_or_errno(send(s, data, size, MSG_NOSIGNAL));
+}
+
+s32 net_read(s32 s, void *mem, s32 len) {
+    return result_or_errno(recv(s, mem, len, 0));
+}
+
+s32 net_close(s32 s) {
+    if (s < 0) return -EBADF;
+    return result_or_errno(close(s));
+}
+
+s32 net_fcntl(s32 s, u32 cmd, u32 flags) {
+    if (cmd == F_GETFL) {
+        s32 result = fcntl(s, F_GETFL, 0);
+        if (result < 0) return -errno;
+        return (result & O_NONBLOCK) ? LWIP_O_NONBLOCK : 0;
+    } else if (cmd == F_SETFL) {
+        s32 current = fcntl(s, F_GETFL, 0);
+        if (current < 0) return -errno;
+        if (flags & LWIP_O_NONBLOCK) current |= O_NONBLOCK;
+        else current &= ~O_NONBLOCK;
+        return result_or_errno(fcntl(s, F_SETFL, current));
+    }
+    return -EINVAL;
+}
+
+s32 net_poll(struct pollsd *sds, s32 nsds, s32 timeout) {
+    struct pollfd fds[nsds];
+    s32 i;
+    for (i = 0; i < nsds; i++) {
+        fds[i].fd = sds[i].socket;
+        fds[i].events = sds[i].events;
+    }
+    s32 result = result_or_errno(poll(fds, nsds, timeout));
+    for (i = 0; i < nsds; i++) {
+        sds[i].revents = result < 0 ? 0 : fds[i].revents;
+    }
+    return result;
+}
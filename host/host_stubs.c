@@ -0,0 +1,215 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <di/di.h>
+#include <errno.h>
+#include <gccore.h>
+#include <ogc/lwp_watchdog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dvd.h"
+#include "dvdcache.h"
+#include "loader.h"
+#include "ramdisk.h"
+#include "reset.h"
+
+/*
+    Console-only pieces of libogc and of the modules that drive the hardware
+    (pads, video, DI, the DOL loader) are stubbed out on the host.
+*/
+
+u64 gettime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void VIDEO_Init() {
+}
+
+void VIDEO_WaitVSync() {
+    usleep(16667);
+}
+
+/*
+    MEM2 is a heap block the size of the Wii's, handed out by moving the arena bounds as on the console.
+*/
+#define MEM2_SIZE (64 * 1024 * 1024)
+
+static u8 *mem2 = NULL;
+static void *arena2_lo = NULL, *arena2_hi = NULL;
+
+static void initialise_mem2() {
+    if (mem2) return;
+    if (!(mem2 = malloc(MEM2_SIZE))) die("Unable to allocate MEM2", ENOMEM);
+    arena2_lo = mem2;
+    arena2_hi = mem2 + MEM2_SIZE;
+}
+
+void *SYS_GetArena2Lo() {
+    initialise_mem2();
+    return arena2_lo;
+}
+
+void *SYS_GetArena2Hi() {
+    initialise_mem2();
+    return arena2_hi;
+}
+
+void SYS_SetArena2Lo(void *newLo) {
+    initialise_mem2();
+    arena2_lo = newLo;
+}
+
+void SYS_SetArena2Hi(void *newHi) {
+    initialise_mem2();
+    arena2_hi = newHi;
+}
+
+static volatile bool _reset = false;
+
+u8 reset() {
+    return _reset;
+}
+
+void set_reset_flag() {
+    _reset = true;
+}
+
+void initialise_reset_buttons() {
+}
+
+bool check_reset_synchronous() {
+    return _reset;
+}
+
+void maybe_poweroff() {
+}
+
+void die(char *msg, int errnum) {
+    printf("%s: [%i] %s\n", msg, errnum, strerror(errnum));
+    exit(1);
+}
+
+bool dvd_mountWait() {
+    return false;
+}
+
+void set_dvd_mountWait(bool state) {
+}
+
+static u64 dvd_last_raw_access = 0;
+
+u64 dvd_last_access() {
+    return dvd_last_raw_access;
+}
+
+void set_dvd_last_access(u64 now) {
+    dvd_last_raw_access = now;
+}
+
+/*
+    The disc is the image file dvd.img in the working directory, if there is one.  Reads take roughly as long as
+    on a real drive: a seek unless the read follows on from the last one, then DVD_READ_RATE bytes per second.
+*/
+#define DVD_SEEK_MICROSECS 80000
+#define DVD_READ_RATE (6 * 1024 * 1024)
+
+int DI_ReadDVD(void *buf, u32 len, u32 lba) {
+    static FILE *image = NULL;
+    static u32 next_lba = 0;
+    if (!image && !(image = fopen("dvd.img", "rb"))) return -1;
+    usleep((lba != next_lba ? DVD_SEEK_MICROSECS : 0) + (u64)len * 2048 * 1000000 / DVD_READ_RATE);
+    next_lba = lba + len;
+    if (fseeko(image, (off_t)lba * 2048, SEEK_SET)) return -1;
+    return fread(buf, 2048, len, image) == len ? 0 : -1;
+}
+
+s32 dvd_stop() {
+    return 0;
+}
+
+void dvd_unmount() {
+    dvd_cache_invalidate();
+}
+
+s32 dvd_eject() {
+    return -1;
+}
+
+void check_dvd_motor_timeout(u64 now) {
+}
+
+void check_dvd_mount() {
+}
+
+s32 load_from_file(FILE *f, char *arg, const bool *abort) {
+    printf("Not loading %s: DOL loading is not supported on the host.\n", arg);
+    return -ENOSYS;
+}
+
+EXEC_UPLOAD *exec_open(char *arg) {
+    printf("Not receiving %s: DOL loading is not supported on the host.\n", arg);
+    errno = ENOSYS;
+    return NULL;
+}
+
+s32 recv_to_exec(s32 s, EXEC_UPLOAD *upload) {
+    return -ENOSYS;
+}
+
+void exec_close(EXEC_UPLOAD *upload) {
+}
+
+void run_pending_boot() {
+}
+
+bool lock_load_buffer() {
+    return true;
+}
+
+void unlock_load_buffer() {
+}
+
+s32 resize_ram_disk(u32 size) {
+    return -ENOSYS;
+}
+
+void ram_disk_usage(u32 *size, u32 *used) {
+    *size = *used = 0;
+}
+
+/*
+    Like libfat's, the devoptab unlink removes empty directories as well as files.
+*/
+int __real_unlink(const char *path);
+
+int __wrap_unlink(const char *path) {
+    int result = __real_unlink(path);
+    if (result && (errno == EISDIR || errno == EPERM)) result = rmdir(path);
+    return result;
+}
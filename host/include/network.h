@@ -0,0 +1,55 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _HOST_NETWORK_H_
+#define _HOST_NETWORK_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "gctypes.h"
+
+struct pollsd {
+    s32 socket;
+    u32 events;
+    u32 revents;
+};
+
+s32 net_init();
+void net_deinit();
+u32 net_gethostip();
+
+s32 net_socket(u32 domain, u32 type, u32 protocol);
+s32 net_bind(s32 s, struct sockaddr *name, socklen_t namelen);
+s32 net_listen(s32 s, u32 backlog);
+s32 net_accept(s32 s, struct sockaddr *addr, socklen_t *addrlen);
+s32 net_connect(s32 s, struct sockaddr *addr, socklen_t addrlen);
+s32 net_write(s32 s, const void *data, s32 size);
+s32 net_read(s32 s, void *mem, s32 len);
+s32 net_close(s32 s);
+s32 net_fcntl(s32 s, u32 cmd, u32 flags);
+s32 net_poll(struct pollsd *sds, s32 nsds, s32 timeout);
+
+#endif /* _HOST_NETWORK_H_ */
@@ -0,0 +1,49 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _HOST_DISC_IO_H_
+#define _HOST_DISC_IO_H_
+
+#include "../gctypes.h"
+
+typedef u32 sec_t;
+
+typedef bool (*FN_MEDIUM_STARTUP)(void);
+typedef bool (*FN_MEDIUM_ISINSERTED)(void);
+typedef bool (*FN_MEDIUM_READSECTORS)(sec_t sector, sec_t numSectors, void *buffer);
+typedef bool (*FN_MEDIUM_WRITESECTORS)(sec_t sector, sec_t numSectors, const void *buffer);
+typedef bool (*FN_MEDIUM_CLEARSTATUS)(void);
+typedef bool (*FN_MEDIUM_SHUTDOWN)(void);
+
+typedef struct DISC_INTERFACE_STRUCT {
+    unsigned long ioType;
+    unsigned long features;
+    FN_MEDIUM_STARTUP startup;
+    FN_MEDIUM_ISINSERTED isInserted;
+    FN_MEDIUM_READSECTORS readSectors;
+    FN_MEDIUM_WRITESECTORS writeSectors;
+    FN_MEDIUM_CLEARSTATUS clearStatus;
+    FN_MEDIUM_SHUTDOWN shutdown;
+} DISC_INTERFACE;
+
+#endif /* _HOST_DISC_IO_H_ */
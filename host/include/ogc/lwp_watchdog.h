@@ -0,0 +1,43 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _HOST_LWP_WATCHDOG_H_
+#define _HOST_LWP_WATCHDOG_H_
+
+#include "../gctypes.h"
+
+/*
+    On the host a tick is one nanosecond of CLOCK_MONOTONIC.
+*/
+#define secs_to_ticks(sec)          ((u64)(sec) * 1000000000ULL)
+#define millisecs_to_ticks(msec)    ((u64)(msec) * 1000000ULL)
+#define microsecs_to_ticks(usec)    ((u64)(usec) * 1000ULL)
+#define ticks_to_secs(ticks)        ((u64)(ticks) / 1000000000ULL)
+#define ticks_to_millisecs(ticks)   ((u64)(ticks) / 1000000ULL)
+#define ticks_to_microsecs(ticks)   ((u64)(ticks) / 1000ULL)
+#define ticks_to_nanosecs(ticks)    ((u64)(ticks))
+#define diff_ticks(tick0, tick1)    ((tick1) - (tick0))
+
+u64 gettime();
+
+#endif /* _HOST_LWP_WATCHDOG_H_ */
@@ -0,0 +1,44 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _HOST_SYS_DIR_H_
+#define _HOST_SYS_DIR_H_
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <time.h> // newlib's sys/stat.h pulls in time.h
+
+/*
+    newlib's devoptab directory iteration, implemented on top of opendir/readdir.
+*/
+typedef struct {
+    int device;
+    void *dirStruct;
+} DIR_ITER;
+
+DIR_ITER *diropen(const char *path);
+int dirreset(DIR_ITER *dirState);
+int dirnext(DIR_ITER *dirState, char *filename, struct stat *filestat);
+int dirclose(DIR_ITER *dirState);
+
+#endif /* _HOST_SYS_DIR_H_ */
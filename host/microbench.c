@@ -0,0 +1,223 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+/*
+    Microbenchmarks for the per-command hot path: path resolution, parsing and dispatch.
+
+    ftp.c and vrt.c are included directly so that their static functions can be measured.
+    Allocations are counted by wrapping malloc and friends at link time.
+*/
+#include "../source/ftp.c"
+#include "../source/vrt.c"
+
+#include <time.h>
+
+#define TARGET_NS 200000000ULL
+
+static u64 allocations = 0;
+static u64 allocated_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    allocations++;
+    allocated_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+typedef struct {
+    const char *cwd;
+    const char *path;
+} path_case;
+
+/* a mix of the paths sync tools and hand-driven clients send */
+static const path_case paths[] = {
+    { "/", "sd" },
+    { "/", "/sd/apps/ftpii/boot.dol" },
+    { "/sd/", "apps/homebrew_browser/temp/" },
+    { "/sd/apps/", "../private/wii/title/RSPE/data.bin" },
+    { "/sd/private/wii/title/RSPE/", "../../../../../usb/backup" },
+    { "/usb/", "wbfs/Some Rather Long Game Title (USA) [RSPE01]/RSPE01.wbfs" },
+    { "/usb/music/Artist/Album (2008)/", "01 - First Track.mp3" },
+    { "/dvd/", "./files/./sound/../movie/intro.thp" },
+    { "/fst/", "/fst/files/rel/Common.rel" },
+    { "/isfs/title/00000001/", "00000002/content/title.tmd" },
+    { "/", "nosuchpartition/file" },
+    { "/sd/", "a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z" },
+};
+#define NUM_PATHS (sizeof(paths) / sizeof(path_case))
+
+/* a typical session, including client quirks like lower case and LIST flags */
+static const char *command_lines[] = {
+    "USER ftpii", "PASS secret", "SYST", "FEAT", "TYPE I", "PWD",
+    "CWD /sd/apps", "PASV", "LIST -al", "SIZE boot.dol", "MDTM boot.dol", "RETR boot.dol",
+    "PORT 192,168,1,2,195,80", "STOR /sd/apps/ftpii/meta.xml", "retr icon.png", "NOOP",
+    "REST 1048576", "DELE old.txt", "MKD new folder with spaces", "SITE CHMOD 755 boot.dol",
+    "RNFR a.txt", "RNTO b.txt", "CDUP", "XYZZY unknown command",
+};
+#define NUM_COMMANDS (sizeof(command_lines) / sizeof(char *))
+
+static char pipelined[FTP_BUFFER_SIZE];
+static client_t bench_client;
+static ftp_command nop_commands[64];
+static dispatch_table nop_dispatch = { "", nop_commands };
+
+static s32 nop_handler(client_t *client, char *args) {
+    return 0;
+}
+
+static void *nop_path_func(char *path, ...) {
+    return NULL;
+}
+
+static s32 nop_data_callback(s32 data_socket, void *arg) {
+    return 0;
+}
+
+static void bench_virtual_abspath(u32 i) {
+    const path_case *p = paths + i % NUM_PATHS;
+    free(virtual_abspath((char *)p->cwd, (char *)p->path));
+}
+
+static void bench_to_real_path(u32 i) {
+    const path_case *p = paths + i % NUM_PATHS;
+    char *real_path = to_real_path((char *)p->cwd, (char *)p->path);
+    if (real_path && *real_path) free(real_path);
+}
+
+static void bench_with_virtual_path(u32 i) {
+    const path_case *p = paths + i % NUM_PATHS;
+    with_virtual_path((char *)p->cwd, nop_path_func, (char *)p->path, -1, &i, NULL);
+}
+
+/*
+    split and dispatch_to_handler work in place, so these include copying the line into a buffer.
+*/
+static void bench_split(u32 i) {
+    char line[FTP_BUFFER_SIZE];
+    char *args[2];
+    strcpy(line, command_lines[i % NUM_COMMANDS]);
+    split(line, ' ', 1, args);
+}
+
+static void bench_dispatch(u32 i) {
+    char line[FTP_BUFFER_SIZE];
+    strcpy(line, command_lines[i % NUM_COMMANDS]);
+    dispatch_to_handler(&bench_client, line, &nop_dispatch);
+}
+
+/*
+    A buffer of pipelined commands queued behind a transfer, which are scanned but not executed.
+*/
+static void bench_scan_pipelined(u32 i) {
+    u32 length = strlen(pipelined);
+    memcpy(bench_client.buf, pipelined, length);
+    bench_client.buf_start = 0;
+    bench_client.buf_length = length;
+    bench_client.buf_scanned = 0;
+    bench_client.num_queued = 0;
+    bench_client.queued_bytes = 0;
+    process_buffered_commands(&bench_client);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(u32 i);
+} benchmark;
+
+static const benchmark benchmarks[] = {
+    { "virtual_abspath", bench_virtual_abspath },
+    { "to_real_path", bench_to_real_path },
+    { "with_virtual_path", bench_with_virtual_path },
+    { "split", bench_split },
+    { "dispatch_to_handler", bench_dispatch },
+    { "scan_pipelined_commands", bench_scan_pipelined },
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmark))
+
+static u64 run_timed(const benchmark *b, u32 iterations) {
+    u64 start = gettime();
+    u32 i;
+    for (i = 0; i < iterations; i++) b->run(i);
+    return gettime() - start;
+}
+
+static void setup() {
+    u32 i;
+    for (i = 0; i == 0 || nop_commands[i - 1].name; i++) {
+        nop_commands[i].name = authenticated_commands[i].name;
+        nop_commands[i].handler = nop_handler;
+    }
+
+    memset(&bench_client, 0, sizeof(bench_client));
+    bench_client.socket = -1;
+    bench_client.passive_socket = -1;
+    bench_client.data_socket = -1;
+    bench_client.authenticated = true;
+    strcpy(bench_client.cwd, "/sd/");
+    bench_client.data_callback = nop_data_callback;
+
+    *pipelined = '\0';
+    for (i = 0; i < MAX_QUEUED_COMMANDS && strlen(pipelined) + strlen(command_lines[i % NUM_COMMANDS]) + CRLF_LENGTH <= FTP_BUFFER_SIZE - URGENT_RESERVE; i++) {
+        strcat(pipelined, command_lines[i % NUM_COMMANDS]);
+        strcat(pipelined, CRLF);
+    }
+}
+
+/*
+    microbench [filter]
+    Runs each benchmark (or those whose name contains filter) for about 200ms and reports
+    "<name> <iterations> <ns/op> <allocs/op> <bytes/op>" lines.
+*/
+int main(int argc, char **argv) {
+    setup();
+    printf("%-28s %12s %10s %10s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+    u32 i;
+    for (i = 0; i < NUM_BENCHMARKS; i++) {
+        const benchmark *b = benchmarks + i;
+        if (argc > 1 && !strstr(b->name, argv[1])) continue;
+        u32 iterations = 1000;
+        u64 elapsed;
+        while ((elapsed = run_timed(b, iterations)) < TARGET_NS / 10 && iterations < 0x10000000) iterations *= 10;
+        iterations = (u32)((double)iterations * TARGET_NS / (elapsed ? elapsed : 1)) + 1;
+        allocations = allocated_bytes = 0;
+        elapsed = run_timed(b, iterations);
+        printf("%-28s %12u %10.1f %10.2f %10.1f\n", b->name, iterations, (double)elapsed / iterations,
+            (double)allocations / iterations, (double)allocated_bytes / iterations);
+    }
+    return 0;
+}
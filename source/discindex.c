@@ -0,0 +1,395 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <ctype.h>
+#include <errno.h>
+#include <malloc.h>
+#include <ogc/mutex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "discindex.h"
+
+#define NUM_DISC_PARTITIONS 3
+#define MAX_INDEX_ENTRIES (1 << 20)
+#define NO_ENTRY 0xffffffff
+
+static const u32 DISC_INDEX_DEVICE_ID = 38747;
+
+typedef struct {
+    u32 name; // offset in the string table
+    u32 parent;
+    u32 first_child; // a directory's children are contiguous, in the order the filesystem listed them
+    u32 num_children;
+    u32 hash; // of the path relative to the partition, see hash_path()
+    u32 next; // the next entry in the same hash bucket
+    u32 mode;
+    u32 mtime;
+    u64 size;
+} index_entry;
+
+/*
+    Entry 0 is the root of the partition.  Iterators hold references to the index, so it is only
+    freed once it has been dropped and every iterator over it has been closed.
+*/
+typedef struct {
+    VIRTUAL_PARTITION *partition;
+    u32 refs;
+    index_entry *entries;
+    u32 num_entries;
+    char *strings;
+    u32 strings_size;
+    u32 strings_capacity;
+    u32 *buckets;
+    u32 bucket_mask;
+} disc_index;
+
+typedef struct {
+    DIR_ITER iter; // first, so that the DIR_ITER handed out can be cast back
+    disc_index *index;
+    u32 next;
+    u32 end;
+} index_iter;
+
+static disc_index *indexes[NUM_DISC_PARTITIONS];
+static mutex_t index_mutex = LWP_MUTEX_NULL;
+
+static VIRTUAL_PARTITION **disc_partitions[NUM_DISC_PARTITIONS] = { &PA_DVD, &PA_WOD, &PA_FST };
+
+static s32 disc_partition_slot(VIRTUAL_PARTITION *partition) {
+    u32 i;
+    for (i = 0; i < NUM_DISC_PARTITIONS; i++) {
+        if (*disc_partitions[i] == partition) return i;
+    }
+    return -1;
+}
+
+/*
+    Returns the slot of the disc partition containing path, and stores a pointer to the rest of the path in rest.
+*/
+static s32 path_slot(const char *path, const char **rest) {
+    u32 i;
+    for (i = 0; i < NUM_DISC_PARTITIONS; i++) {
+        const char *prefix = (*disc_partitions[i])->prefix;
+        size_t prefix_length = strlen(prefix);
+        if (!strncmp(prefix, path, prefix_length)) {
+            *rest = path + prefix_length;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+    The disc filesystems match names case-insensitively, so the index does too.
+*/
+static u32 hash_chars(u32 hash, const char *s, size_t length) {
+    while (length--) hash = (hash ^ (u8)tolower((u8)*s++)) * 16777619u;
+    return hash;
+}
+
+static const u32 HASH_SEED = 2166136261u;
+
+static u32 child_hash(index_entry *parent, const char *name, bool parent_is_root) {
+    u32 hash = parent_is_root ? HASH_SEED : hash_chars(parent->hash, "/", 1);
+    return hash_chars(hash, name, strlen(name));
+}
+
+static bool is_dot_entry(const char *name) {
+    return !strcmp(".", name) || !strcmp("..", name);
+}
+
+static void free_index(disc_index *index) {
+    free(index->entries);
+    free(index->strings);
+    free(index->buckets);
+    free(index);
+}
+
+static void release_index(disc_index *index) {
+    LWP_MutexLock(index_mutex);
+    bool last = !--index->refs;
+    LWP_MutexUnlock(index_mutex);
+    if (last) free_index(index);
+}
+
+static disc_index *acquire_index(s32 slot) {
+    LWP_MutexLock(index_mutex);
+    disc_index *index = indexes[slot];
+    if (index) index->refs++;
+    LWP_MutexUnlock(index_mutex);
+    return index;
+}
+
+/*
+    Stores the full path of an entry in path, which must hold MAXPATHLEN characters.
+*/
+static bool entry_path(disc_index *index, u32 entry, char *path) {
+    char *end = path + MAXPATHLEN - 1;
+    *end = '\0';
+    for (; entry; entry = index->entries[entry].parent) {
+        const char *name = index->strings + index->entries[entry].name;
+        size_t length = strlen(name) + 1;
+        if (end - path < length) return false;
+        end -= length;
+        *end = '/';
+        memcpy(end + 1, name, length - 1);
+    }
+    const char *prefix = index->partition->prefix;
+    size_t prefix_length = strlen(prefix);
+    if (*end == '/') end++;
+    if (end - path < prefix_length) return false;
+    memmove(path + prefix_length, end, strlen(end) + 1);
+    memcpy(path, prefix, prefix_length);
+    return true;
+}
+
+static bool append_entry(disc_index *index, u32 *capacity, u32 parent, const char *name, struct stat *st) {
+    if (index->num_entries == *capacity) {
+        if (*capacity == MAX_INDEX_ENTRIES) return false;
+        u32 grown_capacity = *capacity ? *capacity * 2 : 256;
+        index_entry *grown = realloc(index->entries, grown_capacity * sizeof(index_entry));
+        if (!grown) return false;
+        index->entries = grown;
+        *capacity = grown_capacity;
+    }
+    size_t name_size = strlen(name) + 1;
+    if (index->strings_size + name_size > index->strings_capacity) {
+        u32 grown_capacity = index->strings_capacity ? index->strings_capacity * 2 : 4096;
+        while (grown_capacity < index->strings_size + name_size) grown_capacity *= 2;
+        char *grown = realloc(index->strings, grown_capacity);
+        if (!grown) return false;
+        index->strings = grown;
+        index->strings_capacity = grown_capacity;
+    }
+    memcpy(index->strings + index->strings_size, name, name_size);
+
+    index_entry *entry = index->entries + index->num_entries++;
+    entry->name = index->strings_size;
+    index->strings_size += name_size;
+    entry->parent = parent;
+    entry->first_child = NO_ENTRY;
+    entry->num_children = 0;
+    entry->hash = parent == NO_ENTRY ? HASH_SEED : child_hash(index->entries + parent, name, !parent);
+    entry->mode = st->st_mode;
+    entry->mtime = st->st_mtime;
+    entry->size = st->st_size;
+    return true;
+}
+
+/*
+    Reads the whole tree breadth-first, so that each directory's children are appended together.
+*/
+static bool read_tree(disc_index *index) {
+    struct stat st;
+    u32 capacity = 0;
+    if (stat(index->partition->prefix, &st) || !append_entry(index, &capacity, NO_ENTRY, "", &st)) return false;
+    index->entries[0].mode |= S_IFDIR;
+
+    char path[MAXPATHLEN], filename[MAXPATHLEN];
+    u32 i;
+    for (i = 0; i < index->num_entries; i++) {
+        index_entry *entry = index->entries + i;
+        if (!(entry->mode & S_IFDIR) || (i && is_dot_entry(index->strings + entry->name))) continue;
+        if (!entry_path(index, i, path)) continue;
+        DIR_ITER *dir = diropen(path);
+        if (!dir) continue;
+        u32 first_child = index->num_entries;
+        bool complete = true;
+        while (complete && !dirnext(dir, filename, &st)) complete = append_entry(index, &capacity, i, filename, &st);
+        dirclose(dir);
+        if (!complete) return false;
+        index->entries[i].first_child = first_child;
+        index->entries[i].num_children = index->num_entries - first_child;
+    }
+    return true;
+}
+
+static bool hash_entries(disc_index *index) {
+    u32 num_buckets = 1;
+    while (num_buckets < index->num_entries) num_buckets <<= 1;
+    if (!(index->buckets = malloc(num_buckets * sizeof(u32)))) return false;
+    index->bucket_mask = num_buckets - 1;
+    memset(index->buckets, 0xff, num_buckets * sizeof(u32));
+    u32 i;
+    for (i = 0; i < index->num_entries; i++) {
+        index_entry *entry = index->entries + i;
+        if (i && is_dot_entry(index->strings + entry->name)) continue;
+        u32 *bucket = index->buckets + (entry->hash & index->bucket_mask);
+        entry->next = *bucket;
+        *bucket = i;
+    }
+    return true;
+}
+
+void initialise_disc_index() {
+    LWP_MutexInit(&index_mutex, false);
+}
+
+/*
+    Discs whose trees cannot be read completely, or have more than MAX_INDEX_ENTRIES entries, are not indexed.
+*/
+void build_disc_index(VIRTUAL_PARTITION *partition) {
+    s32 slot = disc_partition_slot(partition);
+    if (slot < 0) return;
+    drop_disc_index(partition);
+    disc_index *index = calloc(1, sizeof(disc_index));
+    if (!index) return;
+    index->partition = partition;
+    index->refs = 1;
+    if (!read_tree(index) || !hash_entries(index)) {
+        printf("Unable to index %s, looking up paths on the disc instead.\n", partition->name);
+        free_index(index);
+        return;
+    }
+    index_entry *shrunk_entries = realloc(index->entries, index->num_entries * sizeof(index_entry));
+    if (shrunk_entries) index->entries = shrunk_entries;
+    char *shrunk_strings = realloc(index->strings, index->strings_size);
+    if (shrunk_strings) index->strings = shrunk_strings;
+    printf("Indexed %u entries of %s in %u bytes.\n", index->num_entries, partition->name,
+        (u32)(index->num_entries * sizeof(index_entry) + index->strings_size + (index->bucket_mask + 1) * sizeof(u32)));
+    LWP_MutexLock(index_mutex);
+    indexes[slot] = index;
+    LWP_MutexUnlock(index_mutex);
+}
+
+void drop_disc_index(VIRTUAL_PARTITION *partition) {
+    s32 slot = disc_partition_slot(partition);
+    if (slot < 0) return;
+    LWP_MutexLock(index_mutex);
+    disc_index *index = indexes[slot];
+    indexes[slot] = NULL;
+    LWP_MutexUnlock(index_mutex);
+    if (index) release_index(index);
+}
+
+bool is_disc_path(const char *path) {
+    const char *rest;
+    return path_slot(path, &rest) >= 0;
+}
+
+/*
+    Compares the entry's path, from its last component back to the root, with the first length characters of path.
+*/
+static bool entry_matches(disc_index *index, u32 entry, const char *path, size_t length) {
+    while (entry) {
+        index_entry *e = index->entries + entry;
+        const char *name = index->strings + e->name;
+        size_t name_length = strlen(name);
+        if (name_length > length || strncasecmp(path + length - name_length, name, name_length)) return false;
+        length -= name_length;
+        entry = e->parent;
+        if (entry) {
+            if (!length || path[length - 1] != '/') return false;
+            length--;
+        }
+    }
+    return !length;
+}
+
+static u32 find_entry(disc_index *index, const char *rest) {
+    size_t length = strlen(rest);
+    while (length && rest[length - 1] == '/') length--;
+    if (!length) return 0;
+    u32 hash = hash_chars(HASH_SEED, rest, length);
+    u32 entry;
+    for (entry = index->buckets[hash & index->bucket_mask]; entry != NO_ENTRY; entry = index->entries[entry].next) {
+        if (index->entries[entry].hash == hash && entry_matches(index, entry, rest, length)) return entry;
+    }
+    return NO_ENTRY;
+}
+
+static void entry_stat(index_entry *entry, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = entry->mode;
+    st->st_mtime = entry->mtime;
+    st->st_size = entry->size;
+    st->st_nlink = 1;
+}
+
+int disc_index_stat(const char *path, struct stat *st) {
+    const char *rest;
+    s32 slot = path_slot(path, &rest);
+    disc_index *index = slot >= 0 ? acquire_index(slot) : NULL;
+    if (!index) return stat(path, st);
+    u32 entry = find_entry(index, rest);
+    if (entry != NO_ENTRY) entry_stat(index->entries + entry, st);
+    release_index(index);
+    if (entry == NO_ENTRY) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+DIR_ITER *disc_index_diropen(const char *path) {
+    const char *rest;
+    s32 slot = path_slot(path, &rest);
+    disc_index *index = slot >= 0 ? acquire_index(slot) : NULL;
+    if (!index) return diropen(path);
+    u32 entry = find_entry(index, rest);
+    if (entry == NO_ENTRY || !(index->entries[entry].mode & S_IFDIR)) {
+        release_index(index);
+        errno = entry == NO_ENTRY ? ENOENT : ENOTDIR;
+        return NULL;
+    }
+    index_iter *iter = malloc(sizeof(index_iter));
+    if (!iter) {
+        release_index(index);
+        errno = ENOMEM;
+        return NULL;
+    }
+    iter->iter.device = DISC_INDEX_DEVICE_ID;
+    iter->iter.dirStruct = NULL;
+    iter->index = index;
+    iter->next = index->entries[entry].first_child;
+    iter->end = iter->next + index->entries[entry].num_children;
+    return &iter->iter;
+}
+
+bool is_disc_index_iter(DIR_ITER *iter) {
+    return iter->device == DISC_INDEX_DEVICE_ID;
+}
+
+int disc_index_dirnext(DIR_ITER *iter, char *filename, struct stat *st) {
+    if (!is_disc_index_iter(iter)) return dirnext(iter, filename, st);
+    index_iter *indexed = (index_iter *)iter;
+    if (indexed->next == indexed->end) {
+        errno = ENOENT;
+        return -1;
+    }
+    index_entry *entry = indexed->index->entries + indexed->next++;
+    strcpy(filename, indexed->index->strings + entry->name);
+    entry_stat(entry, st);
+    return 0;
+}
+
+int disc_index_dirclose(DIR_ITER *iter) {
+    if (!is_disc_index_iter(iter)) return dirclose(iter);
+    index_iter *indexed = (index_iter *)iter;
+    release_index(indexed->index);
+    free(indexed);
+    return 0;
+}
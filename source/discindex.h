@@ -0,0 +1,54 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _DISCINDEX_H_
+#define _DISCINDEX_H_
+
+#include <sys/dir.h>
+
+#include "fs.h"
+
+/*
+    An index of every path on a mounted disc filesystem (/dvd, /wod and /fst), built once when it is mounted,
+    since those filesystems never change while mounted.  Entries are kept in one flat array, with each directory's
+    children contiguous and names in a shared string table, and full paths are found through a hash table, so
+    stat and directory listings do not walk the on-disc directory structures.
+    The disc_index_* functions behave like the standard calls they are named after, for paths on those partitions,
+    and pass through to them while a partition has no index.
+*/
+void initialise_disc_index();
+
+void build_disc_index(VIRTUAL_PARTITION *partition);
+
+void drop_disc_index(VIRTUAL_PARTITION *partition);
+
+bool is_disc_path(const char *path);
+
+bool is_disc_index_iter(DIR_ITER *iter);
+
+int disc_index_stat(const char *path, struct stat *st);
+DIR_ITER *disc_index_diropen(const char *path);
+int disc_index_dirnext(DIR_ITER *iter, char *filename, struct stat *st);
+int disc_index_dirclose(DIR_ITER *iter);
+
+#endif /* _DISCINDEX_H_ */
@@ -36,47 +36,60 @@ following comment:
 
 extern void __exception_closeall();
 
-typedef struct {
-    u32 text_pos[7];
-    u32 data_pos[11];
-    u32 text_start[7];
-    u32 data_start[11];
-    u32 text_size[7];
-    u32 data_size[11];
-    u32 bss_start;
-    u32 bss_size;
-    u32 entry_point;
-} dolheader;
-
-static u32 load_dol_image(const void *dolstart, struct __argv *argv) {
+static u32 load_dol_image(const void *dolstart) {
     dolheader *dolfile = (dolheader *)dolstart;
     u32 i;
-    for (i = 0; i < 7; i++) {
+    for (i = 0; i < DOL_TEXT_SECTIONS; i++) {
         if (!dolfile->text_size[i] || dolfile->text_start[i] < 0x100) continue;
         ICInvalidateRange((void *)dolfile->text_start[i], dolfile->text_size[i]);
         memmove((void *)dolfile->text_start[i], dolstart+dolfile->text_pos[i], dolfile->text_size[i]);
     }
-    for (i = 0; i < 11; i++) {
+    for (i = 0; i < DOL_DATA_SECTIONS; i++) {
         if (!dolfile->data_size[i] || dolfile->data_start[i] < 0x100) continue;
         memmove((void *)dolfile->data_start[i], dolstart+dolfile->data_pos[i], dolfile->data_size[i]);
         DCFlushRangeNoSync((void *)dolfile->data_start[i], dolfile->data_size[i]);
     }
+    return dolfile->entry_point;
+}
+
+/*
+    Whether the size bytes at dol start with a DOL header whose sections all lie within them.
+    Only the header is read, so it can be checked on its own against the size of the whole file.
+*/
+bool is_valid_dol(const void *dol, u32 size) {
+    if (size < sizeof(dolheader)) return false;
+    const dolheader *dolfile = (const dolheader *)dol;
+    u32 i;
+    for (i = 0; i < DOL_TEXT_SECTIONS; i++) {
+        if (!dolfile->text_size[i]) continue;
+        if (dolfile->text_pos[i] > size || dolfile->text_size[i] > size - dolfile->text_pos[i]) return false;
+    }
+    for (i = 0; i < DOL_DATA_SECTIONS; i++) {
+        if (!dolfile->data_size[i]) continue;
+        if (dolfile->data_pos[i] > size || dolfile->data_size[i] > size - dolfile->data_pos[i]) return false;
+    }
+    return dolfile->entry_point != 0;
+}
 
+/*
+    Boots a DOL whose sections are already at their load addresses.
+*/
+void run_loaded_dol(u32 entry_point, struct __argv *argv) {
     if (argv && argv->argvMagic == ARGV_MAGIC) {
-        void *new_argv = (void *)(dolfile->entry_point + 8);
+        void *new_argv = (void *)(entry_point + 8);
         memmove(new_argv, argv, sizeof(*argv));
         DCFlushRange(new_argv, sizeof(*argv));
     }
 
-    return dolfile->entry_point;
-}
-
-void run_dol(const void *dol, struct __argv *argv) {
     u32 level;
-    void (*ep)() = (void(*)())load_dol_image(dol, argv);
+    void (*ep)() = (void(*)())entry_point;
     __IOS_ShutdownSubsystems();
     _CPU_ISR_Disable(level);
     __exception_closeall();
     ep();
     _CPU_ISR_Restore(level);
 }
+
+void run_dol(const void *dol, struct __argv *argv) {
+    run_loaded_dol(load_dol_image(dol), argv);
+}
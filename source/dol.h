@@ -28,6 +28,25 @@ misrepresented as being the original software.
 
 #include <gctypes.h>
 
+#define DOL_TEXT_SECTIONS 7
+#define DOL_DATA_SECTIONS 11
+
+typedef struct {
+    u32 text_pos[DOL_TEXT_SECTIONS];
+    u32 data_pos[DOL_DATA_SECTIONS];
+    u32 text_start[DOL_TEXT_SECTIONS];
+    u32 data_start[DOL_DATA_SECTIONS];
+    u32 text_size[DOL_TEXT_SECTIONS];
+    u32 data_size[DOL_DATA_SECTIONS];
+    u32 bss_start;
+    u32 bss_size;
+    u32 entry_point;
+} dolheader;
+
+bool is_valid_dol(const void *dol, u32 size);
+
+void run_loaded_dol(u32 entry_point, struct __argv *argv);
+
 void run_dol(const void *dol, struct __argv *argv);
 
 #endif /* _DOL_H */
@@ -29,13 +29,18 @@ misrepresented as being the original software.
 #include <stdio.h>
 #include <wod/wod.h>
 
+#include "discindex.h"
 #include "dvd.h"
+#include "dvdcache.h"
 #include "fs.h"
+#include "worker.h"
 
 #define DVD_MOTOR_TIMEOUT 300
 
 static bool _dvd_mountWait = false;
 static u64 dvd_last_stopped = 0;
+static u64 dvd_last_raw_access = 0;
+static transfer_job *disc_mount_job = NULL;
 
 bool dvd_mountWait() {
     return _dvd_mountWait;
@@ -46,7 +51,14 @@ void set_dvd_mountWait(bool state) {
 }
 
 u64 dvd_last_access() {
-    return MAX(MAX(ISO9660_LastAccess(), WOD_LastAccess()), FST_LastAccess());
+    return MAX(MAX(MAX(ISO9660_LastAccess(), WOD_LastAccess()), FST_LastAccess()), dvd_last_raw_access);
+}
+
+/*
+    Records a DI command.  Every disc read passes through the DVD cache, which calls this as it dispatches one.
+*/
+void set_dvd_last_access(u64 now) {
+    dvd_last_raw_access = now;
 }
 
 s32 dvd_stop() {
@@ -58,6 +70,7 @@ void dvd_unmount() {
     unmount(PA_WOD);
     unmount(PA_FST);
     unmount(PA_DVD);
+    dvd_cache_invalidate();
     dvd_stop();
 }
 
@@ -74,16 +87,36 @@ void check_dvd_motor_timeout(u64 now) {
     }
 }
 
+/*
+    Reading the filesystems and indexing their trees takes seconds on a large disc, so it runs on the DVD worker,
+    where it only holds up other operations on the disc.  Until an index is built, lookups go to the disc itself.
+    dvd_mountWait() stays set until the job has finished, which keeps the DVD from being unmounted meanwhile.
+*/
+static s32 mount_disc(s32 unused, void *unused_arg) {
+    bool wod = false, fst = false, iso = false;
+    printf("Mounting %s...", PA_WOD->name);
+    printf((wod = WOD_Mount()) ? "succeeded.\n" : "failed.\n");
+    printf("Mounting %s...", PA_FST->name);
+    printf((fst = FST_Mount()) ? "succeeded.\n" : "failed.\n");
+    printf("Mounting %s...", PA_DVD->name);
+    printf((iso = ISO9660_Mount()) ? "succeeded.\n" : "failed.\n");
+    if (wod) build_disc_index(PA_WOD);
+    if (fst) build_disc_index(PA_FST);
+    if (iso) build_disc_index(PA_DVD);
+    if (!(wod || fst || iso)) dvd_stop();
+    return 0;
+}
+
 void check_dvd_mount() {
-    if (dvd_mountWait() && DI_GetStatus() & DVD_READY) {
+    s32 result;
+    if (disc_mount_job) {
+        if (!finish_job(disc_mount_job, &result)) return;
+        disc_mount_job = NULL;
         set_dvd_mountWait(false);
-        bool wod = false, fst = false, iso = false;
-        printf("Mounting %s...", PA_WOD->name);
-        printf((wod = WOD_Mount()) ? "succeeded.\n" : "failed.\n");
-        printf("Mounting %s...", PA_FST->name);
-        printf((fst = FST_Mount()) ? "succeeded.\n" : "failed.\n");
-        printf("Mounting %s...", PA_DVD->name);
-        printf((iso = ISO9660_Mount()) ? "succeeded.\n" : "failed.\n");
-        if (!(wod || fst || iso)) dvd_stop();
+    } else if (dvd_mountWait() && DI_GetStatus() & DVD_READY) {
+        if (!(disc_mount_job = start_job(DEVICE_DVD, mount_disc, -1, NULL))) {
+            mount_disc(-1, NULL);
+            set_dvd_mountWait(false);
+        }
     }
 }
@@ -30,6 +30,8 @@ void set_dvd_mountWait(bool state);
 
 u64 dvd_last_access();
 
+void set_dvd_last_access(u64 now);
+
 s32 dvd_stop();
 
 void dvd_unmount();
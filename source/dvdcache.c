@@ -0,0 +1,216 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <gccore.h>
+#include <ogc/cond.h>
+#include <ogc/lwp_watchdog.h>
+#include <ogc/mutex.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dvd.h"
+#include "dvdcache.h"
+#include "stats.h"
+
+#define DVD_SECTOR_SIZE 2048
+#define LINE_SECTORS 16 // 32KB, the size of a Wii disc cluster
+#define LINE_SIZE (LINE_SECTORS * DVD_SECTOR_SIZE)
+#define NUM_LINES 256 // 8MB
+#define READAHEAD_LINES 16 // 512KB per DI command once a stream is sequential...
+#define MAX_READAHEAD_LINES 32 // ...and up to 1MB while several streams compete for the drive
+#define MAX_STREAMS 4
+#define STREAM_ACTIVE_SECS 1
+#define NO_LINE 0xffffffff
+
+typedef struct {
+    u32 lba; // first sector, a multiple of LINE_SECTORS, or NO_LINE
+} cache_line;
+
+typedef struct {
+    u32 next_lba;
+    u64 last_used;
+} read_stream;
+
+static u8 *cache_data = NULL;
+static cache_line lines[NUM_LINES];
+static u32 next_line = 0;
+static u32 generation = 0;
+static read_stream streams[MAX_STREAMS];
+static mutex_t cache_mutex = LWP_MUTEX_NULL;
+
+static cond_t drive_cond = LWP_COND_NULL;
+static bool drive_busy = false;
+
+int __real_DI_ReadDVD(void *buf, u32 len, u32 lba);
+
+void dvd_cache_invalidate() {
+    if (cache_mutex != LWP_MUTEX_NULL) LWP_MutexLock(cache_mutex);
+    u32 i;
+    for (i = 0; i < NUM_LINES; i++) lines[i].lba = NO_LINE;
+    for (i = 0; i < MAX_STREAMS; i++) streams[i].next_lba = NO_LINE;
+    next_line = 0;
+    generation++;
+    if (cache_mutex != LWP_MUTEX_NULL) LWP_MutexUnlock(cache_mutex);
+}
+
+/*
+    The cache is taken from the top of MEM2, out of the way of the heap, which grows upwards into MEM2 from its bottom.
+*/
+void initialise_dvd_cache() {
+    if (LWP_MutexInit(&cache_mutex, false) < 0 || LWP_CondInit(&drive_cond) < 0) {
+        printf("Unable to create DVD cache lock, DVD reads will not be cached.\n");
+        return;
+    }
+    dvd_cache_invalidate();
+    u8 *hi = SYS_GetArena2Hi(), *lo = SYS_GetArena2Lo();
+    if (hi - lo < NUM_LINES * LINE_SIZE) {
+        printf("Not enough MEM2 for the DVD cache, DVD reads will not be cached.\n");
+        return;
+    }
+    cache_data = hi - NUM_LINES * LINE_SIZE; // the arena bounds are 32-byte aligned, as is LINE_SIZE
+    SYS_SetArena2Hi(cache_data);
+}
+
+/*
+    Returns the number of lines to read on a miss: one for random access, or a run that grows with the number of
+    active streams for a read that continues one of them, so that each stream gets a large batch per seek.
+*/
+static u32 readahead_lines(u32 lba, u32 len) {
+    u64 now = gettime();
+    read_stream *oldest = streams, *continued = NULL;
+    u32 active = 0;
+    u32 i;
+    for (i = 0; i < MAX_STREAMS; i++) {
+        read_stream *stream = streams + i;
+        if (stream->next_lba == lba) continued = stream;
+        if (stream->next_lba != NO_LINE && now - stream->last_used < secs_to_ticks(STREAM_ACTIVE_SECS)) active++;
+        if (stream->last_used < oldest->last_used) oldest = stream;
+    }
+    read_stream *stream = continued ? continued : oldest;
+    stream->next_lba = lba + len;
+    stream->last_used = now;
+    if (!continued) return 1;
+    u32 run = READAHEAD_LINES * (active ? active : 1);
+    return run < MAX_READAHEAD_LINES ? run : MAX_READAHEAD_LINES;
+}
+
+static cache_line *find_line(u32 line_lba) {
+    u32 i;
+    for (i = 0; i < NUM_LINES; i++) {
+        if (lines[i].lba == line_lba) return lines + i;
+    }
+    return NULL;
+}
+
+/*
+    Waits, with cache_mutex held, until the drive is free.  Disc reads are normally all made by the DVD worker, so
+    this only has to keep out the odd job that the main thread runs itself when every queued job is in use.
+*/
+static void acquire_drive() {
+    while (drive_busy) LWP_CondWait(drive_cond, cache_mutex);
+    drive_busy = true;
+}
+
+static void release_drive() {
+    drive_busy = false;
+    LWP_CondBroadcast(drive_cond);
+}
+
+/*
+    Issues a DI command while holding the drive, with cache_mutex released so that cache hits can be served meanwhile.
+*/
+static int read_from_drive(void *buf, u32 len, u32 lba) {
+    LWP_MutexUnlock(cache_mutex);
+    set_dvd_last_access(gettime());
+    stats_increment(STAT_DVD_READS);
+    int result = __real_DI_ReadDVD(buf, len, lba);
+    LWP_MutexLock(cache_mutex);
+    return result;
+}
+
+/*
+    Reads up to run lines starting at line_lba into consecutive cache lines, with one DI command, stopping short of
+    lines that are already cached.  A run that fails, e.g. by extending past the end of the disc, is retried as a
+    single line.  Returns the first line read, or NULL if it could not be read or the cache was invalidated meanwhile.
+*/
+static cache_line *fill_lines(u32 line_lba, u32 run) {
+    u32 count;
+    for (count = 1; count < run && !find_line(line_lba + count * LINE_SECTORS); count++);
+    u32 read_generation = generation;
+    while (1) {
+        if (next_line + count > NUM_LINES) next_line = 0;
+        u32 first = next_line, i;
+        for (i = 0; i < count; i++) lines[first + i].lba = NO_LINE;
+        next_line += count;
+        int result = read_from_drive(cache_data + first * LINE_SIZE, count * LINE_SECTORS, line_lba);
+        if (generation != read_generation) return NULL;
+        if (!result) {
+            for (i = 0; i < count; i++) lines[first + i].lba = line_lba + i * LINE_SECTORS;
+            return lines + first;
+        }
+        next_line = first;
+        if (count == 1) return NULL;
+        count = 1;
+    }
+}
+
+/*
+    Cache hits are copied out under cache_mutex.  Misses hold the drive, one reader at a time; lines that are being filled are invisible until the read completes, and a line is only ever reused
+    by the drive's holder with cache_mutex held, so hits never see a partial line.
+*/
+int __wrap_DI_ReadDVD(void *buf, u32 len, u32 lba) {
+    if (!cache_data) {
+        set_dvd_last_access(gettime());
+        return __real_DI_ReadDVD(buf, len, lba);
+    }
+    LWP_MutexLock(cache_mutex);
+    u32 run = readahead_lines(lba, len);
+    u8 *out = buf;
+    int result = 0;
+    while (len) {
+        u32 line_lba = lba & ~(LINE_SECTORS - 1);
+        cache_line *line = find_line(line_lba);
+        if (line) {
+            stats_increment(STAT_DVD_CACHE_HITS);
+        } else {
+            stats_increment(STAT_DVD_CACHE_MISSES);
+            acquire_drive();
+            if (!(line = find_line(line_lba)) && !(line = fill_lines(line_lba, run))) {
+                // e.g. the final partial line of the disc, read the rest without caching it
+                result = read_from_drive(out, len, lba);
+                release_drive();
+                break;
+            }
+            release_drive();
+        }
+        u32 offset = lba - line_lba;
+        u32 count = LINE_SECTORS - offset;
+        if (count > len) count = len;
+        memcpy(out, cache_data + (line - lines) * LINE_SIZE + offset * DVD_SECTOR_SIZE, count * DVD_SECTOR_SIZE);
+        out += count * DVD_SECTOR_SIZE;
+        lba += count;
+        len -= count;
+    }
+    LWP_MutexUnlock(cache_mutex);
+    return result;
+}
@@ -0,0 +1,37 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _DVDCACHE_H_
+#define _DVDCACHE_H_
+
+#include <gctypes.h>
+
+/*
+    A sector cache in MEM2 in front of DI_ReadDVD, which the disc filesystems, raw.c and everything else reach
+    through the linker's --wrap.  Sequential streams are read ahead in large aligned runs.
+*/
+void initialise_dvd_cache();
+
+void dvd_cache_invalidate();
+
+#endif /* _DVDCACHE_H_ */
@@ -44,24 +44,30 @@ misrepresented as being the original software.
 #include <wiiuse/wpad.h>
 #include <wod/wod.h>
 
+#include "discindex.h"
 #include "dvd.h"
 #include "fs.h"
+#include "isfscache.h"
+#include "ramdisk.h"
+#include "stats.h"
+#include "worker.h"
 
 #define CACHE_PAGES 8
 #define CACHE_SECTORS_PER_PAGE 64
 
 VIRTUAL_PARTITION VIRTUAL_PARTITIONS[] = {
-    { "SD Gecko A", "/carda", "carda", "carda:/", false, false, &__io_gcsda },
-    { "SD Gecko B", "/cardb", "cardb", "cardb:/", false, false, &__io_gcsdb },
-    { "Front SD", "/sd", "sd", "sd:/", false, false, &__io_wiisd },
-    { "USB storage device", "/usb", "usb", "usb:/", false, false, &__io_usbstorage },
-    { "ISO9660 filesystem", "/dvd", "dvd", "dvd:/", false, false, NULL },
-    { "Wii disc image", "/wod", "wod", "wod:/", false, false, NULL },
-    { "Wii disc filesystem", "/fst", "fst", "fst:/", false, false, NULL },
-    { "NAND images", "/nand", "nand", "nand:/", false, false, NULL },
-    { "NAND filesystem", "/isfs", "isfs", "isfs:/", false, false, NULL },
-    { "OTP filesystem", "/otp", "otp", "otp:/", false, false, NULL },
-    { "SEEPROM filesystem", "/seeprom", "seeprom", "seeprom:/", false, false, NULL }
+    { "SD Gecko A", "/carda", "carda", "carda:/", false, false, &__io_gcsda, DEVICE_GCSDA },
+    { "SD Gecko B", "/cardb", "cardb", "cardb:/", false, false, &__io_gcsdb, DEVICE_GCSDB },
+    { "Front SD", "/sd", "sd", "sd:/", false, false, &__io_wiisd, DEVICE_SD },
+    { "USB storage device", "/usb", "usb", "usb:/", false, false, &__io_usbstorage, DEVICE_USB },
+    { "ISO9660 filesystem", "/dvd", "dvd", "dvd:/", false, false, NULL, DEVICE_DVD },
+    { "Wii disc image", "/wod", "wod", "wod:/", false, false, NULL, DEVICE_DVD },
+    { "Wii disc filesystem", "/fst", "fst", "fst:/", false, false, NULL, DEVICE_DVD },
+    { "NAND images", "/nand", "nand", "nand:/", false, false, NULL, DEVICE_NAND },
+    { "NAND filesystem", "/isfs", "isfs", "isfs:/", false, false, NULL, DEVICE_NAND },
+    { "OTP filesystem", "/otp", "otp", "otp:/", false, false, NULL, DEVICE_NAND },
+    { "SEEPROM filesystem", "/seeprom", "seeprom", "seeprom:/", false, false, NULL, DEVICE_NAND },
+    { "RAM disk", "/ram", "ram", "ram:/", false, false, NULL, DEVICE_RAM }
 };
 const u32 MAX_VIRTUAL_PARTITIONS = (sizeof(VIRTUAL_PARTITIONS) / sizeof(VIRTUAL_PARTITION));
 
@@ -76,6 +82,7 @@ VIRTUAL_PARTITION *PA_NAND    = VIRTUAL_PARTITIONS + 7;
 VIRTUAL_PARTITION *PA_ISFS    = VIRTUAL_PARTITIONS + 8;
 VIRTUAL_PARTITION *PA_OTP     = VIRTUAL_PARTITIONS + 9;
 VIRTUAL_PARTITION *PA_SEEPROM = VIRTUAL_PARTITIONS + 10;
+VIRTUAL_PARTITION *PA_RAM     = VIRTUAL_PARTITIONS + 11;
 
 static VIRTUAL_PARTITION *to_virtual_partition(const char *virtual_prefix) {
     u32 i;
@@ -97,6 +104,18 @@ static bool is_dvd(VIRTUAL_PARTITION *partition) {
     return partition == PA_DVD || partition == PA_WOD || partition == PA_FST;
 }
 
+static bool deferred_mounts[sizeof(VIRTUAL_PARTITIONS) / sizeof(VIRTUAL_PARTITION)];
+static mutex_t deferred_mount_mutex = LWP_MUTEX_NULL;
+static bool isfs_initialised = false;
+
+static bool *deferred_mount(VIRTUAL_PARTITION *partition) {
+    return deferred_mounts + (partition - VIRTUAL_PARTITIONS);
+}
+
+bool deferred(VIRTUAL_PARTITION *partition) {
+    return __atomic_load_n(deferred_mount(partition), __ATOMIC_ACQUIRE);
+}
+
 bool mounted(VIRTUAL_PARTITION *partition) {
     DIR_ITER *dir = diropen(partition->prefix);
     if (dir) {
@@ -131,7 +150,7 @@ static mountstate_t mountstate = MOUNTSTATE_START;
 static VIRTUAL_PARTITION *mount_partition = NULL;
 static u64 mount_timer = 0;
 
-bool mount(VIRTUAL_PARTITION *partition) {
+static bool mount_device(VIRTUAL_PARTITION *partition) {
     if (!partition || mounted(partition) || (is_dvd(partition) && dvd_mountWait())) return false;
     
     bool success = false;
@@ -146,6 +165,7 @@ bool mount(VIRTUAL_PARTITION *partition) {
             if (partition == PA_DVD) success = ISO9660_Mount();
             else if (partition == PA_WOD) success = WOD_Mount();
             else if (partition == PA_FST) success = FST_Mount();
+            if (success) build_disc_index(partition);
         }
         if (!dvd_mountWait() && !dvd_last_access()) dvd_stop();
     } else if (is_fat(partition)) {
@@ -170,28 +190,55 @@ bool mount(VIRTUAL_PARTITION *partition) {
     } else if (partition == PA_NAND) {
         success = NANDIMG_Mount();
     } else if (partition == PA_ISFS) {
-        success = ISFS_Mount();
+        isfs_cache_clear();
+        if (!isfs_initialised) isfs_initialised = ISFS_Initialize() == IPC_OK;
+        success = isfs_initialised && ISFS_Mount();
     } else if (partition == PA_OTP) {
         success = OTP_Mount();
     } else if (partition == PA_SEEPROM) {
         success = SEEPROM_Mount();
+    } else if (partition == PA_RAM) {
+        success = mount_ram_disk();
     }
     printf(success ? "succeeded.\n" : "failed.\n");
+    stats_increment(success ? STAT_MOUNTS : STAT_MOUNT_FAILURES);
     if (success && is_gecko(partition)) partition->geckofail = false;
 
     return success;
 }
 
+/*
+    A deferred partition stays deferred until the attempt has finished, so that mount_if_deferred() can tell
+    the threads that arrive meanwhile to wait for it.
+*/
+bool mount(VIRTUAL_PARTITION *partition) {
+    bool success = mount_device(partition);
+    if (partition) __atomic_store_n(deferred_mount(partition), false, __ATOMIC_RELEASE);
+    return success;
+}
+
 bool mount_virtual(const char *dir) {
     return mount(to_virtual_partition(dir));
 }
 
+/*
+    The first of the threads resolving paths on a deferred partition mounts it, and the others wait until it has,
+    rather than carrying on against a partition that is not there yet.
+*/
+void mount_if_deferred(VIRTUAL_PARTITION *partition) {
+    if (!deferred(partition)) return;
+    LWP_MutexLock(deferred_mount_mutex);
+    if (deferred(partition)) mount(partition);
+    LWP_MutexUnlock(deferred_mount_mutex);
+}
+
 bool unmount(VIRTUAL_PARTITION *partition) {
     if (!partition || !mounted(partition) || (is_dvd(partition) && dvd_mountWait())) return false;
 
     printf("Unmounting %s...", partition->name);
     bool success = false;
     if (is_dvd(partition)) {
+        drop_disc_index(partition);
         if (partition == PA_DVD) success = ISO9660_Unmount();
         else if (partition == PA_WOD) success = WOD_Unmount();
         else if (partition == PA_FST) success = FST_Unmount();
@@ -204,12 +251,19 @@ bool unmount(VIRTUAL_PARTITION *partition) {
         success = NANDIMG_Unmount();
     } else if (partition == PA_ISFS) {
         success = ISFS_Unmount();
+        isfs_cache_clear();
     } else if (partition == PA_OTP) {
         success = OTP_Unmount();
     } else if (partition == PA_SEEPROM) {
         success = SEEPROM_Unmount();
+    } else if (partition == PA_RAM) {
+        success = unmount_ram_disk();
     }
     printf(success ? "succeeded.\n" : "failed.\n");
+    if (success) {
+        __atomic_store_n(deferred_mount(partition), false, __ATOMIC_RELEASE);
+        stats_increment(STAT_UNMOUNTS);
+    }
 
     return success;
 }
@@ -220,30 +274,61 @@ bool unmount_virtual(const char *dir) {
 
 static u64 device_check_timer = 0;
 
+/*
+    Probing and mounting a FAT device can take seconds, so those checks run on the device's worker, with at most
+    one outstanding per partition, and the FTP listener keeps running while SD and USB come online behind it.
+*/
+static transfer_job *device_check_jobs[sizeof(VIRTUAL_PARTITIONS) / sizeof(VIRTUAL_PARTITION)];
+
+static void check_removable_device(VIRTUAL_PARTITION *partition) {
+    if (was_inserted_or_removed(partition)) {
+        if (partition->inserted && (partition == PA_DVD || (!is_dvd(partition) && !mounted(partition)))) {
+            printf("Device inserted; ");
+            stats_increment(STAT_DEVICE_INSERTIONS);
+            if (partition == PA_DVD) {
+                set_dvd_mountWait(true);
+                DI_Mount();
+                printf("Mounting DVD...\n");
+            } else if (!mount(partition) && is_gecko(partition)) {
+                printf("%s failed to automount.  Insertion or removal will not be detected until it is mounted manually.\n", partition->name);
+                printf("Note that inserting an SD Gecko without an SD card in it can be problematic.\n");
+                partition->geckofail = true;
+            }
+        } else if (!partition->inserted && mounted(partition)) {
+            printf("Device removed; ");
+            stats_increment(STAT_DEVICE_REMOVALS);
+            unmount(partition);
+        }
+    }
+}
+
+static s32 run_device_check(s32 unused, VIRTUAL_PARTITION *partition) {
+    check_removable_device(partition);
+    return 0;
+}
+
+static void finish_device_check(VIRTUAL_PARTITION *partition) {
+    transfer_job **job = device_check_jobs + (partition - VIRTUAL_PARTITIONS);
+    if (*job) {
+        wait_for_job(*job);
+        *job = NULL;
+    }
+}
+
 void check_removable_devices(u64 now) {
+    u32 i;
+    s32 result;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+        if (device_check_jobs[i] && finish_job(device_check_jobs[i], &result)) device_check_jobs[i] = NULL;
+    }
     if (now <= device_check_timer) return;
 
-    u32 i;
     for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
         VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
         if (mount_timer && partition == mount_partition) continue;
-        if (was_inserted_or_removed(partition)) {
-            if (partition->inserted && (partition == PA_DVD || (!is_dvd(partition) && !mounted(partition)))) {
-                printf("Device inserted; ");
-                if (partition == PA_DVD) {
-                    set_dvd_mountWait(true);
-                    DI_Mount();
-                    printf("Mounting DVD...\n");
-                } else if (!mount(partition) && is_gecko(partition)) {
-                    printf("%s failed to automount.  Insertion or removal will not be detected until it is mounted manually.\n", partition->name);
-                    printf("Note that inserting an SD Gecko without an SD card in it can be problematic.\n");
-                    partition->geckofail = true;
-                }
-            } else if (!partition->inserted && mounted(partition)) {
-                printf("Device removed; ");
-                unmount(partition);
-            }
-        }
+        if (device_check_jobs[i]) continue;
+        if (is_fat(partition) && (device_check_jobs[i] = start_job(partition->device, (job_callback)run_device_check, -1, partition))) continue;
+        check_removable_device(partition);
     }
     
     device_check_timer = gettime() + secs_to_ticks(2);
@@ -269,6 +354,7 @@ void process_remount_event() {
             DI_Mount();
             printf("Mounting DVD...\n");
         } else {
+            finish_device_check(mount_partition);
             mount(mount_partition);
         }
         mount_partition = NULL;
@@ -292,7 +378,10 @@ void process_device_select_event(u32 pressed) {
                 }
                 dvd_unmount();
             }
-            else if (is_fat(mount_partition)) unmount(mount_partition);
+            else if (is_fat(mount_partition)) {
+                finish_device_check(mount_partition);
+                unmount(mount_partition);
+            }
             printf("To continue after changing the device hold B on controller #1 or wait 30 seconds.\n");
             mount_timer = gettime() + secs_to_ticks(30);
         }
@@ -304,11 +393,17 @@ void check_mount_timer(u64 now) {
 }
 
 void initialise_fs() {
-    NANDIMG_Mount();
-    OTP_Mount();
-    SEEPROM_Mount();
+    VIRTUAL_PARTITION *deferred_partitions[] = { PA_NAND, PA_ISFS, PA_OTP, PA_SEEPROM };
+    u32 i;
+    if (LWP_MutexInit(&deferred_mount_mutex, false) < 0) {
+        printf("Unable to create mount lock, use SITE MOUNT for /nand, /isfs, /otp and /seeprom.\n");
+    } else {
+        for (i = 0; i < 4; i++) *deferred_mount(deferred_partitions[i]) = true;
+    }
+    initialise_disc_index();
     ISFS_SU();
-    if (ISFS_Initialize() == IPC_OK) ISFS_Mount();
+    initialise_isfs_cache();
+    initialise_ram_disk();
 }
 
 /*
@@ -26,6 +26,15 @@ misrepresented as being the original software.
 
 #include <ogc/disc_io.h>
 
+/*
+    The physical devices behind the partitions.  Storage operations on each device are run by its own worker,
+    see worker.h.  DEVICE_NONE is for operations that do not touch storage, e.g. on the virtual root.
+*/
+typedef enum {
+    DEVICE_NONE, DEVICE_GCSDA, DEVICE_GCSDB, DEVICE_SD, DEVICE_USB, DEVICE_DVD, DEVICE_NAND, DEVICE_RAM,
+    MAX_DEVICES
+} io_device;
+
 typedef struct {
     const char *name;
     const char *alias;
@@ -34,9 +43,10 @@ typedef struct {
     bool inserted;
     bool geckofail;
     const DISC_INTERFACE *disc;
+    io_device device;
 } VIRTUAL_PARTITION;
 
-VIRTUAL_PARTITION VIRTUAL_PARTITIONS[11];
+VIRTUAL_PARTITION VIRTUAL_PARTITIONS[12];
 const u32 MAX_VIRTUAL_PARTITIONS;
 VIRTUAL_PARTITION *PA_GCSDA;
 VIRTUAL_PARTITION *PA_GCSDB;
@@ -49,6 +59,7 @@ VIRTUAL_PARTITION *PA_NAND;
 VIRTUAL_PARTITION *PA_ISFS;
 VIRTUAL_PARTITION *PA_OTP;
 VIRTUAL_PARTITION *PA_SEEPROM;
+VIRTUAL_PARTITION *PA_RAM;
 
 void initialise_fs();
 
@@ -60,6 +71,14 @@ bool unmount(VIRTUAL_PARTITION *partition);
 
 bool mount_virtual(const char *dir);
 
+/*
+    /nand, /isfs, /otp and /seeprom are not mounted at startup, but the first time to_real_path() resolves a path on
+    them.  Until then they are deferred: listed in the root directory, but not mounted.
+*/
+bool deferred(VIRTUAL_PARTITION *partition);
+
+void mount_if_deferred(VIRTUAL_PARTITION *partition);
+
 bool unmount_virtual(const char *dir);
 
 void check_removable_devices(u64 now);
@@ -23,6 +23,7 @@ misrepresented as being the original software.
 3.This notice may not be removed or altered from any source distribution.
 
 */
+#include <ctype.h>
 #include <errno.h>
 #include <malloc.h>
 #include <network.h>
@@ -38,10 +39,17 @@ misrepresented as being the original software.
 #include "fs.h"
 #include "loader.h"
 #include "net.h"
+#include "ramdisk.h"
+#include "raw.h"
 #include "reset.h"
+#include "stats.h"
+#include "tar.h"
 #include "vrt.h"
+#include "worker.h"
 
 #define FTP_BUFFER_SIZE 1024
+#define MAX_QUEUED_COMMANDS (FTP_BUFFER_SIZE / 2) // every line ends in CRLF, so the buffer fills before the queue
+#define URGENT_RESERVE 64 // bytes of buffer that queued commands other than ABOR and STAT may not use
 #define MAX_CLIENTS 5
 
 static const u16 SRC_PORT = 20;
@@ -50,11 +58,19 @@ static const char *CRLF = "\r\n";
 static const u32 CRLF_LENGTH = 2;
 
 static u8 num_clients = 0;
-static u16 passive_port = 1024;
 static char *password = NULL;
+static u32 idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static u32 stall_timeout = DEFAULT_NET_TIMEOUT;
 
+/*
+    Data connection callbacks return a positive number of bytes transferred or -EAGAIN to be called again,
+    0 when the transfer is complete, or another negative value on error.
+*/
 typedef s32 (*data_connection_callback)(s32 data_socket, void *arg);
 
+struct client_struct;
+typedef s32 (*client_task_callback)(struct client_struct *client, void *arg, bool abort);
+
 struct client_struct {
     s32 socket;
     char representation_type;
@@ -62,16 +78,40 @@ struct client_struct {
     s32 data_socket;
     char cwd[MAXPATHLEN];
     char pending_rename[MAXPATHLEN];
+    char pending_untar[MAXPATHLEN];
+    bool pending_exec;
     off_t restart_marker;
     struct sockaddr_in address;
     bool authenticated;
-    char buf[FTP_BUFFER_SIZE];
-    s32 offset;
+    u64 last_activity; // when a command was last received, or a transfer or task last finished
+    char buf[FTP_BUFFER_SIZE]; // ring buffer of command text received from the client
+    u32 buf_start;
+    u32 buf_length;
+    u32 buf_scanned; // bytes from buf_start already scanned for line endings
+    u32 num_queued; // complete lines at buf_start, queued behind a transfer
+    u32 queued_bytes;
+    u16 queued_lengths[MAX_QUEUED_COMMANDS];
+    transfer_job *command_job; // the command running on its device's worker, if any
+    char command_line[FTP_BUFFER_SIZE]; // the text of command_job, which no longer occupies buf
+    bool closing; // the connection is to be closed once command_job finishes
+    bool command_aborted; // ABOR was received while command_job was running
     bool data_connection_connected;
     data_connection_callback data_callback;
     void *data_connection_callback_arg;
     void (*data_connection_cleanup)(void *arg);
+    transfer_job *data_job; // the data callback call running on a worker, if any
     u64 data_connection_timer;
+    u64 transfer_started;
+    u64 transfer_progress; // when data was last transferred
+    u64 bytes_transferred;
+    u64 transfer_size;
+    VIRTUAL_PARTITION *transfer_partition;
+    bool transfer_upload;
+    client_task_callback task_callback;
+    void *task_arg;
+    void (*task_cleanup)(void *arg);
+    io_device task_device;
+    transfer_job *task_job; // the task step running on a worker, if any
 };
 
 typedef struct client_struct client_t;
@@ -89,22 +129,36 @@ void set_ftp_password(char *new_password) {
     }
 }
 
+void set_ftp_timeouts(u32 idle_seconds, u32 stall_seconds) {
+    idle_timeout = idle_seconds;
+    stall_timeout = stall_seconds;
+    set_net_timeout(stall_seconds);
+}
+
 static bool compare_ftp_password(char *password_attempt) {
     return !password || !strcmp((char *)password, password_attempt);
 }
 
-/*
-    TODO: support multi-line reply
-*/
-static s32 write_reply(client_t *client, u16 code, char *msg) {
+static s32 write_reply_line(client_t *client, u16 code, char separator, char *msg) {
     u32 msglen = 4 + strlen(msg) + CRLF_LENGTH;
     char msgbuf[msglen + 1];
-    if (msgbuf == NULL) return -ENOMEM;
-    sprintf(msgbuf, "%u %s\r\n", code, msg);
+    sprintf(msgbuf, "%u%c%s\r\n", code, separator, msg);
     printf("Wrote reply: %s", msgbuf);
     return send_exact(client->socket, msgbuf, msglen);
 }
 
+static s32 write_reply(client_t *client, u16 code, char *msg) {
+    return write_reply_line(client, code, ' ', msg);
+}
+
+/*
+    Writes an intermediate line of a multi-line reply.
+    The reply must be completed with write_reply() using the same code.
+*/
+static s32 write_multiline_reply(client_t *client, u16 code, char *msg) {
+    return write_reply_line(client, code, '-', msg);
+}
+
 static void close_passive_socket(client_t *client) {
     if (client->passive_socket >= 0) {
         net_close_blocking(client->passive_socket);
@@ -113,41 +167,31 @@ static void close_passive_socket(client_t *client) {
 }
 
 /*
-    result must be able to hold up to maxsplit+1 null-terminated strings of length strlen(s)
-    returns the number of strings stored in the result array (up to maxsplit+1)
+    Splits s in place into at most maxsplit+1 fields separated by runs of sep, storing pointers into s in result.
+    The last field is the rest of s, without trailing separators.  Missing fields are set to empty strings.
+    returns the number of fields stored in the result array (up to maxsplit+1)
 */
 static u32 split(char *s, char sep, u32 maxsplit, char *result[]) {
     u32 num_results = 0;
-    u32 result_pos = 0;
-    u32 trim_pos = 0;
-    bool in_word = false;
-    for (; *s; s++) {
-        if (*s == sep) {
-            if (num_results <= maxsplit) {
-                in_word = false;
-                continue;
-            } else if (!trim_pos) {
-                trim_pos = result_pos;
-            }
-        } else if (trim_pos) {
-            trim_pos = 0;
-        }
-        if (!in_word) {
-            in_word = true;
-            if (num_results <= maxsplit) {
-                num_results++;
-                result_pos = 0;
+    while (num_results <= maxsplit) {
+        while (*s == sep) s++;
+        if (!*s) break;
+        result[num_results++] = s;
+        if (num_results <= maxsplit) {
+            while (*s && *s != sep) s++;
+            if (*s) *s++ = '\0';
+        } else {
+            char *last_word_end = s;
+            for (; *s; s++) {
+                if (*s != sep) last_word_end = s + 1;
             }
+            *last_word_end = '\0';
+            s = last_word_end;
         }
-        result[num_results - 1][result_pos++] = *s;
-        result[num_results - 1][result_pos] = '\0';
-    }
-    if (trim_pos) {
-        result[num_results - 1][trim_pos] = '\0';
     }
-    u32 i = num_results;
+    u32 i;
     for (i = num_results; i <= maxsplit; i++) {
-        result[i][0] = '\0';
+        result[i] = s;
     }
     return num_results;
 }
@@ -174,7 +218,6 @@ static s32 ftp_REIN(client_t *client, char *rest) {
 }
 
 static s32 ftp_QUIT(client_t *client, char *rest) {
-    // TODO: dont quit if xfer in progress
     s32 result = write_reply(client, 221, "Service closing control connection.");
     return result < 0 ? result : -EQUIT;
 }
@@ -184,9 +227,9 @@ static s32 ftp_SYST(client_t *client, char *rest) {
 }
 
 static s32 ftp_TYPE(client_t *client, char *rest) {
-    char representation_type[FTP_BUFFER_SIZE], param[FTP_BUFFER_SIZE];
-    char *args[] = { representation_type, param };
+    char *args[2];
     u32 num_args = split(rest, ' ', 1, args);
+    char *representation_type = args[0], *param = args[1];
     if (num_args == 0) {
         return write_reply(client, 501, "Syntax error in parameters.");
     } else if ((!strcasecmp("A", representation_type) && (!*param || !strcasecmp("N", param))) ||
@@ -243,6 +286,127 @@ static s32 ftp_DELE(client_t *client, char *path) {
     }
 }
 
+/*
+    Starts a long-running operation that is advanced by calling callback once per event loop iteration,
+    until it returns something other than -EAGAIN.  The callback is responsible for the final reply,
+    and is called one last time with abort set if the client sends ABOR.
+    Other control commands are queued while the task is running.  The steps are run on the worker of device.
+*/
+static void start_task(client_t *client, io_device device, void *callback, void *arg, void *cleanup) {
+    client->task_device = device;
+    client->task_callback = callback;
+    client->task_arg = arg;
+    client->task_cleanup = cleanup;
+}
+
+#define RMTREE_BATCH_SIZE 64
+#define RMTREE_PROGRESS_INTERVAL 1000
+
+typedef struct {
+    VRT_WALK *walk;
+    u32 files;
+    u32 dirs;
+    u32 failed;
+    u32 too_deep;
+    u32 next_progress;
+} rmtree_t;
+
+static void rmtree_cleanup(rmtree_t *rmtree) {
+    vrt_walkclose(rmtree->walk);
+    free(rmtree);
+}
+
+/*
+    Removes up to RMTREE_BATCH_SIZE entries per call, deepest first.
+    Progress is reported as intermediate lines of a multi-line 250 reply,
+    after which failures can only be reported in the text of the final line.
+*/
+static s32 rmtree_finish(client_t *client, rmtree_t *rmtree, bool aborted) {
+    char msg[160];
+    bool progress_sent = rmtree->next_progress > RMTREE_PROGRESS_INTERVAL;
+    int length = sprintf(msg, "%s %u files and %u directories, %u entries could not be removed", aborted ? "Aborted after removing" : "Removed", rmtree->files, rmtree->dirs, rmtree->failed);
+    if (rmtree->too_deep) sprintf(msg + length, ", %u directories nested too deeply were skipped.", rmtree->too_deep);
+    else strcpy(msg + length, ".");
+    s32 result = write_reply(client, ((rmtree->failed || rmtree->too_deep || aborted) && !progress_sent) ? 550 : 250, msg);
+    return result < 0 ? result : 0;
+}
+
+static s32 rmtree_step(client_t *client, rmtree_t *rmtree, bool abort) {
+    if (abort) return rmtree_finish(client, rmtree, true);
+    char path[MAXPATHLEN];
+    char msg[MAXPATHLEN + 80];
+    struct stat st;
+    u32 i;
+    for (i = 0; i < RMTREE_BATCH_SIZE; i++) {
+        u32 too_deep = vrt_walk_too_deep(rmtree->walk);
+        if (vrt_walknext(rmtree->walk, path, &st)) {
+            return rmtree_finish(client, rmtree, false);
+        }
+        if (vrt_walk_too_deep(rmtree->walk) != too_deep) {
+            printf("Nested too deeply, skipping %s\n", path);
+            rmtree->too_deep++;
+        } else if (vrt_unlink("/", path)) {
+            printf("Unable to remove %s: [%i] %s\n", path, errno, strerror(errno));
+            rmtree->failed++;
+        } else if (st.st_mode & S_IFDIR) {
+            rmtree->dirs++;
+        } else {
+            rmtree->files++;
+        }
+    }
+    if (rmtree->files + rmtree->dirs + rmtree->failed >= rmtree->next_progress) {
+        rmtree->next_progress += RMTREE_PROGRESS_INTERVAL;
+        sprintf(msg, "Removed %u files and %u directories so far...", rmtree->files, rmtree->dirs);
+        s32 result = write_multiline_reply(client, 250, msg);
+        if (result < 0) return result;
+    }
+    return -EAGAIN;
+}
+
+static s32 rmtree(client_t *client, char *path) {
+    if (!*path) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+    char *real_path = to_real_path(client->cwd, path);
+    if (!real_path) {
+        return write_reply(client, 550, strerror(errno));
+    } else if (!*real_path) {
+        return write_reply(client, 550, "Refusing to remove the root directory.");
+    }
+    size_t real_length = strlen(real_path);
+    bool is_partition_root = real_length >= 2 && !strcmp(real_path + real_length - 2, ":/");
+    free(real_path);
+    if (is_partition_root) {
+        return write_reply(client, 550, "Refusing to remove the root directory of a partition.");
+    }
+
+    rmtree_t *rmtree = malloc(sizeof(rmtree_t));
+    if (!rmtree) {
+        return write_reply(client, 550, strerror(ENOMEM));
+    }
+    if (!(rmtree->walk = vrt_walkopen(client->cwd, path, true))) {
+        s32 walk_error = errno;
+        free(rmtree);
+        return write_reply(client, 550, strerror(walk_error));
+    }
+    rmtree->files = rmtree->dirs = rmtree->failed = rmtree->too_deep = 0;
+    rmtree->next_progress = RMTREE_PROGRESS_INTERVAL;
+    start_task(client, to_device(client->cwd, path), rmtree_step, rmtree, rmtree_cleanup);
+    return 0;
+}
+
+/*
+    "RMD -r path" removes a directory and everything in it, like SITE RMTREE.
+*/
+static s32 ftp_RMD(client_t *client, char *path) {
+    if (!strcmp("-r", path)) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    } else if (!strncmp("-r ", path, 3)) {
+        return rmtree(client, path + 3);
+    }
+    return ftp_DELE(client, path);
+}
+
 static s32 ftp_MKD(client_t *client, char *path) {
     if (!*path) {
         return write_reply(client, 501, "Syntax error in parameters.");
@@ -283,7 +447,7 @@ static s32 ftp_SIZE(client_t *client, char *path) {
     struct stat st;
     if (!vrt_stat(client->cwd, path, &st)) {
         char size_buf[12];
-        sprintf(size_buf, "%llu", st.st_size);
+        sprintf(size_buf, "%llu", (unsigned long long)st.st_size);
         return write_reply(client, 213, size_buf);
     } else {
         return write_reply(client, 550, strerror(errno));
@@ -292,30 +456,16 @@ static s32 ftp_SIZE(client_t *client, char *path) {
 
 static s32 ftp_PASV(client_t *client, char *rest) {
     close_passive_socket(client);
-    client->passive_socket = net_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    if (client->passive_socket < 0) {
+    u16 port;
+    s32 listener = take_passive_listener(&port);
+    if (listener < 0) {
         return write_reply(client, 520, "Unable to create listening socket.");
     }
-    set_blocking(client->passive_socket, false);
-    struct sockaddr_in bindAddress;
-    memset(&bindAddress, 0, sizeof(bindAddress));
-    bindAddress.sin_family = AF_INET;
-    bindAddress.sin_port = htons(passive_port++); // XXX: BUG: This will overflow eventually, with interesting results...
-    bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-    s32 result;
-    if ((result = net_bind(client->passive_socket, (struct sockaddr *)&bindAddress, sizeof(bindAddress))) < 0) {
-        close_passive_socket(client);
-        return write_reply(client, 520, "Unable to bind listening socket.");
-    }
-    if ((result = net_listen(client->passive_socket, 1)) < 0) {
-        close_passive_socket(client);
-        return write_reply(client, 520, "Unable to listen on socket.");
-    }
+    client->passive_socket = listener;
     char reply[49];
-    u16 port = bindAddress.sin_port;
-    u32 ip = net_gethostip();
+    u32 ip = get_host_ip();
     struct in_addr addr;
-    addr.s_addr = ip;
+    addr.s_addr = htonl(ip);
     printf("Listening for data connections at %s:%u...\n", inet_ntoa(addr), port);
     sprintf(reply, "Entering Passive Mode (%u,%u,%u,%u,%u,%u).", (ip >> 24) & 0xff, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, (port >> 8) & 0xff, port & 0xff);
     return write_reply(client, 227, reply);
@@ -382,6 +532,11 @@ static s32 prepare_data_connection(client_t *client, void *callback, void *arg,
             client->data_connection_callback_arg = arg;
             client->data_connection_cleanup = cleanup;
             client->data_connection_timer = gettime() + secs_to_ticks(30);
+            client->transfer_started = 0;
+            client->bytes_transferred = 0;
+            client->transfer_size = 0;
+            client->transfer_partition = NULL;
+            client->transfer_upload = false;
         }
     }
     return result;
@@ -410,8 +565,9 @@ static s32 send_list(s32 data_socket, DIR_ITER *dir) {
     char line[MAXPATHLEN + 56 + CRLF_LENGTH + 1];
     while (vrt_dirnext(dir, filename, &st) == 0) {
         char timestamp[13];
-        strftime(timestamp, sizeof(timestamp), "%b %d  %Y", localtime(&st.st_mtime));
-        sprintf(line, "%crwxr-xr-x    1 0        0     %10llu %s %s\r\n", (st.st_mode & S_IFDIR) ? 'd' : '-', st.st_size, timestamp, filename);
+        struct tm mtime;
+        strftime(timestamp, sizeof(timestamp), "%b %d  %Y", localtime_r(&st.st_mtime, &mtime));
+        sprintf(line, "%crwxr-xr-x    1 0        0     %10llu %s %s\r\n", (st.st_mode & S_IFDIR) ? 'd' : '-', (unsigned long long)st.st_size, timestamp, filename);
         if ((result = send_exact(data_socket, line, strlen(line))) < 0) {
             break;
         }
@@ -437,11 +593,9 @@ static s32 ftp_NLST(client_t *client, char *path) {
 static s32 ftp_LIST(client_t *client, char *path) {
     if (*path == '-') {
         // handle buggy clients that use "LIST -aL" or similar, at the expense of breaking paths that begin with '-'
-        char flags[FTP_BUFFER_SIZE];
-        char rest[FTP_BUFFER_SIZE];
-        char *args[] = { flags, rest };
+        char *args[2];
         split(path, ' ', 1, args);
-        path = rest;
+        path = args[1];
     }
     if (!*path) {
         path = ".";
@@ -457,10 +611,40 @@ static s32 ftp_LIST(client_t *client, char *path) {
     return result;
 }
 
+static s32 retr_raw(client_t *client, VIRTUAL_PARTITION *partition) {
+    RAW_IMAGE *image = raw_open(partition, client->restart_marker);
+    client->restart_marker = 0;
+    if (!image) {
+        return write_reply(client, 550, strerror(errno));
+    }
+
+    s32 result = prepare_data_connection(client, send_from_raw, image, raw_close);
+    if (result < 0) raw_close(image);
+    else client->transfer_partition = partition;
+    return result;
+}
+
+/*
+    RETR of "<dir>.tar", where no such file exists, streams an archive of <dir>.
+*/
+static s32 retr_tar(client_t *client, TAR_STREAM *tar, char *path) {
+    client->restart_marker = 0;
+    s32 result = prepare_data_connection(client, send_tar, tar, tar_close);
+    if (result < 0) tar_close(tar);
+    else client->transfer_partition = to_partition(client->cwd, path);
+    return result;
+}
+
 static s32 ftp_RETR(client_t *client, char *path) {
+    VIRTUAL_PARTITION *raw_partition = to_raw_partition(client->cwd, path);
+    if (raw_partition) return retr_raw(client, raw_partition);
+
     FILE *f = vrt_fopen(client->cwd, path, "rb");
     if (!f) {
-        return write_reply(client, 550, strerror(errno));
+        s32 fopen_error = errno;
+        TAR_STREAM *tar = tar_open(client->cwd, path, client->restart_marker);
+        if (tar) return retr_tar(client, tar, path);
+        return write_reply(client, 550, strerror(fopen_error));
     }
 
     int fd = fileno(f);
@@ -470,43 +654,102 @@ static s32 ftp_RETR(client_t *client, char *path) {
         client->restart_marker = 0;
         return write_reply(client, 550, strerror(lseek_error));
     }
+    struct stat st;
+    u64 size = fstat(fd, &st) ? 0 : st.st_size;
+    size = size > client->restart_marker ? size - client->restart_marker : 0;
     client->restart_marker = 0;
 
     s32 result = prepare_data_connection(client, send_from_file, f, fclose);
-    if (result < 0) fclose(f);
+    if (result < 0) {
+        fclose(f);
+    } else {
+        client->transfer_size = size;
+        client->transfer_partition = to_partition(client->cwd, path);
+    }
     return result;
 }
 
-static s32 stor_or_append(client_t *client, FILE *f) {
+static s32 stor_or_append(client_t *client, FILE *f, char *path) {
     if (!f) {
         return write_reply(client, 550, strerror(errno));
     }
-    s32 result = prepare_data_connection(client, recv_to_file, f, fclose);
-    if (result < 0) fclose(f);
+    s32 result = prepare_data_connection(client, recv_to_file, f, vrt_fclose);
+    if (result < 0) {
+        vrt_fclose(f);
+    } else {
+        client->transfer_partition = to_partition(client->cwd, path);
+        client->transfer_upload = true;
+    }
+    return result;
+}
+
+/*
+    After SITE UNTAR, the next STOR is extracted as a tar archive and its path is ignored.
+*/
+static s32 stor_untar(client_t *client) {
+    TAR_EXTRACT *untar = untar_open(client->pending_untar);
+    VIRTUAL_PARTITION *partition = to_partition("/", client->pending_untar);
+    *client->pending_untar = '\0';
+    client->restart_marker = 0;
+    if (!untar) {
+        return write_reply(client, 550, strerror(errno));
+    }
+    s32 result = prepare_data_connection(client, recv_to_untar, untar, untar_close);
+    if (result < 0) {
+        untar_close(untar);
+    } else {
+        client->transfer_partition = partition;
+        client->transfer_upload = true;
+    }
+    return result;
+}
+
+/*
+    After SITE EXEC, the next STOR is received into memory and run once the transfer completes, instead of
+    being written to its path.  The path, e.g. /sd/apps/foo/boot.dol, is still passed to the DOL as argv[0].
+*/
+static s32 stor_exec(client_t *client, char *path) {
+    client->pending_exec = false;
+    client->restart_marker = 0;
+    char *real_path = to_real_path(client->cwd, path);
+    EXEC_UPLOAD *upload = exec_open(real_path ? real_path : path);
+    if (real_path) free(real_path);
+    if (!upload) {
+        return write_reply(client, 550, strerror(errno));
+    }
+    s32 result = prepare_data_connection(client, recv_to_exec, upload, exec_close);
+    if (result < 0) {
+        exec_close(upload);
+    } else {
+        client->transfer_upload = true;
+    }
     return result;
 }
 
 static s32 ftp_STOR(client_t *client, char *path) {
+    if (*client->pending_untar) return stor_untar(client);
+    if (client->pending_exec) return stor_exec(client, path);
+
     FILE *f = vrt_fopen(client->cwd, path, "wb");
     int fd;
     if (f) fd = fileno(f);
     if (f && client->restart_marker && lseek(fd, client->restart_marker, SEEK_SET) != client->restart_marker) {
         s32 lseek_error = errno;
-        fclose(f);
+        vrt_fclose(f);
         client->restart_marker = 0;
         return write_reply(client, 550, strerror(lseek_error));
     }
     client->restart_marker = 0;
 
-    return stor_or_append(client, f);
+    return stor_or_append(client, f, path);
 }
 
 static s32 ftp_APPE(client_t *client, char *path) {
-    return stor_or_append(client, vrt_fopen(client->cwd, path, "ab"));
+    return stor_or_append(client, vrt_fopen(client->cwd, path, "ab"), path);
 }
 
 static s32 ftp_REST(client_t *client, char *offset_str) {
-    off_t offset;
+    long long offset;
     if (sscanf(offset_str, "%lli", &offset) < 1 || offset < 0) {
         return write_reply(client, 501, "Syntax error in parameters.");
     }
@@ -563,6 +806,144 @@ static s32 ftp_SITE_UNMOUNT(client_t *client, char *path) {
     return write_reply(client, 250, "Unmounted.");
 }
 
+static s32 ftp_SITE_RAW(client_t *client, char *rest) {
+    if (!strcasecmp("ON", rest)) {
+        set_raw_enabled(true);
+        return write_reply(client, 200, "Raw device images enabled at /raw.");
+    } else if (!strcasecmp("OFF", rest)) {
+        set_raw_enabled(false);
+        return write_reply(client, 200, "Raw device images disabled.");
+    } else {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+}
+
+static s32 ftp_SITE_TIMEOUT(client_t *client, char *rest) {
+    char *args[2];
+    u32 num_args = split(rest, ' ', 1, args);
+    char *which = args[0], *value = args[1], *end;
+    if (num_args == 2) {
+        u32 seconds = strtoul(value, &end, 10);
+        if (*end || *value == '-') {
+            return write_reply(client, 501, "Syntax error in parameters.");
+        } else if (!strcasecmp("IDLE", which)) {
+            set_ftp_timeouts(seconds, stall_timeout);
+        } else if (!strcasecmp("STALL", which)) {
+            set_ftp_timeouts(idle_timeout, seconds);
+        } else {
+            return write_reply(client, 501, "Syntax error in parameters.");
+        }
+    } else if (num_args) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+    char msg[80];
+    sprintf(msg, "Idle timeout %u seconds, stall timeout %u seconds.", idle_timeout, stall_timeout);
+    return write_reply(client, 200, msg);
+}
+
+/*
+    SITE RAMDISK <megabytes> sets the size of /ram, which must be empty, and SITE RAMDISK 0 removes it.
+    It runs on the RAM disk's worker, behind any I/O on /ram, and is refused while a DOL is being loaded,
+    as the load buffer runs up to the top of the MEM2 arena that the RAM disk moves.
+*/
+static s32 ftp_SITE_RAMDISK(client_t *client, char *rest) {
+    if (*rest) {
+        char *end;
+        u32 megabytes = strtoul(rest, &end, 10);
+        if (*end || *rest == '-' || megabytes > 4095) {
+            return write_reply(client, 501, "Syntax error in parameters.");
+        }
+        if (!lock_load_buffer()) {
+            return write_reply(client, 550, "A DOL is being loaded into MEM2.");
+        }
+        s32 result = resize_ram_disk(megabytes << 20);
+        unlock_load_buffer();
+        if (result < 0) {
+            return write_reply(client, 550, strerror(-result));
+        }
+        if (!megabytes) unmount(PA_RAM);
+        else if (!mounted(PA_RAM)) mount(PA_RAM);
+    }
+    u32 size, used;
+    ram_disk_usage(&size, &used);
+    char msg[80];
+    sprintf(msg, "RAM disk size %u KB, %u KB used.", size >> 10, used >> 10);
+    return write_reply(client, 200, msg);
+}
+
+static s32 ftp_SITE_RMTREE(client_t *client, char *path) {
+    return rmtree(client, path);
+}
+
+/*
+    Stores path in quoted between double-quotes, doubling those within it as RFC 959 does for 257 replies.
+    quoted must hold 2 * strlen(path) + 3 characters.
+*/
+static char *quote_path(char *quoted, const char *path) {
+    char *q = quoted;
+    *q++ = '"';
+    for (; *path; path++) {
+        if (*path == '"') *q++ = '"';
+        *q++ = *path;
+    }
+    *q++ = '"';
+    *q = '\0';
+    return quoted;
+}
+
+static s32 ftp_SITE_UNTAR(client_t *client, char *path) {
+    if (!*path) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+    char dir[MAXPATHLEN];
+    strcpy(dir, client->cwd);
+    if (vrt_chdir(dir, path)) {
+        return write_reply(client, 550, strerror(errno));
+    }
+    strcpy(client->pending_untar, dir);
+    client->pending_exec = false;
+    char quoted[2 * MAXPATHLEN + 3];
+    char msg[sizeof(quoted) + 40];
+    sprintf(msg, "Next STOR will be extracted into %s.", quote_path(quoted, dir));
+    return write_reply(client, 200, msg);
+}
+
+static s32 ftp_SITE_EXEC(client_t *client, char *rest) {
+    if (*rest) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+    *client->pending_untar = '\0';
+    client->pending_exec = true;
+    return write_reply(client, 200, "Next STOR will be run as a DOL once received.");
+}
+
+/*
+    SITE STATS replies with the metrics from the /stats file, SITE STATS RESET clears them.
+*/
+static s32 ftp_SITE_STATS(client_t *client, char *rest) {
+    if (!strcasecmp("RESET", rest)) {
+        reset_stats();
+        return write_reply(client, 200, "Statistics reset.");
+    } else if (*rest) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+    u32 size = stats_format(NULL, 0) + STATS_SLACK;
+    char *text = malloc(size);
+    if (!text) {
+        return write_reply(client, 550, strerror(ENOMEM));
+    }
+    stats_format(text, size);
+    s32 result = 0;
+    char *line, *end;
+    for (line = text; result >= 0 && (end = strchr(line, '\n')); line = end + 1) {
+        *end = '\0';
+        result = write_multiline_reply(client, 200, line);
+    }
+    free(text);
+    if (result < 0) return result;
+    return write_reply(client, 200, "End of statistics.");
+}
+
 static s32 ftp_SITE_UNKNOWN(client_t *client, char *rest) {
     return write_reply(client, 501, "Unknown SITE command.");
 }
@@ -571,32 +952,155 @@ static s32 ftp_SITE_LOAD(client_t *client, char *path) {
     FILE *f = vrt_fopen(client->cwd, path, "rb");
     if (!f) return write_reply(client, 550, strerror(errno));
     char *real_path = to_real_path(client->cwd, path);
-    if (!real_path) goto end;
-    load_from_file(f, real_path);
+    s32 result = real_path ? load_from_file(f, real_path, &client->command_aborted) : -errno;
     free(real_path);
-    end:
     fclose(f);
-    return write_reply(client, 500, "Unable to load.");
+    if (result < 0) return write_reply(client, 550, strerror(-result));
+    return write_reply(client, 200, "Loaded, exiting to run it.");
 }
 
 typedef s32 (*ftp_command_handler)(client_t *client, char *args);
 
-static s32 dispatch_to_handler(client_t *client, char *cmd_line, const char **commands, const ftp_command_handler *handlers) {
-    char cmd[FTP_BUFFER_SIZE], rest[FTP_BUFFER_SIZE];
-    char *args[] = { cmd, rest };
-    split(cmd_line, ' ', 1, args); 
-    s32 i;
-    for (i = 0; commands[i]; i++) {
-        if (!strcasecmp(commands[i], cmd)) break;
+typedef struct {
+    const char *name;
+    ftp_command_handler handler;
+    bool takes_path; // the argument is a path, and the command is run on the worker of the path's device
+    io_device device; // otherwise, the command is run on the worker of this device, if any
+} ftp_command;
+
+#define MAX_COMMAND_NAME 8
+#define DISPATCH_SLOT_BITS 8
+
+/*
+    A perfect hash of command names: each name, packed case-insensitively into a u64, is mapped to its
+    own slot by a multiplicative hash.  The multiplier is searched for the first time the table is used.
+    commands is terminated by an entry with a NULL name, whose handler handles unknown commands.
+*/
+typedef struct {
+    const char *scope;
+    const ftp_command *commands;
+    u64 multiplier;
+    u8 slots[1 << DISPATCH_SLOT_BITS];
+} dispatch_table;
+
+/*
+    Returns 0 for names that are empty or longer than any command.
+*/
+static u64 command_key(const char *name) {
+    u64 key = 0;
+    u32 i;
+    for (i = 0; name[i]; i++) {
+        if (i == MAX_COMMAND_NAME) return 0;
+        key = (key << 8) | (u8)toupper((u8)name[i]);
     }
-    return handlers[i](client, rest);
+    return key;
 }
 
-static const char *site_commands[] = { "LOADER", "CLEAR", "CHMOD", "PASSWD", "NOPASSWD", "EJECT", "MOUNT", "UNMOUNT", "LOAD", NULL };
-static const ftp_command_handler site_handlers[] = { ftp_SITE_LOADER, ftp_SITE_CLEAR, ftp_SITE_CHMOD, ftp_SITE_PASSWD, ftp_SITE_NOPASSWD, ftp_SITE_EJECT, ftp_SITE_MOUNT, ftp_SITE_UNMOUNT, ftp_SITE_LOAD, ftp_SITE_UNKNOWN };
+static u32 dispatch_slot(u64 key, u64 multiplier) {
+    return (key * multiplier) >> (64 - DISPATCH_SLOT_BITS);
+}
+
+static void build_dispatch_table(dispatch_table *table) {
+    u64 multiplier = 0x9e3779b97f4a7c15ULL;
+    bool collision;
+    do {
+        memset(table->slots, 0, sizeof(table->slots));
+        collision = false;
+        u32 i;
+        for (i = 0; table->commands[i].name && !collision; i++) {
+            u8 *slot = table->slots + dispatch_slot(command_key(table->commands[i].name), multiplier);
+            collision = *slot;
+            *slot = i + 1;
+        }
+        if (collision) multiplier = (multiplier * 6364136223846793005ULL + 1442695040888963407ULL) | 1;
+    } while (collision);
+    table->multiplier = multiplier;
+}
+
+static const ftp_command *lookup_command(dispatch_table *table, const char *name) {
+    if (!table->multiplier) build_dispatch_table(table);
+    u64 key = command_key(name);
+    if (key) {
+        u8 slot = table->slots[dispatch_slot(key, table->multiplier)];
+        if (slot && command_key(table->commands[slot - 1].name) == key) return table->commands + slot - 1;
+    }
+    const ftp_command *unknown = table->commands;
+    while (unknown->name) unknown++;
+    return unknown;
+}
+
+/*
+    The latency of each command is recorded under the table's scope, so SITE subcommands are
+    reported separately from (and are included in) the latency of SITE itself.
+*/
+static s32 dispatch_to_handler(client_t *client, char *cmd_line, dispatch_table *table) {
+    char *args[2];
+    split(cmd_line, ' ', 1, args);
+    const ftp_command *command = lookup_command(table, args[0]);
+    u64 started = gettime();
+    s32 result = command->handler(client, args[1]);
+    stats_record_command(table->scope, command->name ? command->name : "unknown", gettime() - started);
+    return result;
+}
+
+static const ftp_command site_commands[] = {
+    { "LOADER", ftp_SITE_LOADER }, { "CLEAR", ftp_SITE_CLEAR }, { "CHMOD", ftp_SITE_CHMOD }, { "PASSWD", ftp_SITE_PASSWD },
+    { "NOPASSWD", ftp_SITE_NOPASSWD }, { "EJECT", ftp_SITE_EJECT }, { "MOUNT", ftp_SITE_MOUNT, true }, { "UNMOUNT", ftp_SITE_UNMOUNT, true },
+    { "LOAD", ftp_SITE_LOAD, true }, { "RAW", ftp_SITE_RAW }, { "RMTREE", ftp_SITE_RMTREE, true }, { "UNTAR", ftp_SITE_UNTAR, true },
+    { "STATS", ftp_SITE_STATS }, { "EXEC", ftp_SITE_EXEC }, { "RAMDISK", ftp_SITE_RAMDISK, false, DEVICE_RAM }, { "TIMEOUT", ftp_SITE_TIMEOUT }, { NULL, ftp_SITE_UNKNOWN }
+};
+static dispatch_table site_dispatch = { "SITE", site_commands };
 
 static s32 ftp_SITE(client_t *client, char *cmd_line) {
-    return dispatch_to_handler(client, cmd_line, site_commands, site_handlers);
+    return dispatch_to_handler(client, cmd_line, &site_dispatch);
+}
+
+static void cleanup_data_resources(client_t *client);
+static void cleanup_task_resources(client_t *client);
+
+static bool transfer_in_progress(client_t *client) {
+    return client->command_job || client->data_callback || client->task_callback;
+}
+
+static void finish_task_step(client_t *client);
+
+static s32 ftp_ABOR(client_t *client, char *rest) {
+    s32 result = 0;
+    if (client->data_callback) {
+        printf("Aborting transfer.\n");
+        stats_increment(STAT_TRANSFER_ABORTS);
+        cleanup_data_resources(client);
+        result = write_reply(client, 426, "Connection closed; transfer aborted.");
+    } else if (client->task_callback) {
+        printf("Aborting operation.\n");
+        finish_task_step(client);
+        result = client->task_callback(client, client->task_arg, true);
+        cleanup_task_resources(client);
+    }
+    if (result < 0) return result;
+    return write_reply(client, 226, "ABOR command successful.");
+}
+
+static s32 ftp_STAT(client_t *client, char *rest) {
+    char msg[160];
+    if (client->data_callback && !client->data_connection_connected) {
+        strcpy(msg, "Waiting for data connection.");
+    } else if (client->data_callback) {
+        u64 elapsed_ms = ticks_to_millisecs(gettime() - client->transfer_started);
+        u64 rate = elapsed_ms ? client->bytes_transferred * 1000 / elapsed_ms : 0;
+        u32 kb_per_sec = rate / 1024;
+        if (client->transfer_size > client->bytes_transferred && rate) {
+            u32 eta = (client->transfer_size - client->bytes_transferred) / rate;
+            sprintf(msg, "Transferred %llu of %llu bytes in %u seconds (%u KB/s), about %u seconds remaining.", client->bytes_transferred, client->transfer_size, (u32)(elapsed_ms / 1000), kb_per_sec, eta);
+        } else {
+            sprintf(msg, "Transferred %llu bytes in %u seconds (%u KB/s).", client->bytes_transferred, (u32)(elapsed_ms / 1000), kb_per_sec);
+        }
+    } else if (client->task_callback) {
+        strcpy(msg, "Operation in progress.");
+    } else {
+        strcpy(msg, "No transfer in progress.");
+    }
+    return write_reply(client, 211, msg);
 }
 
 static s32 ftp_NOOP(client_t *client, char *rest) {
@@ -615,63 +1119,138 @@ static s32 ftp_UNKNOWN(client_t *client, char *rest) {
     return write_reply(client, 502, "Command not implemented.");
 }
 
-static const char *unauthenticated_commands[] = { "USER", "PASS", "QUIT", "REIN", "NOOP", NULL };
-static const ftp_command_handler unauthenticated_handlers[] = { ftp_USER, ftp_PASS, ftp_QUIT, ftp_REIN, ftp_NOOP, ftp_NEEDAUTH };
-
-static const char *authenticated_commands[] = {
-    "USER", "PASS", "LIST", "PWD", "CWD", "CDUP",
-    "SIZE", "PASV", "PORT", "TYPE", "SYST", "MODE",
-    "RETR", "STOR", "APPE", "REST", "DELE", "MKD",
-    "RMD", "RNFR", "RNTO", "NLST", "QUIT", "REIN",
-    "SITE", "NOOP", "ALLO", NULL
+static const ftp_command unauthenticated_commands[] = {
+    { "USER", ftp_USER }, { "PASS", ftp_PASS }, { "QUIT", ftp_QUIT }, { "REIN", ftp_REIN }, { "NOOP", ftp_NOOP },
+    { NULL, ftp_NEEDAUTH }
 };
-static const ftp_command_handler authenticated_handlers[] = {
-    ftp_USER, ftp_PASS, ftp_LIST, ftp_PWD, ftp_CWD, ftp_CDUP,
-    ftp_SIZE, ftp_PASV, ftp_PORT, ftp_TYPE, ftp_SYST, ftp_MODE,
-    ftp_RETR, ftp_STOR, ftp_APPE, ftp_REST, ftp_DELE, ftp_MKD,
-    ftp_DELE, ftp_RNFR, ftp_RNTO, ftp_NLST, ftp_QUIT, ftp_REIN,
-    ftp_SITE, ftp_NOOP, ftp_SUPERFLUOUS, ftp_UNKNOWN
+static dispatch_table unauthenticated_dispatch = { "", unauthenticated_commands };
+
+static const ftp_command authenticated_commands[] = {
+    { "USER", ftp_USER }, { "PASS", ftp_PASS }, { "LIST", ftp_LIST, true }, { "PWD", ftp_PWD }, { "CWD", ftp_CWD, true },
+    { "CDUP", ftp_CDUP, true }, { "SIZE", ftp_SIZE, true }, { "PASV", ftp_PASV }, { "PORT", ftp_PORT }, { "TYPE", ftp_TYPE },
+    { "SYST", ftp_SYST }, { "MODE", ftp_MODE }, { "RETR", ftp_RETR, true }, { "STOR", ftp_STOR, true }, { "APPE", ftp_APPE, true },
+    { "REST", ftp_REST }, { "DELE", ftp_DELE, true }, { "MKD", ftp_MKD, true }, { "RMD", ftp_RMD, true }, { "RNFR", ftp_RNFR },
+    { "RNTO", ftp_RNTO, true }, { "NLST", ftp_NLST, true }, { "QUIT", ftp_QUIT }, { "REIN", ftp_REIN },
+    { "SITE", ftp_SITE }, { "NOOP", ftp_NOOP }, { "ALLO", ftp_SUPERFLUOUS }, { "ABOR", ftp_ABOR }, { "STAT", ftp_STAT },
+    { NULL, ftp_UNKNOWN }
 };
+static dispatch_table authenticated_dispatch = { "", authenticated_commands };
+
+/*
+    Returns the device that a command line operates on, or DEVICE_NONE for commands that do not take a path.
+    Leading options, as in "LIST -aL" or "RMD -r", are skipped.  Called on the main thread before the command
+    is run, so the dispatch tables are always built there.
+*/
+static io_device command_device(client_t *client, dispatch_table *table, char *cmd_line) {
+    char name[MAX_COMMAND_NAME + 1];
+    u32 name_length = strcspn(cmd_line, " ");
+    if (name_length > MAX_COMMAND_NAME) return DEVICE_NONE;
+    memcpy(name, cmd_line, name_length);
+    name[name_length] = '\0';
+    const ftp_command *command = lookup_command(table, name);
+    char *path = cmd_line + name_length;
+    while (*path == ' ') path++;
+    if (command->handler == ftp_SITE) return command_device(client, &site_dispatch, path);
+    if (!command->takes_path) return command->device;
+    if (*path == '-') {
+        path = strchr(path, ' ');
+        path = path ? path + 1 : "";
+    }
+    return to_device(client->cwd, path);
+}
+
+/*
+    Clients send ABOR preceded by the telnet "interrupt process" and "synch" sequences.
+*/
+static char *skip_telnet_commands(char *cmd_line) {
+    while ((u8)*cmd_line == 0xff && cmd_line[1]) cmd_line += 2;
+    if ((u8)*cmd_line == 0xf2) cmd_line++;
+    return cmd_line;
+}
+
+static bool is_command(char *cmd_line, const char *name) {
+    cmd_line = skip_telnet_commands(cmd_line);
+    return !strncasecmp(name, cmd_line, 4) && (!cmd_line[4] || cmd_line[4] == ' ');
+}
+
+/*
+    ABOR and STAT are executed immediately even while a transfer is in progress.
+*/
+static bool is_urgent_command(char *cmd_line) {
+    return is_command(cmd_line, "ABOR") || is_command(cmd_line, "STAT");
+}
 
 /*
     returns negative to signal an error that requires closing the connection
 */
 static s32 process_command(client_t *client, char *cmd_line) {
+    cmd_line = skip_telnet_commands(cmd_line);
     if (strlen(cmd_line) == 0) {
         return 0;
     }
 
     printf("Got command: %s\n", cmd_line);
 
-    const char **commands = unauthenticated_commands;
-    const ftp_command_handler *handlers = unauthenticated_handlers;
-
-    if (client->authenticated) {
-        commands = authenticated_commands;
-        handlers = authenticated_handlers;
-    }
-
-    return dispatch_to_handler(client, cmd_line, commands, handlers);
+    return dispatch_to_handler(client, cmd_line, client->authenticated ? &authenticated_dispatch : &unauthenticated_dispatch);
 }
 
 static void cleanup_data_resources(client_t *client) {
-    if (client->data_socket >= 0 && client->data_socket != client->passive_socket) {
-        net_close_blocking(client->data_socket);
+    if (client->transfer_started) {
+        stats_record_transfer(client->transfer_partition, client->transfer_upload, client->bytes_transferred, gettime() - client->transfer_started);
+        client->transfer_started = 0;
+    }
+    s32 data_socket = client->data_socket != client->passive_socket ? client->data_socket : -1;
+    if (client->data_job) {
+        // the worker still has the socket and callback argument, release them once it is done
+        abandon_job(client->data_job, data_socket, client->data_connection_cleanup, client->data_connection_callback_arg);
+        client->data_job = NULL;
+    } else {
+        if (data_socket >= 0) {
+            net_close_blocking(data_socket);
+        }
+        if (client->data_connection_cleanup) {
+            client->data_connection_cleanup(client->data_connection_callback_arg);
+        }
     }
     client->data_socket = -1;
     client->data_connection_connected = false;
     client->data_callback = NULL;
-    if (client->data_connection_cleanup) {
-        client->data_connection_cleanup(client->data_connection_callback_arg);
-    }
     client->data_connection_callback_arg = NULL;
     client->data_connection_cleanup = NULL;
     client->data_connection_timer = 0;
+    client->last_activity = gettime();
+}
+
+/*
+    Waits for a task step running on a worker, so that the task can be aborted or cleaned up.
+    A step is one bounded batch of work, so this does not wait long.
+*/
+static void finish_task_step(client_t *client) {
+    if (client->task_job) {
+        wait_for_job(client->task_job);
+        client->task_job = NULL;
+    }
+}
+
+static void cleanup_task_resources(client_t *client) {
+    finish_task_step(client);
+    client->task_callback = NULL;
+    if (client->task_cleanup) {
+        client->task_cleanup(client->task_arg);
+    }
+    client->task_arg = NULL;
+    client->task_cleanup = NULL;
+    client->last_activity = gettime();
 }
 
 static void cleanup_client(client_t *client) {
+    if (client->command_job) {
+        client->closing = true; // the worker is still using the client, process_command_events closes it later
+        return;
+    }
     net_close_blocking(client->socket);
     cleanup_data_resources(client);
+    cleanup_task_resources(client);
     close_passive_socket(client);
     int client_index;
     for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
@@ -682,6 +1261,7 @@ static void cleanup_client(client_t *client) {
     }
     free(client);
     num_clients--;
+    stats_set_sessions(num_clients);
     printf("Client disconnected.\n");
 }
 
@@ -690,10 +1270,15 @@ void cleanup_ftp() {
     for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
         client_t *client = clients[client_index];
         if (client) {
+            if (client->command_job) {
+                wait_for_job(client->command_job);
+                client->command_job = NULL;
+            }
             write_reply(client, 421, "Service not available, closing control connection.");
             cleanup_client(client);
         }
     }
+    close_passive_listeners();
 }
 
 static bool process_accept_events(s32 server) {
@@ -710,6 +1295,7 @@ static bool process_accept_events(s32 server) {
 
         if (num_clients == MAX_CLIENTS) {
             printf("Maximum of %u clients reached, not accepting client.\n", MAX_CLIENTS);
+            stats_increment(STAT_CONNECTIONS_REFUSED);
             net_close(peer);
             return true;
         }
@@ -720,20 +1306,35 @@ static bool process_accept_events(s32 server) {
             net_close(peer);
             return true;
         }
+        set_blocking(peer, false);
         client->socket = peer;
         client->representation_type = 'A';
         client->passive_socket = -1;
         client->data_socket = -1;
         strcpy(client->cwd, "/");
         *client->pending_rename = '\0';
+        *client->pending_untar = '\0';
+        client->pending_exec = false;
         client->restart_marker = 0;
         client->authenticated = false;
-        client->offset = 0;
+        client->last_activity = gettime();
+        client->buf_start = 0;
+        client->buf_length = 0;
+        client->buf_scanned = 0;
+        client->num_queued = 0;
+        client->queued_bytes = 0;
+        client->command_job = NULL;
+        client->closing = false;
         client->data_connection_connected = false;
         client->data_callback = NULL;
         client->data_connection_callback_arg = NULL;
         client->data_connection_cleanup = NULL;
+        client->data_job = NULL;
         client->data_connection_timer = 0;
+        client->task_callback = NULL;
+        client->task_arg = NULL;
+        client->task_cleanup = NULL;
+        client->task_job = NULL;
         memcpy(&client->address, &client_address, sizeof(client_address));
         int client_index;
         if (write_reply(client, 220, "ftpii") < 0) {
@@ -748,11 +1349,35 @@ static bool process_accept_events(s32 server) {
                 }
             }
             num_clients++;
+            stats_increment(STAT_CONNECTIONS);
+            stats_set_sessions(num_clients);
         }
     }
     return true;
 }
 
+static io_device transfer_device(client_t *client) {
+    return client->transfer_partition ? client->transfer_partition->device : DEVICE_NONE;
+}
+
+/*
+    Runs the data callback on the worker of the transfer's device, returning -EAGAIN until the call finishes, and
+    starting the next call as soon as one transfers data.  The callback is called directly if no job is available.
+*/
+static s32 run_data_callback(client_t *client) {
+    s32 result;
+    if (!client->data_job) {
+        client->data_job = start_job(transfer_device(client), client->data_callback, client->data_socket, client->data_connection_callback_arg);
+        if (!client->data_job) return client->data_callback(client->data_socket, client->data_connection_callback_arg);
+    }
+    if (!finish_job(client->data_job, &result)) return -EAGAIN;
+    client->data_job = NULL;
+    if (result > 0) {
+        client->data_job = start_job(transfer_device(client), client->data_callback, client->data_socket, client->data_connection_callback_arg);
+    }
+    return result;
+}
+
 static void process_data_events(client_t *client) {
     s32 result;
     if (!client->data_connection_connected) {
@@ -761,6 +1386,7 @@ static void process_data_events(client_t *client) {
             socklen_t addrlen = sizeof(data_peer_address);
             result = net_accept(client->passive_socket, (struct sockaddr *)&data_peer_address ,&addrlen);
             if (result >= 0) {
+                set_blocking(result, false);
                 client->data_socket = result;
                 client->data_connection_connected = true;
             }
@@ -775,18 +1401,33 @@ static void process_data_events(client_t *client) {
         }
         if (client->data_connection_connected) {
             result = 1;
+            client->transfer_started = client->transfer_progress = gettime();
             printf("Connected to client!  Transferring data...\n");
         } else if (gettime() > client->data_connection_timer) {
             result = -1;
             printf("Timed out waiting for data connection.\n");
+            stats_increment(STAT_DATA_CONNECTION_TIMEOUTS);
         }
     } else {
-        result = client->data_callback(client->data_socket, client->data_connection_callback_arg);
+        result = run_data_callback(client);
+        if (result > 0) {
+            client->bytes_transferred += result;
+            client->transfer_progress = gettime();
+        } else if (result == -EAGAIN && stall_timeout && gettime() - client->transfer_progress > secs_to_ticks(stall_timeout)) {
+            result = -ETIMEDOUT;
+        }
     }
 
-    if (result <= 0 && result != -EAGAIN) {
+    if (result == -ETIMEDOUT) {
+        printf("Transfer stalled, closing client.\n");
+        stats_increment(STAT_TRANSFER_STALLS);
+        cleanup_data_resources(client);
+        write_reply(client, 421, "Data transfer stalled, closing control connection.");
+        cleanup_client(client);
+    } else if (result <= 0 && result != -EAGAIN) {
         cleanup_data_resources(client);
         if (result < 0) {
+            stats_increment(STAT_TRANSFER_ERRORS);
             result = write_reply(client, 520, "Closing data connection, error occurred during transfer.");
         } else {
             result = write_reply(client, 226, "Closing data connection, transfer successful.");
@@ -797,14 +1438,179 @@ static void process_data_events(client_t *client) {
     }
 }
 
+static s32 run_task_step(s32 unused, client_t *client) {
+    return client->task_callback(client, client->task_arg, false);
+}
+
+static void process_task_events(client_t *client) {
+    s32 result;
+    if (client->task_job) {
+        if (!finish_job(client->task_job, &result)) return;
+        client->task_job = NULL;
+    } else if (!(client->task_job = start_job(client->task_device, (job_callback)run_task_step, -1, client))) {
+        result = run_task_step(-1, client);
+    } else {
+        return;
+    }
+    if (result != -EAGAIN) {
+        cleanup_task_resources(client);
+        if (result < 0) {
+            cleanup_client(client);
+        }
+    }
+}
+
+static char *buffered_char(client_t *client, u32 offset) {
+    return client->buf + (client->buf_start + offset) % FTP_BUFFER_SIZE;
+}
+
+/*
+    Returns the line of length bytes (including CRLF) at offset in the ring buffer as a null-terminated string.
+    The line is terminated in place, over its CR, unless it wraps around the end of the buffer, in which case
+    it is copied into copy, which must hold FTP_BUFFER_SIZE bytes.
+*/
+static char *buffered_line(client_t *client, u32 offset, u32 length, char *copy) {
+    u32 start = (client->buf_start + offset) % FTP_BUFFER_SIZE;
+    u32 text_length = length - CRLF_LENGTH;
+    if (start + text_length < FTP_BUFFER_SIZE) {
+        client->buf[start + text_length] = '\0';
+        return client->buf + start;
+    }
+    u32 first_part = FTP_BUFFER_SIZE - start;
+    memcpy(copy, client->buf + start, first_part);
+    memcpy(copy + first_part, client->buf, text_length - first_part);
+    copy[text_length] = '\0';
+    return copy;
+}
+
+/*
+    Removes a line that has been executed.  Only the unscanned bytes after an urgent command, which
+    is executed from behind the queued lines, ever need to be moved.
+*/
+static void remove_buffered_line(client_t *client, u32 offset, u32 length) {
+    if (offset) {
+        u32 i;
+        for (i = offset + length; i < client->buf_length; i++) {
+            *buffered_char(client, i - length) = *buffered_char(client, i);
+        }
+    } else {
+        client->buf_start = (client->buf_start + length) % FTP_BUFFER_SIZE;
+    }
+    client->buf_length -= length;
+    client->buf_scanned -= length;
+}
+
+static s32 run_command(s32 unused, client_t *client) {
+    return process_command(client, client->command_line);
+}
+
+/*
+    Executes the complete lines in the buffer, scanning each received byte once.
+    While a transfer is in progress, urgent commands are executed immediately, and other
+    commands are left queued in the buffer to be executed in order once it completes.
+    Commands that take a path are run on the worker of its device, and everything after them,
+    urgent or not, is queued until they finish, though an ABOR asks the running command to stop.
+    URGENT_RESERVE bytes of the buffer are kept for ABOR and STAT, so that they can still be read
+    however many commands are queued.  A command that would eat into them is refused, or left unread
+    while a worker is writing the replies of the running command.
+    Returns false if the client was closed.
+*/
+static bool process_buffered_commands(client_t *client) {
+    char copy[FTP_BUFFER_SIZE];
+    while (1) {
+        u32 offset = 0, length;
+        bool queued = client->num_queued && !transfer_in_progress(client);
+        if (queued) {
+            length = client->queued_lengths[0];
+            client->num_queued--;
+            client->queued_bytes -= length;
+            memmove(client->queued_lengths, client->queued_lengths + 1, client->num_queued * sizeof(u16));
+        } else {
+            offset = client->queued_bytes;
+            bool line_complete = false;
+            while (!line_complete && client->buf_scanned < client->buf_length) {
+                u32 position = (client->buf_start + client->buf_scanned) % FTP_BUFFER_SIZE;
+                u32 segment_length = client->buf_length - client->buf_scanned;
+                if (segment_length > FTP_BUFFER_SIZE - position) segment_length = FTP_BUFFER_SIZE - position;
+                char *segment = client->buf + position, *c = segment, *segment_end = segment + segment_length;
+                while (c < segment_end && *c && *c != '\n') c++;
+                client->buf_scanned += c - segment;
+                if (c == segment_end) continue;
+                if (!*c) {
+                    printf("Received a null byte from client, closing connection ;-)\n"); // i have decided this isn't allowed =P
+                    goto close;
+                }
+                client->buf_scanned++;
+                line_complete = true;
+            }
+            if (!line_complete) return true;
+            length = client->buf_scanned - offset;
+            if (length < CRLF_LENGTH || *buffered_char(client, client->buf_scanned - CRLF_LENGTH) != CRLF[0]) {
+                printf("Received a line-feed from client without preceding carriage return, closing connection ;-)\n"); // i have decided this isn't allowed =P
+                goto close;
+            }
+            if (transfer_in_progress(client)) {
+                char *line = buffered_line(client, offset, length, copy);
+                bool urgent = is_urgent_command(line);
+                if (client->command_job && is_command(line, "ABOR")) {
+                    __atomic_store_n(&client->command_aborted, true, __ATOMIC_RELAXED);
+                }
+                if (client->command_job || !urgent) {
+                    if (urgent || client->queued_bytes + length <= FTP_BUFFER_SIZE - URGENT_RESERVE) {
+                        client->queued_lengths[client->num_queued++] = length;
+                        client->queued_bytes += length;
+                    } else if (client->command_job) {
+                        client->buf_scanned = offset; // scanned again once the command finishes
+                        return true;
+                    } else {
+                        remove_buffered_line(client, offset, length);
+                        if (write_reply(client, 450, "Too many commands queued, command refused.") < 0) goto close;
+                    }
+                    continue;
+                }
+            }
+        }
+
+        char *line = buffered_line(client, offset, length, copy);
+        dispatch_table *table = client->authenticated ? &authenticated_dispatch : &unauthenticated_dispatch;
+        io_device device = command_device(client, table, skip_telnet_commands(line));
+        if (device != DEVICE_NONE) {
+            strcpy(client->command_line, line);
+            remove_buffered_line(client, offset, length);
+            client->command_aborted = false;
+            if ((client->command_job = start_job(device, (job_callback)run_command, -1, client))) continue;
+            line = client->command_line;
+            length = 0;
+        }
+        s32 result = process_command(client, line);
+        if (result < 0) {
+            if (result != -EQUIT) {
+                printf("Closing connection due to error while processing command: %s\n", line);
+            }
+            goto close;
+        }
+        if (length) remove_buffered_line(client, offset, length);
+    }
+
+    close:
+    cleanup_client(client);
+    return false;
+}
+
 static void process_control_events(client_t *client) {
     s32 bytes_read;
-    while (client->offset < (FTP_BUFFER_SIZE - 1)) {
-        if (client->data_callback) {
-            return;
+    while (process_buffered_commands(client)) {
+        if (client->buf_length == FTP_BUFFER_SIZE) {
+            if (client->num_queued) {
+                return; // the buffer is full of queued commands, stop reading until the transfer completes
+            }
+            printf("Received line longer than %u bytes, closing client.\n", FTP_BUFFER_SIZE - CRLF_LENGTH);
+            goto recv_loop_end;
         }
-        char *offset_buf = client->buf + client->offset;
-        if ((bytes_read = net_read(client->socket, offset_buf, FTP_BUFFER_SIZE - 1 - client->offset)) < 0) {
+        u32 end = (client->buf_start + client->buf_length) % FTP_BUFFER_SIZE;
+        u32 space = FTP_BUFFER_SIZE - client->buf_length;
+        if (end + space > FTP_BUFFER_SIZE) space = FTP_BUFFER_SIZE - end;
+        if ((bytes_read = net_read(client->socket, client->buf + end, space)) < 0) {
             if (bytes_read != -EAGAIN) {
                 printf("Read error %i occurred, closing client.\n", bytes_read);
                 goto recv_loop_end;
@@ -813,60 +1619,55 @@ static void process_control_events(client_t *client) {
         } else if (bytes_read == 0) {
             goto recv_loop_end; // EOF from client
         }
-        client->offset += bytes_read;
-        client->buf[client->offset] = '\0';
-    
-        if (strchr(offset_buf, '\0') != (client->buf + client->offset)) {
-            printf("Received a null byte from client, closing connection ;-)\n"); // i have decided this isn't allowed =P
-            goto recv_loop_end;
-        }
-
-        char *next;
-        char *end;
-        for (next = client->buf; (end = strstr(next, CRLF)) && !client->data_callback; next = end + CRLF_LENGTH) {
-            *end = '\0';
-            if (strchr(next, '\n')) {
-                printf("Received a line-feed from client without preceding carriage return, closing connection ;-)\n"); // i have decided this isn't allowed =P
-                goto recv_loop_end;
-            }
-        
-            if (*next) {
-                s32 result;
-                if ((result = process_command(client, next)) < 0) {
-                    if (result != -EQUIT) {
-                        printf("Closing connection due to error while processing command: %s\n", next);
-                    }
-                    goto recv_loop_end;
-                }
-            }
-        
-        }
-    
-        if (next != client->buf) { // some lines were processed
-            client->offset = strlen(next);
-            char tmp_buf[client->offset];
-            memcpy(tmp_buf, next, client->offset);
-            memcpy(client->buf, tmp_buf, client->offset);
-        }
+        client->buf_length += bytes_read;
+        if (!client->command_job) client->last_activity = gettime();
     }
-    printf("Received line longer than %u bytes, closing client.\n", FTP_BUFFER_SIZE - 1);
+    return;
 
     recv_loop_end:
     cleanup_client(client);
 }
 
+/*
+    Collects the result of a command run on a worker, closing the connection if the command failed
+    or the client went away meanwhile.
+*/
+static void process_command_events(client_t *client) {
+    s32 result;
+    if (!finish_job(client->command_job, &result)) return;
+    client->command_job = NULL;
+    client->last_activity = gettime();
+    if (result < 0 && result != -EQUIT) {
+        printf("Closing connection due to error while processing command: %s\n", client->command_line);
+    }
+    if (result < 0 || client->closing) cleanup_client(client);
+}
+
 bool process_ftp_events(s32 server) {
     bool network_down = !process_accept_events(server);
+    reap_abandoned_jobs();
     int client_index;
     for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
         client_t *client = clients[client_index];
-        if (client) {
-            if (client->data_callback) {
-                process_data_events(client);
-            } else {
-                process_control_events(client);
-            }
+        if (client && client->command_job) {
+            process_command_events(client);
+        } else if (client && client->data_callback) {
+            process_data_events(client);
+        } else if (client && client->task_callback) {
+            process_task_events(client);
+        }
+        client = clients[client_index];
+        if (client && !client->closing) {
+            process_control_events(client);
+        }
+        client = clients[client_index];
+        if (client && idle_timeout && !transfer_in_progress(client) && gettime() - client->last_activity > secs_to_ticks(idle_timeout)) {
+            printf("Client idle for %u seconds, closing connection.\n", idle_timeout);
+            stats_increment(STAT_IDLE_TIMEOUTS);
+            write_reply(client, 421, "Idle timeout, closing control connection.");
+            cleanup_client(client);
         }
     }
+    replenish_passive_listeners();
     return network_down;
 }
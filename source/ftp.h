@@ -28,6 +28,13 @@ misrepresented as being the original software.
 
 void accept_ftp_client(s32 server);
 void set_ftp_password(char *new_password);
+#define DEFAULT_IDLE_TIMEOUT 300
+
+/*
+    Sets how long, in seconds, a control connection may sit idle between commands, and a data
+    transfer may go without progress, before the client is sent 421 and disconnected.  0 disables either.
+*/
+void set_ftp_timeouts(u32 idle_seconds, u32 stall_seconds);
 bool process_ftp_events(s32 server);
 void cleanup_ftp();
 
@@ -31,11 +31,15 @@ misrepresented as being the original software.
 #include <wiiuse/wpad.h>
 
 #include "dvd.h"
+#include "dvdcache.h"
 #include "ftp.h"
 #include "fs.h"
+#include "loader.h"
 #include "net.h"
 #include "pad.h"
 #include "reset.h"
+#include "stats.h"
+#include "worker.h"
 
 static const u16 PORT = 21;
 static const char *APP_DIR_PREFIX = "ftpii_";
@@ -65,9 +69,13 @@ static void initialise_ftpii() {
     PAD_Init();
     WPAD_Init();
     initialise_reset_buttons();
+    start_pad_polling();
     printf("To exit, hold A on controller #1 or press the reset button.\n");
-    initialise_network();
+    start_network_initialisation();
+    initialise_dvd_cache();
     initialise_fs();
+    initialise_stats();
+    initialise_workers();
     printf("To remount a device, hold B on controller #1.\n");
 }
 
@@ -119,21 +127,32 @@ int main(int argc, char **argv) {
     bool network_down = true;
     s32 server = -1;
     while (!reset()) {
-        if (network_down) {
-            net_close(server);
-            initialise_network();
+        if (network_down && !network_initialising()) {
             server = create_server(PORT);
-            if (server < 0) continue;
-            printf("Listening on TCP port %u...\n", PORT);
-            network_down = false;
+            if (server >= 0) {
+                printf("Listening on TCP port %u...\n", PORT);
+                network_down = false;
+            } else {
+                start_network_initialisation();
+            }
         }
         check_dvd_mount();
-        network_down = process_ftp_events(server);
+        if (network_down) {
+            usleep(1000); // let the network LWP run
+        } else if (process_ftp_events(server)) {
+            network_down = true;
+            net_close(server);
+            server = -1;
+            start_network_initialisation();
+        }
         process_wiimote_events();
         process_gamecube_events();
         process_timer_events();
     }
+    stop_pad_polling();
+    finish_network_initialisation();
     cleanup_ftp();
+    cleanup_workers();
     net_close(server);
 
     u32 i;
@@ -145,6 +164,7 @@ int main(int argc, char **argv) {
     DI_Close();
     ISFS_Deinitialize();
 
+    run_pending_boot();
     maybe_poweroff();
     return 0;
 }
@@ -0,0 +1,460 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <malloc.h>
+#include <ogc/mutex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "isfscache.h"
+#include "stats.h"
+
+#define ISFS_CACHE_SIZE (256 * 1024)
+#define DIR_BUCKETS 64
+#define MAX_WRITERS 8
+
+static const u32 ISFS_CACHE_DEVICE_ID = 38746;
+
+typedef struct {
+    const char *name; // stored after the entries, in the same allocation
+    struct stat st;
+} cached_entry;
+
+/*
+    One directory listing.  Iterators hold references to it, so it is only freed once it has been
+    dropped from the cache and every iterator over it has been closed.
+*/
+typedef struct cached_dir {
+    struct cached_dir *next; // in its hash bucket
+    struct cached_dir *older;
+    struct cached_dir *newer;
+    u32 refs;
+    bool cached;
+    u32 size;
+    char *path;
+    u32 num_entries;
+    cached_entry entries[];
+} cached_dir;
+
+typedef struct {
+    DIR_ITER iter; // first, so that the DIR_ITER handed out can be cast back
+    cached_dir *dir;
+    u32 position;
+} cached_iter;
+
+/*
+    Files open for writing; their directories are not cached until they are closed, as their sizes are changing.
+*/
+typedef struct {
+    FILE *f; // NULL while the file is being opened
+    char *path; // NULL while the writer is free
+    char *dir_path;
+} writer;
+
+static cached_dir *buckets[DIR_BUCKETS];
+static cached_dir *oldest = NULL;
+static cached_dir *newest = NULL;
+static u32 cache_used = 0;
+static u32 generation = 0; // advanced by every change, so that listings read meanwhile are not cached
+static writer writers[MAX_WRITERS];
+static mutex_t cache_mutex = LWP_MUTEX_NULL;
+
+static bool is_isfs_path(const char *path) {
+    return !strncmp(PA_ISFS->prefix, path, strlen(PA_ISFS->prefix));
+}
+
+/*
+    Stores path without trailing slashes (other than the one ending the prefix) in key, which must hold MAXPATHLEN characters.
+*/
+static bool to_key(const char *path, char *key) {
+    size_t length = strlen(path), prefix_length = strlen(PA_ISFS->prefix);
+    if (length >= MAXPATHLEN) return false;
+    while (length > prefix_length && path[length - 1] == '/') length--;
+    memcpy(key, path, length);
+    key[length] = '\0';
+    return true;
+}
+
+/*
+    Stores the key of the directory containing key in parent, and returns the entry's name within it,
+    or returns NULL for the root of the partition.
+*/
+static const char *split_key(const char *key, char *parent) {
+    size_t prefix_length = strlen(PA_ISFS->prefix);
+    if (!key[prefix_length]) return NULL;
+    const char *slash = strrchr(key, '/');
+    size_t parent_length = slash - key < prefix_length ? prefix_length : slash - key;
+    memcpy(parent, key, parent_length);
+    parent[parent_length] = '\0';
+    return slash + 1;
+}
+
+static bool within(const char *path, const char *key) {
+    size_t length = strlen(key);
+    return !strncmp(path, key, length) && (!path[length] || path[length] == '/' || key[length - 1] == '/');
+}
+
+static u32 hash_key(const char *key) {
+    u32 hash = 2166136261u;
+    while (*key) hash = (hash ^ (u8)*key++) * 16777619u;
+    return hash % DIR_BUCKETS;
+}
+
+static cached_dir *find_dir(const char *key) {
+    cached_dir *dir;
+    for (dir = buckets[hash_key(key)]; dir && strcmp(dir->path, key); dir = dir->next);
+    return dir;
+}
+
+static void unlink_from_age_list(cached_dir *dir) {
+    if (dir->older) dir->older->newer = dir->newer;
+    else oldest = dir->newer;
+    if (dir->newer) dir->newer->older = dir->older;
+    else newest = dir->older;
+}
+
+static void link_as_newest(cached_dir *dir) {
+    dir->older = newest;
+    dir->newer = NULL;
+    if (newest) newest->newer = dir;
+    else oldest = dir;
+    newest = dir;
+}
+
+static void release_dir(cached_dir *dir) {
+    if (!--dir->refs) free(dir);
+}
+
+static void drop_dir(cached_dir *dir) {
+    cached_dir **link;
+    for (link = buckets + hash_key(dir->path); *link != dir; link = &(*link)->next);
+    *link = dir->next;
+    unlink_from_age_list(dir);
+    cache_used -= dir->size;
+    dir->cached = false;
+    release_dir(dir);
+}
+
+static void insert_dir(cached_dir *dir) {
+    if (dir->size > ISFS_CACHE_SIZE) return;
+    while (cache_used + dir->size > ISFS_CACHE_SIZE) drop_dir(oldest);
+    u32 bucket = hash_key(dir->path);
+    dir->next = buckets[bucket];
+    buckets[bucket] = dir;
+    link_as_newest(dir);
+    cache_used += dir->size;
+    dir->cached = true;
+    dir->refs++;
+}
+
+static void clear() {
+    generation++;
+    while (oldest) drop_dir(oldest);
+}
+
+static bool has_writer(const char *key) {
+    u32 i;
+    for (i = 0; i < MAX_WRITERS; i++) {
+        if (writers[i].path && !strcmp(writers[i].dir_path, key)) return true;
+    }
+    return false;
+}
+
+/*
+    Drops the listings of key, everything under it, and the directory containing it.
+*/
+static void invalidate(const char *key) {
+    char parent[MAXPATHLEN];
+    bool has_parent = split_key(key, parent);
+    generation++;
+    u32 i;
+    for (i = 0; i < DIR_BUCKETS; i++) {
+        cached_dir *dir = buckets[i];
+        while (dir) {
+            cached_dir *next = dir->next;
+            if (within(dir->path, key) || (has_parent && !strcmp(dir->path, parent))) drop_dir(dir);
+            dir = next;
+        }
+    }
+}
+
+static void invalidate_path(const char *path) {
+    char key[MAXPATHLEN];
+    if (!is_isfs_path(path)) return;
+    LWP_MutexLock(cache_mutex);
+    if (to_key(path, key)) invalidate(key);
+    else clear();
+    LWP_MutexUnlock(cache_mutex);
+}
+
+typedef struct {
+    char *name;
+    struct stat st;
+} read_entry;
+
+/*
+    Reads a whole directory, with the cache unlocked.  The listing is returned with one reference, and is not cached.
+*/
+static cached_dir *read_dir(const char *key) {
+    DIR_ITER *iter = diropen(key);
+    if (!iter) return NULL;
+    read_entry *entries = NULL;
+    u32 num_entries = 0, capacity = 0, names_size = 0;
+    char filename[MAXPATHLEN];
+    struct stat st;
+    cached_dir *dir = NULL;
+    while (!dirnext(iter, filename, &st)) {
+        if (num_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            read_entry *grown = realloc(entries, capacity * sizeof(read_entry));
+            if (!grown) goto end;
+            entries = grown;
+        }
+        if (!(entries[num_entries].name = strdup(filename))) goto end;
+        entries[num_entries++].st = st;
+        names_size += strlen(filename) + 1;
+    }
+
+    u32 size = sizeof(cached_dir) + num_entries * sizeof(cached_entry) + names_size + strlen(key) + 1;
+    if (!(dir = malloc(size))) goto end;
+    dir->refs = 1;
+    dir->cached = false;
+    dir->size = size;
+    dir->num_entries = num_entries;
+    char *strings = (char *)(dir->entries + num_entries);
+    u32 i;
+    for (i = 0; i < num_entries; i++) {
+        strcpy(strings, entries[i].name);
+        dir->entries[i].name = strings;
+        dir->entries[i].st = entries[i].st;
+        strings += strlen(strings) + 1;
+    }
+    dir->path = strcpy(strings, key);
+
+    end:
+    dirclose(iter);
+    while (num_entries) free(entries[--num_entries].name);
+    free(entries);
+    if (!dir) errno = ENOMEM;
+    return dir;
+}
+
+/*
+    Returns the listing of the directory key with a reference held by the caller, reading and caching it if
+    necessary, or NULL if it cannot be read or should not be cached right now.
+*/
+static cached_dir *get_dir(const char *key) {
+    LWP_MutexLock(cache_mutex);
+    if (has_writer(key)) {
+        LWP_MutexUnlock(cache_mutex);
+        return NULL;
+    }
+    cached_dir *dir = find_dir(key);
+    if (dir) {
+        unlink_from_age_list(dir);
+        link_as_newest(dir);
+        dir->refs++;
+        LWP_MutexUnlock(cache_mutex);
+        stats_increment(STAT_ISFS_CACHE_HITS);
+        return dir;
+    }
+    u32 read_generation = generation;
+    LWP_MutexUnlock(cache_mutex);
+
+    stats_increment(STAT_ISFS_CACHE_MISSES);
+    if (!(dir = read_dir(key))) return NULL;
+
+    LWP_MutexLock(cache_mutex);
+    if (generation == read_generation && !find_dir(key)) insert_dir(dir);
+    LWP_MutexUnlock(cache_mutex);
+    return dir;
+}
+
+static void put_dir(cached_dir *dir) {
+    LWP_MutexLock(cache_mutex);
+    release_dir(dir);
+    LWP_MutexUnlock(cache_mutex);
+}
+
+void initialise_isfs_cache() {
+    LWP_MutexInit(&cache_mutex, false);
+}
+
+void isfs_cache_clear() {
+    LWP_MutexLock(cache_mutex);
+    clear();
+    LWP_MutexUnlock(cache_mutex);
+}
+
+int isfs_cache_stat(const char *path, struct stat *st) {
+    char key[MAXPATHLEN], parent[MAXPATHLEN];
+    if (!is_isfs_path(path) || !to_key(path, key)) return stat(path, st);
+    const char *name = split_key(key, parent);
+    cached_dir *dir = name ? get_dir(parent) : NULL;
+    if (!dir) return stat(path, st);
+    int result = -1;
+    u32 i;
+    for (i = 0; i < dir->num_entries; i++) {
+        if (!strcmp(dir->entries[i].name, name)) {
+            *st = dir->entries[i].st;
+            result = 0;
+            break;
+        }
+    }
+    put_dir(dir);
+    if (result) errno = ENOENT;
+    return result;
+}
+
+DIR_ITER *isfs_cache_diropen(const char *path) {
+    char key[MAXPATHLEN];
+    if (!is_isfs_path(path) || !to_key(path, key)) return diropen(path);
+    cached_dir *dir = get_dir(key);
+    if (!dir) return diropen(path);
+    cached_iter *iter = malloc(sizeof(cached_iter));
+    if (!iter) {
+        put_dir(dir);
+        errno = ENOMEM;
+        return NULL;
+    }
+    iter->iter.device = ISFS_CACHE_DEVICE_ID;
+    iter->iter.dirStruct = NULL;
+    iter->dir = dir;
+    iter->position = 0;
+    return &iter->iter;
+}
+
+int isfs_cache_dirnext(DIR_ITER *iter, char *filename, struct stat *st) {
+    if (iter->device != ISFS_CACHE_DEVICE_ID) return dirnext(iter, filename, st);
+    cached_iter *cached = (cached_iter *)iter;
+    if (cached->position == cached->dir->num_entries) {
+        errno = ENOENT;
+        return -1;
+    }
+    cached_entry *entry = cached->dir->entries + cached->position++;
+    strcpy(filename, entry->name);
+    *st = entry->st;
+    return 0;
+}
+
+int isfs_cache_dirclose(DIR_ITER *iter) {
+    if (iter->device != ISFS_CACHE_DEVICE_ID) return dirclose(iter);
+    cached_iter *cached = (cached_iter *)iter;
+    put_dir(cached->dir);
+    free(cached);
+    return 0;
+}
+
+int isfs_cache_unlink(const char *path) {
+    int result = unlink(path);
+    invalidate_path(path);
+    return result;
+}
+
+int isfs_cache_mkdir(const char *path, mode_t mode) {
+    int result = mkdir(path, mode);
+    invalidate_path(path);
+    return result;
+}
+
+int isfs_cache_rename(const char *from_path, const char *to_path) {
+    int result = rename(from_path, to_path);
+    invalidate_path(from_path);
+    invalidate_path(to_path);
+    return result;
+}
+
+/*
+    The writer is claimed before the file is opened, since opening it for writing may already create or truncate it.
+*/
+FILE *isfs_cache_fopen(const char *path, const char *mode) {
+    char key[MAXPATHLEN], parent[MAXPATHLEN];
+    if (!is_isfs_path(path) || (*mode == 'r' && !strchr(mode, '+'))) return fopen(path, mode);
+    if (!to_key(path, key) || !split_key(key, parent)) {
+        FILE *f = fopen(path, mode);
+        invalidate_path(path);
+        return f;
+    }
+    LWP_MutexLock(cache_mutex);
+    writer *w = NULL;
+    u32 i;
+    for (i = 0; i < MAX_WRITERS && !w; i++) {
+        if (!writers[i].path) w = writers + i;
+    }
+    s32 error = EMFILE;
+    if (w && (!(w->path = strdup(key)) || !(w->dir_path = strdup(parent)))) {
+        free(w->path);
+        w->path = NULL;
+        w = NULL;
+        error = ENOMEM;
+    }
+    LWP_MutexUnlock(cache_mutex);
+    if (!w) {
+        errno = error;
+        return NULL;
+    }
+
+    FILE *f = fopen(path, mode);
+    error = errno;
+    LWP_MutexLock(cache_mutex);
+    invalidate(key);
+    if (f) {
+        w->f = f;
+    } else {
+        free(w->path);
+        free(w->dir_path);
+        w->path = NULL;
+    }
+    LWP_MutexUnlock(cache_mutex);
+    errno = error;
+    return f;
+}
+
+/*
+    The writer is released only after the file is closed, so its directory is not cached with the size it had
+    before the final flush.
+*/
+int isfs_cache_fclose(FILE *f) {
+    writer *w = NULL;
+    LWP_MutexLock(cache_mutex);
+    u32 i;
+    for (i = 0; i < MAX_WRITERS && !w; i++) {
+        if (writers[i].f == f) w = writers + i;
+    }
+    LWP_MutexUnlock(cache_mutex);
+    int result = fclose(f);
+    if (w) {
+        LWP_MutexLock(cache_mutex);
+        invalidate(w->path);
+        free(w->path);
+        free(w->dir_path);
+        w->f = NULL;
+        w->path = NULL;
+        LWP_MutexUnlock(cache_mutex);
+    }
+    return result;
+}
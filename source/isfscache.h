@@ -0,0 +1,51 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _ISFSCACHE_H_
+#define _ISFSCACHE_H_
+
+#include <stdio.h>
+#include <sys/dir.h>
+
+/*
+    A cache of directory listings (names and attributes) under isfs:/, where every stat and directory read
+    is otherwise an IPC to IOS.  Each directory is read in full the first time it is listed or one of its
+    entries is stat'ed, and the least recently read directories are dropped beyond ISFS_CACHE_SIZE bytes.
+    The isfs_cache_* functions behave like the standard calls they are named after, and pass paths outside
+    isfs:/ straight through to them.  Changes made through them update the cache.
+*/
+void initialise_isfs_cache();
+
+void isfs_cache_clear();
+
+int isfs_cache_stat(const char *path, struct stat *st);
+DIR_ITER *isfs_cache_diropen(const char *path);
+int isfs_cache_dirnext(DIR_ITER *iter, char *filename, struct stat *st);
+int isfs_cache_dirclose(DIR_ITER *iter);
+int isfs_cache_unlink(const char *path);
+int isfs_cache_mkdir(const char *path, mode_t mode);
+int isfs_cache_rename(const char *from_path, const char *to_path);
+FILE *isfs_cache_fopen(const char *path, const char *mode);
+int isfs_cache_fclose(FILE *f);
+
+#endif /* _ISFSCACHE_H_ */
@@ -23,7 +23,8 @@ misrepresented as being the original software.
 3.This notice may not be removed or altered from any source distribution.
 
 */
-#include <gctypes.h>
+#include <errno.h>
+#include <gccore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,35 +32,240 @@ misrepresented as being the original software.
 
 #include "dol.h"
 #include "loader.h"
+#include "net.h"
+#include "reset.h"
 
-static bool read_from_file(u8 *buf, FILE *f) {
-    while (1) {
-        s32 bytes_read = fread(buf, 1, 0x8000, f);
-        if (bytes_read > 0) buf += bytes_read;
-        if (bytes_read < 0x8000) return feof(f);
+#define LOAD_BUFFER ((u8 *)0x92000000)
+#define LOW_MEMORY_END 0x80004000 // exception vectors and OS globals, in use until the DOL is booted
+#define READ_CHUNK_SIZE 0x8000
+
+extern void _start();
+
+struct exec_upload {
+    bool complete; // the whole DOL has been received and checked
+    u32 size;
+};
+
+static EXEC_UPLOAD exec;
+static bool loader_claimed = false; // by a SITE LOAD or SITE EXEC, until its DOL is abandoned or booted
+static bool boot_pending = false;
+static u32 pending_entry_point = 0; // 0 when the DOL is waiting in the load buffer for run_dol
+static char pending_arg[MAXPATHLEN];
+
+static bool make_argv(struct __argv *argv, char *arg) {
+    bzero(argv, sizeof(*argv));
+    argv->argvMagic = ARGV_MAGIC;
+    argv->length = strlen(arg) + 2;
+    argv->commandLine = malloc(argv->length);
+    if (!argv->commandLine) return false;
+    strcpy(argv->commandLine, arg);
+    argv->commandLine[argv->length - 1] = '\x00';
+    argv->argc = 1;
+    argv->argv = &argv->commandLine;
+    argv->endARGV = argv->argv + 1;
+    return true;
+}
+
+/*
+    The load buffer runs from LOAD_BUFFER up to the top of the MEM2 arena, below the DVD cache.
+*/
+/*
+    SITE LOAD and SITE EXEC run on device workers, so only one of them at a time may load a DOL.
+*/
+static s32 claim_loader(char *arg) {
+    if (strlen(arg) >= sizeof(pending_arg)) return -ENAMETOOLONG;
+    if (__atomic_exchange_n(&loader_claimed, true, __ATOMIC_ACQUIRE)) return -EBUSY;
+    strcpy(pending_arg, arg);
+    return 0;
+}
+
+static void release_loader() {
+    __atomic_store_n(&loader_claimed, false, __ATOMIC_RELEASE);
+}
+
+bool lock_load_buffer() {
+    return !__atomic_exchange_n(&loader_claimed, true, __ATOMIC_ACQUIRE);
+}
+
+void unlock_load_buffer() {
+    release_loader();
+}
+
+/*
+    The loader stays claimed until run_pending_boot, which runs once ftpii has stopped its other threads and
+    unmounted everything.
+*/
+static void boot_after_exit(u32 entry_point) {
+    pending_entry_point = entry_point;
+    boot_pending = true;
+    set_reset_flag();
+}
+
+static u32 load_buffer_capacity() {
+    u8 *lo = SYS_GetArena2Lo(), *hi = SYS_GetArena2Hi();
+    if (lo > LOAD_BUFFER || hi < LOAD_BUFFER) return 0;
+    return hi - LOAD_BUFFER;
+}
+
+static s32 read_from_file(u8 *buf, u32 size, FILE *f, const bool *abort) {
+    while (size) {
+        if (__atomic_load_n(abort, __ATOMIC_RELAXED)) return -ECANCELED;
+        u32 chunk = size < READ_CHUNK_SIZE ? size : READ_CHUNK_SIZE;
+        if (fread(buf, 1, chunk, f) != chunk) return -EIO;
+        buf += chunk;
+        size -= chunk;
     }
+    return 0;
 }
 
-void load_from_file(FILE *f, char *arg) {
-    struct __argv argv;
-    bzero(&argv, sizeof(argv));
-    argv.argvMagic = ARGV_MAGIC;
-    argv.length = strlen(arg) + 2;
-    argv.commandLine = malloc(argv.length);
-    if (!argv.commandLine) return;
-    strcpy(argv.commandLine, arg);
-    argv.commandLine[argv.length - 1] = '\x00';
-    argv.argc = 1;
-    argv.argv = &argv.commandLine;
-    argv.endARGV = argv.argv + 1;
+typedef struct {
+    u32 pos;
+    u32 start;
+    u32 size;
+    bool text;
+} dol_section;
+
+/*
+    ftpii is linked high in MEM1 (see --section-start in the Makefile), leaving the memory between the OS globals
+    and its own image free for the DOL being loaded.  Sections that land there can be read straight into place.
+*/
+static bool loads_below_ftpii(dol_section *section) {
+    u32 end = (u32)_start;
+    return section->start >= LOW_MEMORY_END && section->start <= end && section->size <= end - section->start;
+}
+
+/*
+    Collects the sections that load_dol_image would copy, sorted by file offset, returning how many there are.
+*/
+static u32 dol_sections(const dolheader *header, dol_section *sections) {
+    u32 i, count = 0;
+    for (i = 0; i < DOL_TEXT_SECTIONS + DOL_DATA_SECTIONS; i++) {
+        bool text = i < DOL_TEXT_SECTIONS;
+        u32 j = text ? i : i - DOL_TEXT_SECTIONS;
+        dol_section section = {
+            text ? header->text_pos[j] : header->data_pos[j],
+            text ? header->text_start[j] : header->data_start[j],
+            text ? header->text_size[j] : header->data_size[j],
+            text
+        };
+        if (!section.size || section.start < 0x100) continue;
+        u32 k = count++;
+        for (; k && sections[k - 1].pos > section.pos; k--) sections[k] = sections[k - 1];
+        sections[k] = section;
+    }
+    return count;
+}
+
+/*
+    Reads each section from f straight to its load address in file order, instead of buffering the whole DOL
+    and moving the sections into place afterwards.
+*/
+static s32 load_sections(FILE *f, dol_section *sections, u32 count, const bool *abort) {
+    u32 i;
+    for (i = 0; i < count; i++) {
+        dol_section *section = sections + i;
+        if (ftell(f) != section->pos && fseek(f, section->pos, SEEK_SET)) return -EIO;
+        s32 result = read_from_file((u8 *)section->start, section->size, f, abort);
+        if (result < 0) return result;
+        DCFlushRange((void *)section->start, section->size);
+        if (section->text) ICInvalidateRange((void *)section->start, section->size);
+    }
+    return 0;
+}
+
+/*
+    A DOL with a section that would overwrite low memory or ftpii itself, which is still running, is read into the
+    load buffer instead and moved into place by run_dol.
+*/
+s32 load_from_file(FILE *f, char *arg, const bool *abort) {
+    s32 result = claim_loader(arg);
+    if (result < 0) return result;
 
     struct stat st;
-    int fd = fileno(f);
-    if (fstat(fd, &st)) return;
-    u8 *buf = (u8 *)0x92000000;
-    if (!read_from_file(buf, f)) return;
+    dolheader header;
+    if (fstat(fileno(f), &st) || fread(&header, 1, sizeof(header), f) != sizeof(header)) {
+        result = -EIO;
+        goto end;
+    }
+    if (!is_valid_dol(&header, st.st_size)) {
+        result = -ENOEXEC;
+        goto end;
+    }
+
+    dol_section sections[DOL_TEXT_SECTIONS + DOL_DATA_SECTIONS];
+    u32 count = dol_sections(&header, sections), i;
+    for (i = 0; i < count && loads_below_ftpii(sections + i); i++);
+    if (i == count) {
+        if (!(result = load_sections(f, sections, count, abort))) boot_after_exit(header.entry_point);
+    } else if (st.st_size <= load_buffer_capacity()) {
+        memcpy(LOAD_BUFFER, &header, sizeof(header));
+        result = read_from_file(LOAD_BUFFER + sizeof(header), st.st_size - sizeof(header), f, abort);
+        if (!result) boot_after_exit(0);
+    } else {
+        printf("DOL is larger than the %u bytes available to load it.\n", load_buffer_capacity());
+        result = -EFBIG;
+    }
+
+    end:
+    if (result < 0) release_loader();
+    else printf("Loaded %s, exiting to run it.\n", arg);
+    return result;
+}
 
-    run_dol(buf, &argv);
+EXEC_UPLOAD *exec_open(char *arg) {
+    s32 result = claim_loader(arg);
+    if (result < 0) {
+        errno = -result;
+        return NULL;
+    }
+    exec.complete = false;
+    exec.size = 0;
+    return &exec;
+}
 
+/*
+    Receives the DOL straight into the load buffer, failing with -EFBIG as soon as it outgrows it.
+    At end-of-file the header is checked against the received size before the upload counts as complete.
+*/
+s32 recv_to_exec(s32 s, EXEC_UPLOAD *upload) {
+    u32 capacity = load_buffer_capacity();
+    s32 result;
+    if (upload->size < capacity) {
+        result = recv_to_memory(s, (char *)LOAD_BUFFER + upload->size, capacity - upload->size);
+    } else {
+        char extra;
+        result = recv_to_memory(s, &extra, 1);
+        if (result > 0) {
+            printf("DOL is larger than the %u bytes available to load it.\n", capacity);
+            return -EFBIG;
+        }
+    }
+    if (result > 0) {
+        upload->size += result;
+    } else if (result == 0) {
+        if (!is_valid_dol(LOAD_BUFFER, upload->size)) {
+            printf("Received %u bytes that are not a valid DOL.\n", upload->size);
+            return -ENOEXEC;
+        }
+        upload->complete = true;
+    }
+    return result;
+}
+
+void exec_close(EXEC_UPLOAD *upload) {
+    if (upload->complete) {
+        printf("Received %u byte DOL, exiting to run %s.\n", upload->size, pending_arg);
+        boot_after_exit(0);
+    } else {
+        release_loader();
+    }
+}
+
+void run_pending_boot() {
+    if (!boot_pending) return;
+    struct __argv argv;
+    if (!make_argv(&argv, pending_arg)) return;
+    if (pending_entry_point) run_loaded_dol(pending_entry_point, &argv);
+    else run_dol(LOAD_BUFFER, &argv);
     free(argv.commandLine);
 }
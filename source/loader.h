@@ -26,8 +26,31 @@ misrepresented as being the original software.
 #ifndef _LOADER_H_
 #define _LOADER_H_
 
+#include <gctypes.h>
 #include <stdio.h>
 
-void load_from_file(FILE *f, char *arg);
+/*
+    Reads and checks the DOL in f, returning 0 or a negative errno, or -ECANCELED once *abort is set.
+    On success the reset flag is set and the DOL is booted by run_pending_boot once ftpii has shut down.
+*/
+s32 load_from_file(FILE *f, char *arg, const bool *abort);
+
+typedef struct exec_upload EXEC_UPLOAD;
+
+EXEC_UPLOAD *exec_open(char *arg);
+
+s32 recv_to_exec(s32 s, EXEC_UPLOAD *upload);
+
+void exec_close(EXEC_UPLOAD *upload);
+
+void run_pending_boot();
+
+/*
+    Keeps SITE LOAD and SITE EXEC out of MEM2 while the arena above the load buffer is moved, e.g. by
+    resize_ram_disk.  Returns false if a DOL is being loaded or waiting to be booted.
+*/
+bool lock_load_buffer();
+
+void unlock_load_buffer();
 
 #endif /* _LOADER_H_ */
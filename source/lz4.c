@@ -0,0 +1,66 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <string.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH 4
+
+static bool read_length(const u8 **src, const u8 *end, u32 *length) {
+    u8 byte;
+    do {
+        if (*src >= end) return false;
+        byte = *(*src)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+s32 lz4_decompress(const u8 *src, u32 src_size, u8 *dst, u32 dst_size) {
+    const u8 *src_end = src + src_size;
+    u8 *out = dst, *dst_end = dst + dst_size;
+    while (src < src_end) {
+        u8 token = *src++;
+        u32 length = token >> 4;
+        if (length == 15 && !read_length(&src, src_end, &length)) return -1;
+        if (length > src_end - src || length > dst_end - out) return -1;
+        memcpy(out, src, length);
+        out += length;
+        src += length;
+        if (src == src_end) break; // the last sequence is literals only
+
+        if (src_end - src < 2) return -1;
+        u32 offset = src[0] | src[1] << 8;
+        src += 2;
+        if (!offset || offset > out - dst) return -1;
+        length = token & 15;
+        if (length == 15 && !read_length(&src, src_end, &length)) return -1;
+        length += MIN_MATCH;
+        if (length > dst_end - out) return -1;
+        // matches may overlap the bytes they produce, so they are copied forwards a byte at a time
+        const u8 *match = out - offset;
+        while (length--) *out++ = *match++;
+    }
+    return out - dst;
+}
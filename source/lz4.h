@@ -0,0 +1,35 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <gctypes.h>
+
+/*
+    Decompresses one block in the LZ4 block format, as written by tools/dolpack.c.
+    Returns the number of bytes written to dst, or -1 if src is malformed or does not fit in dst_size bytes.
+*/
+s32 lz4_decompress(const u8 *src, u32 src_size, u8 *dst, u32 dst_size);
+
+#endif /* _LZ4_H_ */
@@ -24,25 +24,69 @@ misrepresented as being the original software.
 #include <errno.h>
 #include <gccore.h>
 #include <network.h>
+#include <ogc/lwp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/fcntl.h>
 
 #include "net.h"
 #include "reset.h"
+#include "stats.h"
+#include "worker.h"
 
-#define MAX_NET_BUFFER_SIZE 32768
+#define MAX_NET_BUFFER_SIZE TRANSFER_BUFFER_SIZE
 #define MIN_NET_BUFFER_SIZE 4096
-#define FREAD_BUFFER_SIZE 32768
+#define FREAD_BUFFER_SIZE TRANSFER_BUFFER_SIZE
+
+#define POLL_INTERVAL_MS 1000
+#define PASSIVE_POOL_SIZE 3
+#define MIN_PASSIVE_PORT 1024
+#define PASSIVE_BIND_ATTEMPTS 8
+#define NETWORK_STACK_SIZE 32768
+#define NETWORK_PRIORITY 48 // below the main thread, which sleeps between its iterations while it waits
 
 static u32 NET_BUFFER_SIZE = MAX_NET_BUFFER_SIZE;
+static u32 net_timeout_ms = DEFAULT_NET_TIMEOUT * 1000;
+static u32 host_ip = 0;
+static u16 passive_port = MIN_PASSIVE_PORT;
+static lwp_t network_thread = LWP_THREAD_NULL;
+static bool initialising = false;
+
+typedef struct {
+    s32 socket;
+    u16 port;
+} passive_listener;
+
+static passive_listener passive_pool[PASSIVE_POOL_SIZE];
+static u32 passive_pool_count = 0;
+static transfer_job *refill_job = NULL;
+static passive_listener refilled[PASSIVE_POOL_SIZE]; // opened by refill_job, moved to the pool once it finishes
+static u32 refilled_count = 0;
+
+static void collect_refilled_listeners() {
+    while (refilled_count) passive_pool[passive_pool_count++] = refilled[--refilled_count];
+}
+
+void close_passive_listeners() {
+    if (refill_job) {
+        wait_for_job(refill_job);
+        refill_job = NULL;
+        collect_refilled_listeners();
+    }
+    while (passive_pool_count) {
+        net_close(passive_pool[--passive_pool_count].socket);
+    }
+}
 
 void initialise_network() {
     printf("Waiting for network to initialise...\n");
+    close_passive_listeners();
+    host_ip = 0;
     s32 result = -1;
-    while (!check_reset_synchronous() && result < 0) {
+    while (!reset() && result < 0) {
         net_deinit();
-        while (!check_reset_synchronous() && (result = net_init()) == -EAGAIN);
+        while (!reset() && (result = net_init()) == -EAGAIN);
         if (result < 0) printf("net_init() failed: [%i] %s, retrying...\n", result, strerror(-result));
     }
     if (result >= 0) {
@@ -50,8 +94,9 @@ void initialise_network() {
         do {
             ip = net_gethostip();
             if (!ip) printf("net_gethostip() failed, retrying...\n");
-        } while (!check_reset_synchronous() && !ip);
+        } while (!reset() && !ip);
         if (ip) {
+            host_ip = ip;
             struct in_addr addr;
             addr.s_addr = ip;
             printf("Network initialised.  Wii IP address: %s\n", inet_ntoa(addr));
@@ -59,6 +104,35 @@ void initialise_network() {
     }
 }
 
+static void *network_main(void *unused) {
+    initialise_network();
+    __atomic_store_n(&initialising, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void start_network_initialisation() {
+    finish_network_initialisation();
+    initialising = true;
+    if (LWP_CreateThread(&network_thread, network_main, NULL, NULL, NETWORK_STACK_SIZE, NETWORK_PRIORITY) < 0) {
+        network_thread = LWP_THREAD_NULL;
+        network_main(NULL);
+    }
+}
+
+bool network_initialising() {
+    return __atomic_load_n(&initialising, __ATOMIC_ACQUIRE);
+}
+
+void finish_network_initialisation() {
+    if (network_thread == LWP_THREAD_NULL) return;
+    LWP_JoinThread(network_thread, NULL);
+    network_thread = LWP_THREAD_NULL;
+}
+
+u32 get_host_ip() {
+    return host_ip;
+}
+
 s32 set_blocking(s32 s, bool blocking) {
     s32 flags;
     flags = net_fcntl(s, F_GETFL, 0);
@@ -97,21 +171,119 @@ s32 create_server(u16 port) {
     return server;
 }
 
+void set_net_timeout(u32 seconds) {
+    net_timeout_ms = seconds * 1000;
+}
+
+/*
+    Waits until s is ready for events, or returns -ETIMEDOUT once the net timeout passes without it becoming ready.
+    Polls in short intervals so that a transfer worker notices a reset promptly.
+*/
+static s32 wait_for_socket(s32 s, u32 events) {
+    struct pollsd sd;
+    u32 waited_ms = 0;
+    s32 result;
+    do {
+        sd.socket = s;
+        sd.events = events;
+        sd.revents = 0;
+        result = net_poll(&sd, 1, POLL_INTERVAL_MS);
+        waited_ms += POLL_INTERVAL_MS;
+    } while (result == 0 && !reset() && (!net_timeout_ms || waited_ms < net_timeout_ms));
+    if (result == 0) return -ETIMEDOUT;
+    return result < 0 ? result : 0;
+}
+
+/*
+    Both the main thread and the worker that refills the pool take ports.
+*/
+static u16 next_passive_port() {
+    u16 port = __atomic_load_n(&passive_port, __ATOMIC_RELAXED), next;
+    do {
+        next = port == 0xffff ? MIN_PASSIVE_PORT : port + 1;
+    } while (!__atomic_compare_exchange_n(&passive_port, &port, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return port;
+}
+
+/*
+    Opens a non-blocking socket listening on the next passive port, skipping ports that are in use.
+*/
+static s32 open_passive_listener(u16 *port) {
+    s32 s = net_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (s < 0) return s;
+    set_blocking(s, false);
+    struct sockaddr_in bindAddress;
+    memset(&bindAddress, 0, sizeof(bindAddress));
+    bindAddress.sin_family = AF_INET;
+    bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    s32 result;
+    u32 attempt = 0;
+    do {
+        *port = next_passive_port();
+        bindAddress.sin_port = htons(*port);
+    } while ((result = net_bind(s, (struct sockaddr *)&bindAddress, sizeof(bindAddress))) == -EADDRINUSE && ++attempt < PASSIVE_BIND_ATTEMPTS);
+    if (result >= 0) result = net_listen(s, 1);
+    if (result < 0) {
+        net_close(s);
+        return result;
+    }
+    return s;
+}
+
+s32 take_passive_listener(u16 *port) {
+    if (passive_pool_count) {
+        passive_listener *listener = passive_pool + --passive_pool_count;
+        *port = listener->port;
+        return listener->socket;
+    }
+    return open_passive_listener(port);
+}
+
+static s32 refill_passive_listeners(s32 unused, void *count) {
+    while (refilled_count < (uintptr_t)count) {
+        passive_listener *listener = refilled + refilled_count;
+        if ((listener->socket = open_passive_listener(&listener->port)) < 0) return listener->socket;
+        refilled_count++;
+    }
+    return 0;
+}
+
+/*
+    The pool only shrinks while refill_job runs, so the listeners it opens always fit once it has finished.
+*/
+void replenish_passive_listeners() {
+    s32 result;
+    if (refill_job) {
+        if (!finish_job(refill_job, &result)) return;
+        refill_job = NULL;
+        collect_refilled_listeners();
+    }
+    if (host_ip && passive_pool_count < PASSIVE_POOL_SIZE) {
+        void *count = (void *)(uintptr_t)(PASSIVE_POOL_SIZE - passive_pool_count);
+        if (!(refill_job = start_job(DEVICE_NONE, refill_passive_listeners, -1, count))) {
+            refill_passive_listeners(-1, (void *)1);
+            collect_refilled_listeners();
+        }
+    }
+}
+
 typedef s32 (*transferrer_type)(s32 s, void *mem, s32 len);
-static s32 transfer_exact(s32 s, char *buf, s32 length, transferrer_type transferrer) {
+static s32 transfer_exact(s32 s, char *buf, s32 length, transferrer_type transferrer, u32 events) {
     s32 result = 0;
     s32 remaining = length;
     s32 bytes_transferred;
-    set_blocking(s, true);
     while (remaining) {
         try_again_with_smaller_buffer:
         bytes_transferred = transferrer(s, buf, MIN(remaining, NET_BUFFER_SIZE));
         if (bytes_transferred > 0) {
             remaining -= bytes_transferred;
             buf += bytes_transferred;
+        } else if (bytes_transferred == -EAGAIN) {
+            if ((result = wait_for_socket(s, events)) < 0) break;
         } else if (bytes_transferred < 0) {
             if (bytes_transferred == -EINVAL && NET_BUFFER_SIZE == MAX_NET_BUFFER_SIZE) {
                 NET_BUFFER_SIZE = MIN_NET_BUFFER_SIZE;
+                stats_increment(STAT_NET_BUFFER_FALLBACKS);
                 goto try_again_with_smaller_buffer;
             }
             result = bytes_transferred;
@@ -121,50 +293,83 @@ static s32 transfer_exact(s32 s, char *buf, s32 length, transferrer_type transfe
             break;
         }
     }
-    set_blocking(s, false);
     return result;
 }
 
 s32 send_exact(s32 s, char *buf, s32 length) {
-    return transfer_exact(s, buf, length, (transferrer_type)net_write);
+    return transfer_exact(s, buf, length, (transferrer_type)net_write, POLLOUT);
 }
 
 s32 send_from_file(s32 s, FILE *f) {
-    char buf[FREAD_BUFFER_SIZE];
-    s32 bytes_read;
-    s32 result = 0;
-
-    bytes_read = fread(buf, 1, FREAD_BUFFER_SIZE, f);
+    char *buf = transfer_buffer();
+    s32 bytes_read = fread(buf, 1, FREAD_BUFFER_SIZE, f);
     if (bytes_read > 0) {
-        result = send_exact(s, buf, bytes_read);
-        if (result < 0) goto end;
-    }
-    if (bytes_read < FREAD_BUFFER_SIZE) {
-        result = -!feof(f);
-        goto end;
+        s32 result = send_exact(s, buf, bytes_read);
+        return result < 0 ? result : bytes_read;
     }
-    return -EAGAIN;
-    end:
-    return result;
+    return -!feof(f);
 }
 
-s32 recv_to_file(s32 s, FILE *f) {
-    char buf[NET_BUFFER_SIZE];
+/*
+    Reads from s until it would block or reaches end-of-file, handing each chunk to consumer.
+    A negative result from consumer aborts the transfer.
+    Returns the number of bytes received, or 0 once end-of-file is reached with nothing received.
+*/
+s32 recv_to_consumer(s32 s, recv_consumer consumer, void *arg) {
+    char *buf = transfer_buffer();
     s32 bytes_read;
+    s32 total = 0;
     while (1) {
         try_again_with_smaller_buffer:
         bytes_read = net_read(s, buf, NET_BUFFER_SIZE);
         if (bytes_read < 0) {
             if (bytes_read == -EINVAL && NET_BUFFER_SIZE == MAX_NET_BUFFER_SIZE) {
                 NET_BUFFER_SIZE = MIN_NET_BUFFER_SIZE;
+                stats_increment(STAT_NET_BUFFER_FALLBACKS);
                 goto try_again_with_smaller_buffer;
             }
-            return bytes_read;
+            return (bytes_read == -EAGAIN && total) ? total : bytes_read;
         } else if (bytes_read == 0) {
-            return 0;
+            return total;
         }
 
-        s32 bytes_written = fwrite(buf, 1, bytes_read, f);
-        if (bytes_written < bytes_read) return -1;
+        s32 result = consumer(arg, buf, bytes_read);
+        if (result < 0) return result;
+        total += bytes_read;
+    }
+}
+
+static s32 write_to_file(FILE *f, char *buf, s32 length) {
+    s32 bytes_written = fwrite(buf, 1, length, f);
+    return bytes_written < length ? -1 : 0;
+}
+
+s32 recv_to_file(s32 s, FILE *f) {
+    return recv_to_consumer(s, (recv_consumer)write_to_file, f);
+}
+
+/*
+    Reads from s straight into buf, without going through the transfer buffer, until it would block,
+    reaches end-of-file or has filled length bytes.
+    Returns the number of bytes received, or 0 once end-of-file is reached with nothing received.
+*/
+s32 recv_to_memory(s32 s, char *buf, u32 length) {
+    s32 bytes_read;
+    s32 total = 0;
+    while ((u32)total < length) {
+        try_again_with_smaller_buffer:
+        bytes_read = net_read(s, buf + total, MIN(length - total, NET_BUFFER_SIZE));
+        if (bytes_read < 0) {
+            if (bytes_read == -EINVAL && NET_BUFFER_SIZE == MAX_NET_BUFFER_SIZE) {
+                NET_BUFFER_SIZE = MIN_NET_BUFFER_SIZE;
+                stats_increment(STAT_NET_BUFFER_FALLBACKS);
+                goto try_again_with_smaller_buffer;
+            }
+            return (bytes_read == -EAGAIN && total) ? total : bytes_read;
+        } else if (bytes_read == 0) {
+            return total;
+        }
+        total += bytes_read;
     }
+    return total;
 }
@@ -26,18 +26,57 @@ misrepresented as being the original software.
 
 #include <stdio.h>
 
+/*
+    Retries until the network is up and the Wii has an address, or until reset() is set.
+*/
 void initialise_network();
 
+/*
+    Runs initialise_network() on its own LWP, so that the rest of startup, and the controllers, need not wait for it.
+    network_initialising() is true until it is done, and finish_network_initialisation() waits for it.
+*/
+void start_network_initialisation();
+bool network_initialising();
+void finish_network_initialisation();
+
+/*
+    Returns the address found by the last initialise_network(), or 0 if there is none.
+*/
+u32 get_host_ip();
+
 s32 set_blocking(s32 s, bool blocking);
 
 s32 net_close_blocking(s32 s);
 
+#define DEFAULT_NET_TIMEOUT 60
+
+/*
+    Sets how long, in seconds, send_exact waits for a peer that has stopped reading before
+    failing with -ETIMEDOUT.  0 waits forever.
+*/
+void set_net_timeout(u32 seconds);
+
 s32 create_server(u16 port);
 
+/*
+    Passive data connection listeners are opened ahead of time on the DEVICE_NONE worker, which
+    replenish_passive_listeners() sets to topping up the pool, so that PASV need not wait for them.  take_passive_listener() hands one over, opening it on the spot if the
+    pool is empty, and stores its port in port.  The pool is discarded when the network is reinitialised.
+*/
+s32 take_passive_listener(u16 *port);
+void replenish_passive_listeners();
+void close_passive_listeners();
+
 s32 send_exact(s32 s, char *buf, s32 length);
 
 s32 send_from_file(s32 s, FILE *f);
 
+typedef s32 (*recv_consumer)(void *arg, char *buf, s32 length);
+
+s32 recv_to_consumer(s32 s, recv_consumer consumer, void *arg);
+
 s32 recv_to_file(s32 s, FILE *f);
 
+s32 recv_to_memory(s32 s, char *buf, u32 length);
+
 #endif /* _NET_H_ */
@@ -21,11 +21,58 @@ misrepresented as being the original software.
 3.This notice may not be removed or altered from any source distribution.
 
 */
+#include <gccore.h>
+#include <stdio.h>
+#include <ogc/lwp.h>
 #include <wiiuse/wpad.h>
 
 #include "pad.h"
 
+#define POLL_STACK_SIZE 16384
+#define POLL_PRIORITY 40 // below the main thread, which the controllers must not hold up
+
+static lwp_t poll_thread = LWP_THREAD_NULL;
+static volatile bool stopping = false;
+static u32 wiimote_presses = 0;
+static u32 gamecube_presses = 0;
+
+/*
+    Scans the controllers once per frame, collecting the buttons pressed since the main loop last looked.
+*/
+static void *poll_pads(void *unused) {
+    while (!stopping) {
+        VIDEO_WaitVSync();
+        WPAD_ScanPads();
+        PAD_ScanPads();
+        u32 pressed = WPAD_ButtonsDown(0);
+        if (pressed) __atomic_fetch_or(&wiimote_presses, pressed, __ATOMIC_RELAXED);
+        pressed = PAD_ButtonsDown(0);
+        if (pressed) __atomic_fetch_or(&gamecube_presses, pressed, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void start_pad_polling() {
+    if (LWP_CreateThread(&poll_thread, poll_pads, NULL, NULL, POLL_STACK_SIZE, POLL_PRIORITY) < 0) {
+        printf("Unable to start controller polling, the main loop will scan them itself.\n");
+        poll_thread = LWP_THREAD_NULL;
+    }
+}
+
+void stop_pad_polling() {
+    if (poll_thread == LWP_THREAD_NULL) return;
+    stopping = true;
+    LWP_JoinThread(poll_thread, NULL);
+    poll_thread = LWP_THREAD_NULL;
+}
+
+static u32 take_presses(u32 *presses, u32 mask) {
+    u32 pressed = __atomic_exchange_n(presses, 0, __ATOMIC_RELAXED);
+    return (pressed & mask) ? pressed : 0;
+}
+
 u32 check_wiimote(u32 mask) {
+    if (poll_thread != LWP_THREAD_NULL) return take_presses(&wiimote_presses, mask);
     WPAD_ScanPads();
     u32 pressed = WPAD_ButtonsDown(0);
     if (pressed & mask) return pressed;
@@ -33,6 +80,7 @@ u32 check_wiimote(u32 mask) {
 }
 
 u32 check_gamecube(u32 mask) {
+    if (poll_thread != LWP_THREAD_NULL) return take_presses(&gamecube_presses, mask);
     PAD_ScanPads();
     u32 pressed = PAD_ButtonsDown(0);
     if (pressed & mask) {
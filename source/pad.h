@@ -26,6 +26,17 @@ misrepresented as being the original software.
 
 #include <gctypes.h>
 
+/*
+    Polls the controllers on a low-priority LWP, once per frame, so that scanning them does not hold up the main loop.
+    From then on, check_wiimote and check_gamecube return the buttons pressed since they were last called.
+*/
+void start_pad_polling();
+
+void stop_pad_polling();
+
+/*
+    Return the buttons pressed if any of them are in mask, or 0.
+*/
 u32 check_wiimote(u32 mask);
 
 u32 check_gamecube(u32 mask);
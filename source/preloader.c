@@ -24,12 +24,43 @@ misrepresented as being the original software.
 
 */
 #include <gccore.h>
+#include <string.h>
 
-#include "_ftpii_dol.h"
+#include "_ftpii_dol_lz.h"
 #include "dol.h"
+#include "lz4.h"
+
+/*
+    Decompresses each section of the DOL packed by tools/dolpack.c straight to its load address.
+    Returns the entry point, or 0 if the packed DOL is malformed.
+*/
+static u32 unpack_dol(const u8 *packed, u32 size) {
+    const u8 *end = packed + size;
+    dolheader header;
+    if (size < sizeof(header)) return 0;
+    memcpy(&header, packed, sizeof(header));
+    packed += sizeof(header);
+    u32 i;
+    for (i = 0; i < DOL_TEXT_SECTIONS + DOL_DATA_SECTIONS; i++) {
+        bool text = i < DOL_TEXT_SECTIONS;
+        u32 j = text ? i : i - DOL_TEXT_SECTIONS;
+        u8 *start = (u8 *)(text ? header.text_start[j] : header.data_start[j]);
+        u32 length = text ? header.text_size[j] : header.data_size[j];
+        if (!length || (u32)start < 0x100) continue;
+        if (end - packed < 4) return 0;
+        u32 block_size = packed[0] << 24 | packed[1] << 16 | packed[2] << 8 | packed[3];
+        packed += 4;
+        if (block_size > end - packed || lz4_decompress(packed, block_size, start, length) != length) return 0;
+        packed += block_size;
+        DCFlushRange(start, length);
+        if (text) ICInvalidateRange(start, length);
+    }
+    return header.entry_point;
+}
 
 int main(int argc, char **argv) {
     VIDEO_Init();
-    run_dol(_ftpii_dol, __system_argv);
+    u32 entry_point = unpack_dol(_ftpii_dol_lz, _ftpii_dol_lz_size);
+    if (entry_point) run_loaded_dol(entry_point, __system_argv);
     return 1;
 }
@@ -0,0 +1,603 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <gccore.h>
+#include <malloc.h>
+#include <ogc/mutex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/dir.h>
+#include <sys/iosupport.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+#include "ramdisk.h"
+
+#define BLOCK_SIZE 32768
+#define DEFAULT_RAM_DISK_SIZE (8 * 1024 * 1024)
+#define MAX_NAME_LENGTH 256
+
+static const char *DEVICE_NAME = "ram";
+
+/*
+    A file or directory.  Open files and directory iterators hold references to it, so an unlinked node is only
+    freed once the last of them is closed.
+*/
+typedef struct ram_node {
+    char *name;
+    struct ram_node *parent;
+    struct ram_node *children; // directories only
+    struct ram_node *next; // sibling
+    bool is_dir;
+    bool unlinked;
+    u32 refs;
+    time_t mtime;
+    u32 size; // files only
+    u32 num_blocks;
+    u32 blocks_capacity;
+    u8 **blocks; // the file's data in BLOCK_SIZE pieces of the MEM2 region, the table itself is in MEM1
+} ram_node;
+
+typedef struct {
+    ram_node *node;
+    u32 position;
+    bool readable;
+    bool writable;
+    bool append;
+} ram_file;
+
+/*
+    An iterator holds the child it returns next, which detach() moves on when that child is removed, so that
+    unlinking each entry as it is returned visits every entry.
+*/
+typedef struct ram_dir {
+    ram_node *dir;
+    ram_node *next_child;
+    struct ram_dir *next; // in open_dirs
+} ram_dir;
+
+static mutex_t ram_mutex = LWP_MUTEX_NULL;
+static u8 *region = NULL; // taken from the top of the MEM2 arena
+static u32 total_blocks = 0;
+static u32 *free_blocks = NULL; // a stack of the block numbers not in use
+static u32 num_free = 0;
+static u32 open_handles = 0;
+static ram_dir *open_dirs = NULL;
+static bool is_mounted = false;
+static ram_node root = { .name = "", .is_dir = true };
+
+static void lock() {
+    LWP_MutexLock(ram_mutex);
+}
+
+static void unlock() {
+    LWP_MutexUnlock(ram_mutex);
+}
+
+static u8 *allocate_block() {
+    if (!num_free) return NULL;
+    return region + free_blocks[--num_free] * BLOCK_SIZE;
+}
+
+static void free_block(u8 *block) {
+    free_blocks[num_free++] = (block - region) / BLOCK_SIZE;
+}
+
+/*
+    Grows or shrinks a file's blocks to cover size bytes, zero-filling new space.
+*/
+static bool resize_file(ram_node *node, u32 size) {
+    u32 needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needed > node->blocks_capacity) {
+        u32 capacity = node->blocks_capacity ? node->blocks_capacity : 4;
+        while (capacity < needed) capacity *= 2;
+        u8 **blocks = realloc(node->blocks, capacity * sizeof(u8 *));
+        if (!blocks) return false;
+        node->blocks = blocks;
+        node->blocks_capacity = capacity;
+    }
+    if (needed > node->num_blocks && needed - node->num_blocks > num_free) return false;
+    while (node->num_blocks > needed) free_block(node->blocks[--node->num_blocks]);
+    if (size > node->size && node->size % BLOCK_SIZE) {
+        u32 offset = node->size % BLOCK_SIZE;
+        memset(node->blocks[node->size / BLOCK_SIZE] + offset, 0, BLOCK_SIZE - offset);
+    }
+    while (node->num_blocks < needed) {
+        u8 *block = allocate_block();
+        memset(block, 0, BLOCK_SIZE);
+        node->blocks[node->num_blocks++] = block;
+    }
+    node->size = size;
+    return true;
+}
+
+static void free_node(ram_node *node) {
+    while (node->children) {
+        ram_node *child = node->children;
+        node->children = child->next;
+        free_node(child);
+    }
+    while (node->num_blocks) free_block(node->blocks[--node->num_blocks]);
+    free(node->blocks);
+    free(node->name);
+    free(node);
+}
+
+static void release(ram_node *node) {
+    open_handles--;
+    if (!--node->refs && node->unlinked) free_node(node);
+}
+
+static void detach(ram_node *node) {
+    ram_dir *dir;
+    for (dir = open_dirs; dir; dir = dir->next) {
+        if (dir->next_child == node) dir->next_child = node->next;
+    }
+    ram_node **link = &node->parent->children;
+    while (*link != node) link = &(*link)->next;
+    *link = node->next;
+    node->next = NULL;
+    node->parent->mtime = time(NULL);
+    node->parent = NULL;
+}
+
+static void attach(ram_node *node, ram_node *parent) {
+    ram_node **link = &parent->children;
+    while (*link) link = &(*link)->next;
+    *link = node;
+    node->parent = parent;
+    parent->mtime = time(NULL);
+}
+
+static ram_node *find_child(ram_node *dir, const char *name, u32 len) {
+    ram_node *child;
+    for (child = dir->children; child; child = child->next) {
+        if (!strncmp(child->name, name, len) && !child->name[len]) return child;
+    }
+    return NULL;
+}
+
+/*
+    Returns the node at path, or NULL with errno set.  When only the last component is missing,
+    errno is ENOENT and *parent and leaf say where it would be created.
+*/
+static ram_node *lookup(const char *path, ram_node **parent, char *leaf) {
+    const char *colon = strchr(path, ':');
+    if (colon) path = colon + 1;
+    ram_node *node = &root;
+    *parent = NULL;
+    while (1) {
+        while (*path == '/') path++;
+        if (!*path) return node;
+        u32 len = strcspn(path, "/");
+        if (!node->is_dir) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+        if (len >= MAX_NAME_LENGTH) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        ram_node *child;
+        if (len == 1 && *path == '.') child = node;
+        else if (len == 2 && !strncmp(path, "..", 2)) child = node->parent ? node->parent : node;
+        else child = find_child(node, path, len);
+        if (!child) {
+            const char *rest = path + len;
+            while (*rest == '/') rest++;
+            if (!*rest) {
+                *parent = node;
+                memcpy(leaf, path, len);
+                leaf[len] = '\0';
+            }
+            errno = ENOENT;
+            return NULL;
+        }
+        node = child;
+        path += len;
+    }
+}
+
+static ram_node *create(ram_node *parent, const char *name, bool is_dir) {
+    ram_node *node = calloc(1, sizeof(ram_node));
+    if (!node) return NULL;
+    if (!(node->name = strdup(name))) {
+        free(node);
+        return NULL;
+    }
+    node->is_dir = is_dir;
+    node->mtime = time(NULL);
+    attach(node, parent);
+    return node;
+}
+
+static void fill_stat(ram_node *node, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = node->is_dir ? S_IFDIR | 0777 : S_IFREG | 0666;
+    st->st_nlink = 1;
+    st->st_size = node->size;
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = node->num_blocks * (BLOCK_SIZE / 512);
+    st->st_atime = st->st_mtime = st->st_ctime = node->mtime;
+}
+
+static int fail(struct _reent *r, int error) {
+    unlock();
+    r->_errno = error;
+    return -1;
+}
+
+static int ram_open(struct _reent *r, void *file_struct, const char *path, int flags, int mode) {
+    ram_file *file = file_struct;
+    char leaf[MAX_NAME_LENGTH];
+    ram_node *parent;
+    lock();
+    ram_node *node = lookup(path, &parent, leaf);
+    if (node) {
+        if ((flags & O_CREAT) && (flags & O_EXCL)) return fail(r, EEXIST);
+        if (node->is_dir) return fail(r, EISDIR);
+    } else {
+        if (!(flags & O_CREAT) || !parent) return fail(r, errno);
+        if (!(node = create(parent, leaf, false))) return fail(r, ENOMEM);
+    }
+    file->node = node;
+    file->position = 0;
+    file->readable = (flags & O_ACCMODE) != O_WRONLY;
+    file->writable = (flags & O_ACCMODE) != O_RDONLY;
+    file->append = flags & O_APPEND;
+    if (file->writable && (flags & O_TRUNC)) {
+        resize_file(node, 0);
+        node->mtime = time(NULL);
+    }
+    node->refs++;
+    open_handles++;
+    unlock();
+    return (int)file;
+}
+
+static int ram_close(struct _reent *r, int fd) {
+    lock();
+    release(((ram_file *)fd)->node);
+    unlock();
+    return 0;
+}
+
+static ssize_t ram_write(struct _reent *r, int fd, const char *ptr, size_t len) {
+    ram_file *file = (ram_file *)fd;
+    ram_node *node = file->node;
+    lock();
+    if (!file->writable) return fail(r, EBADF);
+    if (file->append) file->position = node->size;
+    if (len > 0xffffffff - file->position) return fail(r, EFBIG);
+    if (file->position + len > node->size && !resize_file(node, file->position + len)) return fail(r, ENOSPC);
+    size_t done = 0;
+    while (done < len) {
+        u32 offset = file->position % BLOCK_SIZE;
+        u32 chunk = BLOCK_SIZE - offset;
+        if (chunk > len - done) chunk = len - done;
+        memcpy(node->blocks[file->position / BLOCK_SIZE] + offset, ptr + done, chunk);
+        file->position += chunk;
+        done += chunk;
+    }
+    node->mtime = time(NULL);
+    unlock();
+    return done;
+}
+
+static ssize_t ram_read(struct _reent *r, int fd, char *ptr, size_t len) {
+    ram_file *file = (ram_file *)fd;
+    ram_node *node = file->node;
+    lock();
+    if (!file->readable) return fail(r, EBADF);
+    if (file->position >= node->size) len = 0;
+    else if (len > node->size - file->position) len = node->size - file->position;
+    size_t done = 0;
+    while (done < len) {
+        u32 offset = file->position % BLOCK_SIZE;
+        u32 chunk = BLOCK_SIZE - offset;
+        if (chunk > len - done) chunk = len - done;
+        memcpy(ptr + done, node->blocks[file->position / BLOCK_SIZE] + offset, chunk);
+        file->position += chunk;
+        done += chunk;
+    }
+    unlock();
+    return done;
+}
+
+static off_t ram_seek(struct _reent *r, int fd, off_t pos, int dir) {
+    ram_file *file = (ram_file *)fd;
+    lock();
+    off_t base;
+    if (dir == SEEK_SET) base = 0;
+    else if (dir == SEEK_CUR) base = file->position;
+    else if (dir == SEEK_END) base = file->node->size;
+    else return fail(r, EINVAL);
+    if (base + pos < 0) return fail(r, EINVAL);
+    if (base + pos > 0xffffffff) return fail(r, EOVERFLOW);
+    file->position = base + pos;
+    unlock();
+    return file->position;
+}
+
+static int ram_fstat(struct _reent *r, int fd, struct stat *st) {
+    lock();
+    fill_stat(((ram_file *)fd)->node, st);
+    unlock();
+    return 0;
+}
+
+static int ram_stat(struct _reent *r, const char *path, struct stat *st) {
+    char leaf[MAX_NAME_LENGTH];
+    ram_node *parent;
+    lock();
+    ram_node *node = lookup(path, &parent, leaf);
+    if (!node) return fail(r, errno);
+    fill_stat(node, st);
+    unlock();
+    return 0;
+}
+
+/*
+    Like libfat's, unlink removes empty directories as well as files.
+*/
+static int ram_unlink(struct _reent *r, const char *path) {
+    char leaf[MAX_NAME_LENGTH];
+    ram_node *parent;
+    lock();
+    ram_node *node = lookup(path, &parent, leaf);
+    if (!node) return fail(r, errno);
+    if (node == &root) return fail(r, EBUSY);
+    if (node->children) return fail(r, ENOTEMPTY);
+    detach(node);
+    if (node->refs) node->unlinked = true;
+    else free_node(node);
+    unlock();
+    return 0;
+}
+
+static int ram_chdir(struct _reent *r, const char *path) {
+    char leaf[MAX_NAME_LENGTH];
+    ram_node *parent;
+    lock();
+    ram_node *node = lookup(path, &parent, leaf);
+    if (!node) return fail(r, errno);
+    if (!node->is_dir) return fail(r, ENOTDIR);
+    unlock();
+    return 0;
+}
+
+static int ram_rename(struct _reent *r, const char *old_path, const char *new_path) {
+    char leaf[MAX_NAME_LENGTH], new_leaf[MAX_NAME_LENGTH];
+    ram_node *parent, *new_parent;
+    lock();
+    ram_node *node = lookup(old_path, &parent, leaf);
+    if (!node) return fail(r, errno);
+    if (node == &root) return fail(r, EBUSY);
+    if (lookup(new_path, &new_parent, new_leaf)) return fail(r, EEXIST);
+    if (!new_parent) return fail(r, errno);
+    ram_node *ancestor;
+    for (ancestor = new_parent; ancestor; ancestor = ancestor->parent) {
+        if (ancestor == node) return fail(r, EINVAL);
+    }
+    char *name = strdup(new_leaf);
+    if (!name) return fail(r, ENOMEM);
+    detach(node);
+    free(node->name);
+    node->name = name;
+    attach(node, new_parent);
+    unlock();
+    return 0;
+}
+
+static int ram_mkdir(struct _reent *r, const char *path, int mode) {
+    char leaf[MAX_NAME_LENGTH];
+    ram_node *parent;
+    lock();
+    if (lookup(path, &parent, leaf)) return fail(r, EEXIST);
+    if (!parent) return fail(r, errno);
+    if (!create(parent, leaf, true)) return fail(r, ENOMEM);
+    unlock();
+    return 0;
+}
+
+static DIR_ITER *ram_diropen(struct _reent *r, DIR_ITER *dir_state, const char *path) {
+    ram_dir *dir = dir_state->dirStruct;
+    char leaf[MAX_NAME_LENGTH];
+    ram_node *parent;
+    lock();
+    ram_node *node = lookup(path, &parent, leaf);
+    if (!node || !node->is_dir) {
+        fail(r, node ? ENOTDIR : errno);
+        return NULL;
+    }
+    dir->dir = node;
+    dir->next_child = node->children;
+    dir->next = open_dirs;
+    open_dirs = dir;
+    node->refs++;
+    open_handles++;
+    unlock();
+    return dir_state;
+}
+
+static int ram_dirreset(struct _reent *r, DIR_ITER *dir_state) {
+    ram_dir *dir = dir_state->dirStruct;
+    lock();
+    dir->next_child = dir->dir->children;
+    unlock();
+    return 0;
+}
+
+static int ram_dirnext(struct _reent *r, DIR_ITER *dir_state, char *filename, struct stat *st) {
+    ram_dir *dir = dir_state->dirStruct;
+    lock();
+    ram_node *child = dir->next_child;
+    if (!child) return fail(r, ENOENT);
+    dir->next_child = child->next;
+    strcpy(filename, child->name);
+    if (st) fill_stat(child, st);
+    unlock();
+    return 0;
+}
+
+static int ram_dirclose(struct _reent *r, DIR_ITER *dir_state) {
+    ram_dir *dir = dir_state->dirStruct;
+    lock();
+    ram_dir **link = &open_dirs;
+    while (*link != dir) link = &(*link)->next;
+    *link = dir->next;
+    release(dir->dir);
+    unlock();
+    return 0;
+}
+
+static int ram_statvfs(struct _reent *r, const char *path, struct statvfs *buf) {
+    lock();
+    memset(buf, 0, sizeof(struct statvfs));
+    buf->f_bsize = buf->f_frsize = BLOCK_SIZE;
+    buf->f_blocks = total_blocks;
+    buf->f_bfree = buf->f_bavail = num_free;
+    buf->f_namemax = MAX_NAME_LENGTH - 1;
+    unlock();
+    return 0;
+}
+
+static int ram_ftruncate(struct _reent *r, int fd, off_t len) {
+    ram_file *file = (ram_file *)fd;
+    lock();
+    if (!file->writable) return fail(r, EBADF);
+    if (len < 0 || len > 0xffffffff) return fail(r, EINVAL);
+    if (!resize_file(file->node, len)) return fail(r, ENOSPC);
+    file->node->mtime = time(NULL);
+    unlock();
+    return 0;
+}
+
+static int ram_fsync(struct _reent *r, int fd) {
+    return 0;
+}
+
+static const devoptab_t ram_devoptab = {
+    .name = "ram",
+    .structSize = sizeof(ram_file),
+    .open_r = ram_open,
+    .close_r = ram_close,
+    .write_r = ram_write,
+    .read_r = ram_read,
+    .seek_r = ram_seek,
+    .fstat_r = ram_fstat,
+    .stat_r = ram_stat,
+    .unlink_r = ram_unlink,
+    .chdir_r = ram_chdir,
+    .rename_r = ram_rename,
+    .mkdir_r = ram_mkdir,
+    .dirStateSize = sizeof(ram_dir),
+    .diropen_r = ram_diropen,
+    .dirreset_r = ram_dirreset,
+    .dirnext_r = ram_dirnext,
+    .dirclose_r = ram_dirclose,
+    .statvfs_r = ram_statvfs,
+    .ftruncate_r = ram_ftruncate,
+    .fsync_r = ram_fsync
+};
+
+bool mount_ram_disk() {
+    if (is_mounted || !total_blocks) return false;
+    root.mtime = time(NULL);
+    if (AddDevice(&ram_devoptab) < 0) return false;
+    return is_mounted = true;
+}
+
+/*
+    Unmounting discards the contents.  Open files are left pointing at their nodes, which are freed as they close.
+*/
+bool unmount_ram_disk() {
+    if (!is_mounted) return false;
+    RemoveDevice(DEVICE_NAME);
+    lock();
+    while (root.children) {
+        ram_node *child = root.children;
+        detach(child);
+        if (child->refs) child->unlinked = true;
+        else free_node(child);
+    }
+    unlock();
+    is_mounted = false;
+    return true;
+}
+
+/*
+    The region sits directly below the DVD cache, so it can give its memory back by raising the top of the
+    arena again.  It can only be moved while no files or iterators are open and nothing is stored in it.
+*/
+s32 resize_ram_disk(u32 size) {
+    size &= ~(BLOCK_SIZE - 1);
+    lock();
+    if (open_handles || root.children) {
+        unlock();
+        return -EBUSY;
+    }
+    u8 *hi = SYS_GetArena2Hi(), *lo = SYS_GetArena2Lo();
+    if (region) hi = region + total_blocks * BLOCK_SIZE;
+    if (hi < lo || hi - lo < size) {
+        unlock();
+        return -ENOMEM;
+    }
+    u32 *new_free_blocks = NULL;
+    if (size && !(new_free_blocks = malloc(size / BLOCK_SIZE * sizeof(u32)))) {
+        unlock();
+        return -ENOMEM;
+    }
+    free(free_blocks);
+    free_blocks = new_free_blocks;
+    total_blocks = num_free = size / BLOCK_SIZE;
+    region = size ? hi - size : NULL;
+    u32 i;
+    for (i = 0; i < total_blocks; i++) free_blocks[i] = total_blocks - 1 - i;
+    SYS_SetArena2Hi(hi - size);
+    unlock();
+    return 0;
+}
+
+void ram_disk_usage(u32 *size, u32 *used) {
+    lock();
+    *size = total_blocks * BLOCK_SIZE;
+    *used = (total_blocks - num_free) * BLOCK_SIZE;
+    unlock();
+}
+
+void initialise_ram_disk() {
+    if (LWP_MutexInit(&ram_mutex, false) < 0) {
+        printf("Unable to create RAM disk lock, /ram will not be available.\n");
+        return;
+    }
+    s32 result = resize_ram_disk(DEFAULT_RAM_DISK_SIZE);
+    if (result < 0) {
+        printf("Unable to reserve MEM2 for the RAM disk: [%i] %s\n", -result, strerror(-result));
+        return;
+    }
+    mount_ram_disk();
+}
@@ -0,0 +1,46 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include <gctypes.h>
+
+/*
+    A RAM filesystem at ram:/, kept in a block of MEM2 below the DVD cache.  Its contents are lost on unmount.
+*/
+void initialise_ram_disk();
+
+bool mount_ram_disk();
+
+bool unmount_ram_disk();
+
+/*
+    Sets the size cap, giving memory back to the top of MEM2 or taking more from it.
+    Fails with EBUSY unless the RAM disk is empty.
+*/
+s32 resize_ram_disk(u32 size);
+
+void ram_disk_usage(u32 *size, u32 *used);
+
+#endif /* _RAMDISK_H_ */
@@ -0,0 +1,131 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <di/di.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dvd.h"
+#include "net.h"
+#include "raw.h"
+
+#define RAW_READ_SIZE 0x20000
+#define DISC_SECTOR_SIZE 512
+#define DVD_SECTOR_SIZE 2048
+
+struct raw_image {
+    VIRTUAL_PARTITION *partition;
+    u32 sector_size;
+    u32 sector;
+    u32 skip;
+    bool finished;
+    u8 *buf;
+};
+
+static bool _raw_enabled = false;
+
+bool raw_enabled() {
+    return _raw_enabled;
+}
+
+void set_raw_enabled(bool enabled) {
+    _raw_enabled = enabled;
+}
+
+/*
+    The DVD is imaged through DI as a whole, and is available whenever any of
+    the disc filesystems is mounted.  Other partitions need a DISC_INTERFACE.
+*/
+bool raw_available(VIRTUAL_PARTITION *partition) {
+    if (!_raw_enabled) return false;
+    if (partition == PA_DVD) return !dvd_mountWait() && (mounted(PA_DVD) || mounted(PA_WOD) || mounted(PA_FST));
+    return partition->disc && mounted(partition);
+}
+
+RAW_IMAGE *raw_open(VIRTUAL_PARTITION *partition, off_t offset) {
+    if (!raw_available(partition)) {
+        errno = ENODEV;
+        return NULL;
+    }
+    RAW_IMAGE *image = malloc(sizeof(RAW_IMAGE));
+    if (!image) goto nomem;
+    image->buf = memalign(32, RAW_READ_SIZE);
+    if (!image->buf) goto nomem;
+    image->partition = partition;
+    image->sector_size = partition == PA_DVD ? DVD_SECTOR_SIZE : DISC_SECTOR_SIZE;
+    image->sector = offset / image->sector_size;
+    image->skip = offset % image->sector_size;
+    image->finished = false;
+    return image;
+
+    nomem:
+    free(image);
+    errno = ENOMEM;
+    return NULL;
+}
+
+static bool read_sectors(RAW_IMAGE *image, u32 sector, u32 count, u8 *buf) {
+    if (image->partition == PA_DVD) {
+        return !DI_ReadDVD(buf, count, sector);
+    }
+    return image->partition->disc->readSectors(sector, count, buf);
+}
+
+/*
+    Neither DISC_INTERFACE nor DI can tell us the size of the medium, so the image
+    ends at the first sector that cannot be read.  When a full run fails, the run
+    is retried a sector at a time to find out how much of it is readable.
+*/
+s32 send_from_raw(s32 s, RAW_IMAGE *image) {
+    if (image->finished) return 0;
+    u32 run_sectors = RAW_READ_SIZE / image->sector_size;
+    u32 count = run_sectors;
+    if (!read_sectors(image, image->sector, count, image->buf)) {
+        for (count = 0; count < run_sectors; count++) {
+            if (!read_sectors(image, image->sector + count, 1, image->buf + count * image->sector_size)) break;
+        }
+        printf("End of raw image of %s at sector %u.\n", image->partition->name, image->sector + count);
+        image->finished = true;
+    }
+
+    u32 length = count * image->sector_size;
+    s32 bytes_sent = 0;
+    if (length > image->skip) {
+        bytes_sent = length - image->skip;
+        s32 result = send_exact(s, (char *)image->buf + image->skip, bytes_sent);
+        if (result < 0) return result;
+    }
+    image->skip = 0;
+    image->sector += count;
+
+    if (bytes_sent) return bytes_sent;
+    return image->finished ? 0 : -EAGAIN;
+}
+
+s32 raw_close(RAW_IMAGE *image) {
+    free(image->buf);
+    free(image);
+    return 0;
+}
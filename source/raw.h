@@ -0,0 +1,43 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _RAW_H_
+#define _RAW_H_
+
+#include "fs.h"
+
+typedef struct raw_image RAW_IMAGE;
+
+bool raw_enabled();
+
+void set_raw_enabled(bool enabled);
+
+bool raw_available(VIRTUAL_PARTITION *partition);
+
+RAW_IMAGE *raw_open(VIRTUAL_PARTITION *partition, off_t offset);
+
+s32 send_from_raw(s32 s, RAW_IMAGE *image);
+
+s32 raw_close(RAW_IMAGE *image);
+
+#endif /* _RAW_H_ */
@@ -0,0 +1,285 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <malloc.h>
+#include <ogc/lwp_watchdog.h>
+#include <ogc/mutex.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define MAX_COMMAND_STATS 64
+#define HISTOGRAM_BUCKETS 5
+
+static const char *counter_names[MAX_STAT_COUNTERS] = {
+    "connections", "connections_refused", "data_connection_timeouts", "transfer_errors", "transfer_aborts",
+    "transfer_stalls", "idle_timeouts", "net_buffer_fallbacks", "mounts", "mount_failures", "unmounts", "device_insertions",
+    "device_removals", "dvd_reads", "dvd_cache_hits", "dvd_cache_misses",
+    "isfs_cache_hits", "isfs_cache_misses"
+};
+
+/* upper bounds of the histogram buckets; the last bucket is unbounded */
+static const u32 latency_bounds_ms[HISTOGRAM_BUCKETS - 1] = { 1, 10, 100, 1000 };
+static const u32 rate_bounds_kbps[HISTOGRAM_BUCKETS - 1] = { 64, 256, 1024, 4096 };
+
+typedef struct {
+    const char *scope;
+    const char *command;
+    u32 count;
+    u64 total_ticks;
+    u64 max_ticks;
+    u32 histogram[HISTOGRAM_BUCKETS];
+} command_stats;
+
+typedef struct {
+    u32 count;
+    u64 bytes;
+    u64 ticks;
+    u32 histogram[HISTOGRAM_BUCKETS];
+} transfer_stats;
+
+typedef struct {
+    u64 bytes_read;
+    u64 read_ticks;
+    u64 bytes_written;
+    u64 write_ticks;
+} partition_stats;
+
+static mutex_t stats_mutex = LWP_MUTEX_NULL; // commands and transfers are recorded from the workers too
+static u64 stats_since = 0;
+static u32 counters[MAX_STAT_COUNTERS];
+static u32 sessions = 0;
+static u32 peak_sessions = 0;
+static command_stats commands[MAX_COMMAND_STATS];
+static u32 num_commands = 0;
+static transfer_stats downloads;
+static transfer_stats uploads;
+static partition_stats partitions[sizeof(VIRTUAL_PARTITIONS) / sizeof(VIRTUAL_PARTITION)];
+
+static u32 bucket(u32 value, const u32 *bounds) {
+    u32 i;
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1 && value >= bounds[i]; i++);
+    return i;
+}
+
+void initialise_stats() {
+    LWP_MutexInit(&stats_mutex, false);
+    reset_stats();
+}
+
+/*
+    Peak sessions restart from the number of clients currently connected.
+*/
+void reset_stats() {
+    LWP_MutexLock(stats_mutex);
+    stats_since = gettime();
+    memset(counters, 0, sizeof(counters));
+    peak_sessions = sessions;
+    memset(commands, 0, sizeof(commands));
+    num_commands = 0;
+    memset(&downloads, 0, sizeof(downloads));
+    memset(&uploads, 0, sizeof(uploads));
+    memset(partitions, 0, sizeof(partitions));
+    LWP_MutexUnlock(stats_mutex);
+}
+
+void stats_increment(stat_counter counter) {
+    __atomic_fetch_add(counters + counter, 1, __ATOMIC_RELAXED);
+}
+
+void stats_set_sessions(u32 current_sessions) {
+    sessions = current_sessions;
+    if (sessions > peak_sessions) peak_sessions = sessions;
+}
+
+/*
+    scope and command must be string constants, they are kept by reference, and compared by reference
+    before falling back to comparing the strings.
+    Commands beyond MAX_COMMAND_STATS distinct names are not recorded.
+*/
+void stats_record_command(const char *scope, const char *command, u64 ticks) {
+    command_stats *stats = NULL;
+    u32 i;
+    LWP_MutexLock(stats_mutex);
+    for (i = 0; i < num_commands && !stats; i++) {
+        if (commands[i].scope == scope && commands[i].command == command) stats = commands + i;
+    }
+    for (i = 0; i < num_commands && !stats; i++) {
+        if (!strcmp(commands[i].scope, scope) && !strcmp(commands[i].command, command)) stats = commands + i;
+    }
+    if (!stats) {
+        if (num_commands == MAX_COMMAND_STATS) goto end;
+        stats = commands + num_commands++;
+        stats->scope = scope;
+        stats->command = command;
+    }
+    stats->count++;
+    stats->total_ticks += ticks;
+    if (ticks > stats->max_ticks) stats->max_ticks = ticks;
+    stats->histogram[bucket(ticks_to_millisecs(ticks), latency_bounds_ms)]++;
+    end:
+    LWP_MutexUnlock(stats_mutex);
+}
+
+/*
+    partition may be NULL for transfers that are not backed by a partition, such as directory listings.
+    Transfers too short to time are counted, but left out of the rate histogram.
+*/
+void stats_record_transfer(VIRTUAL_PARTITION *partition, bool upload, u64 bytes, u64 ticks) {
+    transfer_stats *stats = upload ? &uploads : &downloads;
+    u64 us = ticks_to_microsecs(ticks);
+    u64 kbps = us ? bytes * 1000000 / 1024 / us : 0;
+    LWP_MutexLock(stats_mutex);
+    stats->count++;
+    stats->bytes += bytes;
+    stats->ticks += ticks;
+    if (us) stats->histogram[bucket(kbps > 0xffffffff ? 0xffffffff : kbps, rate_bounds_kbps)]++;
+    if (partition) {
+        partition_stats *pstats = partitions + (partition - VIRTUAL_PARTITIONS);
+        if (upload) {
+            pstats->bytes_written += bytes;
+            pstats->write_ticks += ticks;
+        } else {
+            pstats->bytes_read += bytes;
+            pstats->read_ticks += ticks;
+        }
+    }
+    LWP_MutexUnlock(stats_mutex);
+}
+
+typedef struct {
+    char *buf;
+    u32 size;
+    u32 length;
+} stats_writer;
+
+static void append(stats_writer *writer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    u32 available = writer->length < writer->size ? writer->size - writer->length : 0;
+    int length = vsnprintf(available ? writer->buf + writer->length : NULL, available, format, args);
+    va_end(args);
+    if (length > 0) writer->length += length;
+}
+
+static void append_histogram(stats_writer *writer, const char *name, const u32 *histogram, const u32 *bounds, const char *unit) {
+    u32 i;
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        append(writer, "%s.lt_%u%s %u\n", name, bounds[i], unit, histogram[i]);
+    }
+    append(writer, "%s.ge_%u%s %u\n", name, bounds[HISTOGRAM_BUCKETS - 2], unit, histogram[HISTOGRAM_BUCKETS - 1]);
+}
+
+static void append_transfers(stats_writer *writer, const char *name, transfer_stats *stats) {
+    u64 us = ticks_to_microsecs(stats->ticks);
+    append(writer, "%s.count %u\n", name, stats->count);
+    append(writer, "%s.bytes %llu\n", name, stats->bytes);
+    append(writer, "%s.ms %llu\n", name, us / 1000);
+    append(writer, "%s.kbps %llu\n", name, us ? stats->bytes * 1000000 / 1024 / us : 0);
+    char histogram_name[32];
+    sprintf(histogram_name, "%s.rate", name);
+    append_histogram(writer, histogram_name, stats->histogram, rate_bounds_kbps, "kbps");
+}
+
+/*
+    Throughput is over the time spent transferring to or from the partition, like download.kbps and upload.kbps.
+*/
+static void append_partition_rate(stats_writer *writer, const char *alias, const char *direction, u64 bytes, u64 ticks) {
+    u64 us = ticks_to_microsecs(ticks);
+    append(writer, "partition.%s.%s_ms %llu\n", alias, direction, us / 1000);
+    append(writer, "partition.%s.%s_kbps %llu\n", alias, direction, us ? bytes * 1000000 / 1024 / us : 0);
+}
+
+/*
+    Renders the metrics as one "<name> <value>" pair per line, e.g. "command.RETR.count 12".
+    Like snprintf, returns the length of the full text even when it does not fit in buf.
+*/
+u32 stats_format(char *buf, u32 size) {
+    stats_writer writer = { buf, size, 0 };
+    if (size) *buf = '\0';
+    LWP_MutexLock(stats_mutex);
+
+    append(&writer, "elapsed_ms %llu\n", ticks_to_millisecs(gettime() - stats_since));
+    struct mallinfo heap = mallinfo();
+    append(&writer, "heap.arena %u\n", (u32)heap.arena);
+    append(&writer, "heap.in_use %u\n", (u32)heap.uordblks);
+    append(&writer, "heap.free %u\n", (u32)heap.fordblks);
+    append(&writer, "sessions.active %u\n", sessions);
+    append(&writer, "sessions.peak %u\n", peak_sessions);
+
+    u32 i;
+    for (i = 0; i < MAX_STAT_COUNTERS; i++) {
+        append(&writer, "counter.%s %u\n", counter_names[i], __atomic_load_n(counters + i, __ATOMIC_RELAXED));
+    }
+
+    append_transfers(&writer, "download", &downloads);
+    append_transfers(&writer, "upload", &uploads);
+
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+        partition_stats *stats = partitions + i;
+        if (!stats->bytes_read && !stats->bytes_written) continue;
+        const char *alias = VIRTUAL_PARTITIONS[i].alias + 1;
+        append(&writer, "partition.%s.bytes_read %llu\n", alias, stats->bytes_read);
+        append(&writer, "partition.%s.bytes_written %llu\n", alias, stats->bytes_written);
+        append_partition_rate(&writer, alias, "read", stats->bytes_read, stats->read_ticks);
+        append_partition_rate(&writer, alias, "write", stats->bytes_written, stats->write_ticks);
+    }
+
+    for (i = 0; i < num_commands; i++) {
+        command_stats *stats = commands + i;
+        char name[32];
+        sprintf(name, "command.%s%s%s", stats->scope, *stats->scope ? "_" : "", stats->command);
+        append(&writer, "%s.count %u\n", name, stats->count);
+        append(&writer, "%s.total_ms %llu\n", name, ticks_to_millisecs(stats->total_ticks));
+        append(&writer, "%s.max_ms %llu\n", name, ticks_to_millisecs(stats->max_ticks));
+        strcat(name, ".latency");
+        append_histogram(&writer, name, stats->histogram, latency_bounds_ms, "ms");
+    }
+
+    LWP_MutexUnlock(stats_mutex);
+    return writer.length;
+}
+
+/*
+    Returns a read-only snapshot of the metrics, as rendered by stats_format().
+*/
+FILE *stats_fopen() {
+    u32 size = stats_format(NULL, 0) + STATS_SLACK;
+    char *text = malloc(size);
+    if (!text) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    u32 length = stats_format(text, size);
+    if (length >= size) length = size - 1;
+    FILE *f = fmemopen(NULL, length + 1, "w+");
+    if (f) {
+        fwrite(text, 1, length, f);
+        rewind(f);
+    }
+    free(text);
+    return f;
+}
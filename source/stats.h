@@ -0,0 +1,72 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+
+#include "fs.h"
+
+typedef enum {
+    STAT_CONNECTIONS,
+    STAT_CONNECTIONS_REFUSED,
+    STAT_DATA_CONNECTION_TIMEOUTS,
+    STAT_TRANSFER_ERRORS,
+    STAT_TRANSFER_ABORTS,
+    STAT_TRANSFER_STALLS,
+    STAT_IDLE_TIMEOUTS,
+    STAT_NET_BUFFER_FALLBACKS,
+    STAT_MOUNTS,
+    STAT_MOUNT_FAILURES,
+    STAT_UNMOUNTS,
+    STAT_DEVICE_INSERTIONS,
+    STAT_DEVICE_REMOVALS,
+    STAT_DVD_READS,
+    STAT_DVD_CACHE_HITS,
+    STAT_DVD_CACHE_MISSES,
+    STAT_ISFS_CACHE_HITS,
+    STAT_ISFS_CACHE_MISSES,
+    MAX_STAT_COUNTERS
+} stat_counter;
+
+void initialise_stats();
+
+void reset_stats();
+
+void stats_increment(stat_counter counter);
+
+void stats_set_sessions(u32 sessions);
+
+void stats_record_command(const char *scope, const char *command, u64 ticks);
+
+void stats_record_transfer(VIRTUAL_PARTITION *partition, bool upload, u64 bytes, u64 ticks);
+
+/* counters may grow by a few digits between sizing a buffer with stats_format() and rendering into it */
+#define STATS_SLACK 64
+
+u32 stats_format(char *buf, u32 size);
+
+FILE *stats_fopen();
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,568 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/dir.h>
+
+#include "fs.h"
+#include "net.h"
+#include "tar.h"
+#include "vrt.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_BUFFER_SIZE 32768
+#define TAR_MAX_HEADER_SIZE (TAR_BLOCK_SIZE * (2 + (MAXPATHLEN + TAR_BLOCK_SIZE) / TAR_BLOCK_SIZE))
+
+static const char *TAR_SUFFIX = ".tar";
+static const char *GNU_LONGNAME = "././@LongLink";
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} tar_header;
+
+struct tar_stream {
+    VRT_WALK *walk;
+    size_t name_offset;
+    FILE *f;
+    u64 remaining;
+    u32 trailer_blocks;
+    off_t skip;
+    char buf[TAR_BUFFER_SIZE];
+};
+
+/*
+    Opens a ustar stream of the directory named by a client-visible path of the form "<dir>.tar".
+    Member names are relative to the parent of <dir>, so the archive extracts to a single directory.
+    Returns NULL if the path does not have that form, or <dir> is not a directory.
+*/
+TAR_STREAM *tar_open(char *cwd, char *path, off_t offset) {
+    size_t path_len = strlen(path);
+    size_t suffix_len = strlen(TAR_SUFFIX);
+    if (path_len <= suffix_len || strcasecmp(TAR_SUFFIX, path + path_len - suffix_len)) {
+        errno = ENOENT;
+        return NULL;
+    }
+    char dir[path_len + 1];
+    strcpy(dir, path);
+    dir[path_len - suffix_len] = '\0';
+
+    struct stat st;
+    char *real_path = to_real_path(cwd, dir);
+    if (!real_path) return NULL;
+    bool is_root = !*real_path;
+    if (!is_root) free(real_path);
+    if (is_root || vrt_stat(cwd, dir, &st) || !(st.st_mode & S_IFDIR)) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    TAR_STREAM *tar = malloc(sizeof(TAR_STREAM));
+    if (!tar) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!(tar->walk = vrt_walkopen(cwd, dir, false))) {
+        free(tar);
+        return NULL;
+    }
+    tar->name_offset = 0;
+    tar->f = NULL;
+    tar->remaining = 0;
+    tar->trailer_blocks = 2;
+    tar->skip = offset;
+    return tar;
+}
+
+static void set_octal(char *field, size_t field_size, u64 value) {
+    if (value >> (3 * (field_size - 1))) {
+        // GNU base-256 encoding for values that do not fit in the octal field
+        memset(field, 0, field_size);
+        size_t i;
+        for (i = field_size - 1; i > 0; i--, value >>= 8) field[i] = value & 0xff;
+        field[0] = 0x80;
+    } else {
+        sprintf(field, "%0*llo", (int)field_size - 1, (unsigned long long)value);
+    }
+}
+
+/*
+    Returns the '/' at which a name longer than the ustar name field can be split into prefix and name,
+    or NULL if it does not fit in ustar at all.  A directory's trailing '/' is not a split point, as it would
+    leave the name field empty.
+*/
+static char *ustar_split(char *name) {
+    size_t name_len = strlen(name);
+    char *split = name + name_len - sizeof(((tar_header *)0)->name) - 1;
+    char *last = name + name_len - 1;
+    while (split < last && *split != '/') split++;
+    return (split < last && split - name <= sizeof(((tar_header *)0)->prefix)) ? split : NULL;
+}
+
+static bool fits_ustar(char *name) {
+    return strlen(name) <= sizeof(((tar_header *)0)->name) || ustar_split(name);
+}
+
+static void fill_header(tar_header *header, char *name, char typeflag, u64 size, time_t mtime) {
+    memset(header, 0, sizeof(tar_header));
+    size_t name_len = strlen(name);
+    char *split;
+    if (name_len <= sizeof(header->name)) {
+        memcpy(header->name, name, name_len);
+    } else if ((split = ustar_split(name))) {
+        memcpy(header->prefix, name, split - name);
+        memcpy(header->name, split + 1, name_len - (split - name) - 1);
+    } else {
+        // the caller has already written a GNU long name entry
+        memcpy(header->name, name, sizeof(header->name));
+    }
+    strcpy(header->mode, typeflag == '5' ? "0000755" : "0000644");
+    strcpy(header->uid, "0000000");
+    strcpy(header->gid, "0000000");
+    set_octal(header->size, sizeof(header->size), size);
+    set_octal(header->mtime, sizeof(header->mtime), mtime < 0 ? 0 : mtime);
+    header->typeflag = typeflag;
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    u32 checksum = 0;
+    u8 *byte;
+    for (byte = (u8 *)header; byte < (u8 *)(header + 1); byte++) checksum += *byte;
+    sprintf(header->checksum, "%06o", checksum);
+    header->checksum[7] = ' ';
+}
+
+/*
+    Appends the header blocks for the next member to buf, opening it if it is a regular file.
+    Returns the number of bytes written, or -1 when there are no more members.
+*/
+static s32 next_member(TAR_STREAM *tar, char *buf) {
+    char path[MAXPATHLEN];
+    struct stat st;
+    while (!vrt_walknext(tar->walk, path, &st)) {
+        if (!tar->name_offset) {
+            // the first member is the directory itself
+            tar->name_offset = strrchr(path, '/') + 1 - path;
+        }
+        char name[MAXPATHLEN + 1];
+        strcpy(name, path + tar->name_offset);
+
+        char typeflag;
+        u64 size = 0;
+        if (st.st_mode & S_IFDIR) {
+            typeflag = '5';
+            strcat(name, "/");
+        } else if (S_ISREG(st.st_mode)) {
+            if (!(tar->f = vrt_fopen("/", path, "rb"))) {
+                printf("Unable to open %s for archiving: [%i] %s\n", path, errno, strerror(errno));
+                continue;
+            }
+            typeflag = '0';
+            size = st.st_size;
+        } else {
+            continue;
+        }
+
+        s32 length = 0;
+        if (!fits_ustar(name)) {
+            size_t name_size = strlen(name) + 1;
+            fill_header((tar_header *)buf, (char *)GNU_LONGNAME, 'L', name_size, 0);
+            length += TAR_BLOCK_SIZE;
+            size_t padded_size = (name_size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+            memset(buf + length, 0, padded_size);
+            memcpy(buf + length, name, name_size);
+            length += padded_size;
+        }
+        fill_header((tar_header *)(buf + length), name, typeflag, size, st.st_mtime);
+        length += TAR_BLOCK_SIZE;
+
+        tar->remaining = size;
+        if (tar->f && !size) {
+            fclose(tar->f);
+            tar->f = NULL;
+        }
+        return length;
+    }
+    return -1;
+}
+
+/*
+    Appends up to max_length bytes of the current member's data to buf, followed by padding when the member is complete.
+    A member that turns out to be shorter than its stat() size is padded with zeroes to keep the archive consistent.
+*/
+static u32 member_data(TAR_STREAM *tar, char *buf, u32 max_length) {
+    u32 length = MIN(max_length, tar->remaining);
+    size_t bytes_read = fread(buf, 1, length, tar->f);
+    if (bytes_read < length) {
+        printf("Short read while archiving, padding with zeroes.\n");
+        memset(buf + bytes_read, 0, length - bytes_read);
+    }
+    tar->remaining -= length;
+    if (!tar->remaining) {
+        fclose(tar->f);
+        tar->f = NULL;
+        u32 padding = (TAR_BLOCK_SIZE - (length % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+        memset(buf + length, 0, padding);
+        length += padding;
+    }
+    return length;
+}
+
+/*
+    The buffer size is a multiple of the block size, so headers always start on a block boundary within the buffer.
+*/
+s32 send_tar(s32 s, TAR_STREAM *tar) {
+    u32 length = 0;
+    while (length < TAR_BUFFER_SIZE) {
+        if (tar->f) {
+            length += member_data(tar, tar->buf + length, TAR_BUFFER_SIZE - length);
+        } else if (tar->walk && length + TAR_MAX_HEADER_SIZE <= TAR_BUFFER_SIZE) {
+            s32 header_length = next_member(tar, tar->buf + length);
+            if (header_length < 0) {
+                vrt_walkclose(tar->walk);
+                tar->walk = NULL;
+            } else {
+                length += header_length;
+            }
+        } else if (!tar->walk && tar->trailer_blocks) {
+            memset(tar->buf + length, 0, TAR_BLOCK_SIZE);
+            length += TAR_BLOCK_SIZE;
+            tar->trailer_blocks--;
+        } else {
+            break;
+        }
+    }
+
+    s32 bytes_sent = 0;
+    if (tar->skip >= length) {
+        tar->skip -= length;
+    } else {
+        bytes_sent = length - tar->skip;
+        s32 result = send_exact(s, tar->buf + tar->skip, bytes_sent);
+        tar->skip = 0;
+        if (result < 0) return result;
+    }
+    if (bytes_sent) return bytes_sent;
+    return (tar->walk || tar->trailer_blocks) ? -EAGAIN : 0;
+}
+
+s32 tar_close(TAR_STREAM *tar) {
+    if (tar->f) fclose(tar->f);
+    if (tar->walk) vrt_walkclose(tar->walk);
+    free(tar);
+    return 0;
+}
+
+typedef enum { UNTAR_HEADER, UNTAR_DATA, UNTAR_METADATA, UNTAR_PADDING, UNTAR_END } untar_state_t;
+
+struct tar_extract {
+    untar_state_t state;
+    char dir[MAXPATHLEN];
+    char header[TAR_BLOCK_SIZE];
+    u32 header_length;
+    u32 zero_blocks;
+    FILE *f;
+    u64 remaining;
+    u32 padding;
+    char metadata_type;
+    char metadata[MAXPATHLEN * 2];
+    u32 metadata_length;
+    char long_name[MAXPATHLEN];
+    u32 files;
+    u32 dirs;
+    u32 failed;
+};
+
+/*
+    Prepares to extract an archive into dir, which is a client-visible absolute path ending in '/'.
+*/
+TAR_EXTRACT *untar_open(char *dir) {
+    if (strlen(dir) >= MAXPATHLEN) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    TAR_EXTRACT *untar = malloc(sizeof(TAR_EXTRACT));
+    if (!untar) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(untar, 0, sizeof(TAR_EXTRACT));
+    untar->state = UNTAR_HEADER;
+    strcpy(untar->dir, dir);
+    return untar;
+}
+
+static u64 get_octal(char *field, size_t field_size) {
+    u64 value = 0;
+    size_t i;
+    if ((u8)field[0] == 0x80) {
+        for (i = 1; i < field_size; i++) value = (value << 8) | (u8)field[i];
+        return value;
+    }
+    for (i = 0; i < field_size && field[i] == ' '; i++);
+    for (; i < field_size && field[i] >= '0' && field[i] <= '7'; i++) value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static bool valid_checksum(tar_header *header) {
+    u32 checksum = 0;
+    u8 *byte;
+    for (byte = (u8 *)header; byte < (u8 *)(header + 1); byte++) {
+        if (byte >= (u8 *)header->checksum && byte < (u8 *)header->checksum + sizeof(header->checksum)) checksum += ' ';
+        else checksum += *byte;
+    }
+    return checksum == get_octal(header->checksum, sizeof(header->checksum));
+}
+
+/*
+    Stores the member's path below the extraction directory in path.
+    Returns false for names that are absolute after stripping, contain "..", or are too long.
+*/
+static bool member_path(TAR_EXTRACT *untar, tar_header *header, char *path) {
+    char name[MAXPATHLEN];
+    if (*untar->long_name) {
+        strcpy(name, untar->long_name);
+        *untar->long_name = '\0';
+    } else {
+        char field[sizeof(header->name) + 1];
+        memcpy(field, header->name, sizeof(header->name));
+        field[sizeof(header->name)] = '\0';
+        *name = '\0';
+        if (*header->prefix) sprintf(name, "%.*s/", (int)sizeof(header->prefix), header->prefix);
+        strcat(name, field);
+    }
+
+    char *rest = name;
+    while (*rest == '/' || (rest[0] == '.' && rest[1] == '/')) rest += (*rest == '/') ? 1 : 2;
+    char *component = rest;
+    while (component) {
+        if (!strncmp(component, "..", 2) && (component[2] == '/' || !component[2])) return false;
+        if ((component = strchr(component, '/'))) component++;
+    }
+    size_t rest_len = strlen(rest);
+    while (rest_len && rest[rest_len - 1] == '/') rest[--rest_len] = '\0';
+    if (!rest_len || strlen(untar->dir) + rest_len >= MAXPATHLEN) return false;
+
+    strcpy(path, untar->dir);
+    strcat(path, rest);
+    return true;
+}
+
+/*
+    Creates the parent directories of path that lie below the extraction directory.
+*/
+static void make_parents(TAR_EXTRACT *untar, char *path) {
+    char *slash = path + strlen(untar->dir);
+    while ((slash = strchr(slash, '/'))) {
+        *slash = '\0';
+        vrt_mkdir("/", path, 0777);
+        *slash++ = '/';
+    }
+}
+
+static void skip_data(TAR_EXTRACT *untar, u64 size) {
+    untar->remaining = size;
+    untar->padding = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    untar->state = size ? UNTAR_DATA : UNTAR_HEADER;
+}
+
+/*
+    Takes the path from a pax extended header; other pax attributes are ignored.
+*/
+static void parse_pax(TAR_EXTRACT *untar) {
+    char *record = untar->metadata;
+    char *end = untar->metadata + untar->metadata_length;
+    while (record < end) {
+        char *next;
+        u32 record_length = strtoul(record, &next, 10);
+        if (!record_length || next >= end || record + record_length > end) break;
+        if (!strncmp(next, " path=", 6) && record_length - (next + 6 - record) <= MAXPATHLEN) {
+            size_t value_length = record_length - (next + 6 - record) - 1;
+            memcpy(untar->long_name, next + 6, value_length);
+            untar->long_name[value_length] = '\0';
+        }
+        record += record_length;
+    }
+}
+
+static s32 process_header(TAR_EXTRACT *untar) {
+    tar_header *header = (tar_header *)untar->header;
+    u32 i;
+    for (i = 0; i < TAR_BLOCK_SIZE && !untar->header[i]; i++);
+    if (i == TAR_BLOCK_SIZE) {
+        if (++untar->zero_blocks == 2) untar->state = UNTAR_END;
+        return 0;
+    }
+    untar->zero_blocks = 0;
+    if (!valid_checksum(header)) {
+        printf("Invalid tar header checksum, aborting extraction.\n");
+        return -EINVAL;
+    }
+
+    u64 size = get_octal(header->size, sizeof(header->size));
+    if (header->typeflag == 'L' || header->typeflag == 'x') {
+        skip_data(untar, size);
+        untar->metadata_type = header->typeflag;
+        untar->metadata_length = 0;
+        if (size && size <= sizeof(untar->metadata)) untar->state = UNTAR_METADATA;
+        return 0;
+    }
+
+    char path[MAXPATHLEN];
+    if (!member_path(untar, header, path)) {
+        printf("Skipping unsafe tar member %.100s\n", header->name);
+        untar->failed++;
+        skip_data(untar, size);
+        return 0;
+    }
+
+    if (header->typeflag == '5') {
+        if (vrt_mkdir("/", path, 0777) && errno != EEXIST) {
+            make_parents(untar, path);
+            if (vrt_mkdir("/", path, 0777) && errno != EEXIST) {
+                printf("Unable to create %s: [%i] %s\n", path, errno, strerror(errno));
+                untar->failed++;
+                return 0;
+            }
+        }
+        untar->dirs++;
+        skip_data(untar, size);
+    } else if (header->typeflag == '0' || header->typeflag == '\0' || header->typeflag == '7') {
+        if (!(untar->f = vrt_fopen("/", path, "wb"))) {
+            make_parents(untar, path);
+            untar->f = vrt_fopen("/", path, "wb");
+        }
+        if (untar->f) {
+            untar->files++;
+        } else {
+            printf("Unable to create %s: [%i] %s\n", path, errno, strerror(errno));
+            untar->failed++;
+        }
+        skip_data(untar, size);
+        if (untar->f && !size) {
+            vrt_fclose(untar->f);
+            untar->f = NULL;
+        }
+    } else {
+        if (header->typeflag != 'g') printf("Skipping tar member %s of unsupported type '%c'\n", path, header->typeflag);
+        skip_data(untar, size);
+    }
+    return 0;
+}
+
+/*
+    Consumes a chunk of the archive, writing member data straight from the network buffer.
+*/
+static s32 untar_consume(TAR_EXTRACT *untar, char *buf, s32 length) {
+    while (length) {
+        u32 chunk;
+        switch (untar->state) {
+            case UNTAR_HEADER:
+                chunk = MIN(length, TAR_BLOCK_SIZE - untar->header_length);
+                memcpy(untar->header + untar->header_length, buf, chunk);
+                untar->header_length += chunk;
+                if (untar->header_length == TAR_BLOCK_SIZE) {
+                    untar->header_length = 0;
+                    s32 result = process_header(untar);
+                    if (result < 0) return result;
+                }
+                break;
+            case UNTAR_DATA:
+            case UNTAR_METADATA:
+                chunk = MIN(length, untar->remaining);
+                if (untar->state == UNTAR_METADATA) {
+                    memcpy(untar->metadata + untar->metadata_length, buf, chunk);
+                    untar->metadata_length += chunk;
+                } else if (untar->f && fwrite(buf, 1, chunk, untar->f) < chunk) {
+                    printf("Error writing tar member: [%i] %s\n", errno, strerror(errno));
+                    vrt_fclose(untar->f);
+                    untar->f = NULL;
+                    untar->failed++;
+                }
+                untar->remaining -= chunk;
+                if (!untar->remaining) {
+                    if (untar->f) {
+                        vrt_fclose(untar->f);
+                        untar->f = NULL;
+                    }
+                    if (untar->state == UNTAR_METADATA) {
+                        if (untar->metadata_type == 'L' && untar->metadata_length <= MAXPATHLEN) {
+                            memcpy(untar->long_name, untar->metadata, untar->metadata_length);
+                            untar->long_name[untar->metadata_length - 1] = '\0';
+                        } else if (untar->metadata_type == 'x') {
+                            parse_pax(untar);
+                        }
+                    }
+                    untar->state = untar->padding ? UNTAR_PADDING : UNTAR_HEADER;
+                }
+                break;
+            case UNTAR_PADDING:
+                chunk = MIN(length, untar->padding);
+                untar->padding -= chunk;
+                if (!untar->padding) untar->state = UNTAR_HEADER;
+                break;
+            default:
+                chunk = length;
+        }
+        buf += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/*
+    Fails the transfer if the archive was truncated or any member could not be extracted.
+*/
+s32 recv_to_untar(s32 s, TAR_EXTRACT *untar) {
+    s32 result = recv_to_consumer(s, (recv_consumer)untar_consume, untar);
+    if (result) return result;
+    printf("Extracted %u files and %u directories, %u failed.\n", untar->files, untar->dirs, untar->failed);
+    if ((untar->state != UNTAR_HEADER && untar->state != UNTAR_END) || untar->header_length) return -EIO;
+    return untar->failed ? -EIO : 0;
+}
+
+s32 untar_close(TAR_EXTRACT *untar) {
+    if (untar->f) vrt_fclose(untar->f);
+    free(untar);
+    return 0;
+}
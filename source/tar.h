@@ -0,0 +1,46 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _TAR_H_
+#define _TAR_H_
+
+#include <gctypes.h>
+#include <sys/types.h>
+
+typedef struct tar_stream TAR_STREAM;
+
+TAR_STREAM *tar_open(char *cwd, char *path, off_t offset);
+
+s32 send_tar(s32 s, TAR_STREAM *tar);
+
+s32 tar_close(TAR_STREAM *tar);
+
+typedef struct tar_extract TAR_EXTRACT;
+
+TAR_EXTRACT *untar_open(char *dir);
+
+s32 recv_to_untar(s32 s, TAR_EXTRACT *untar);
+
+s32 untar_close(TAR_EXTRACT *untar);
+
+#endif /* _TAR_H_ */
@@ -25,14 +25,36 @@ misrepresented as being the original software.
 #include <errno.h>
 #include <malloc.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/dir.h>
 #include <unistd.h>
 
+#include "discindex.h"
 #include "fs.h"
+#include "isfscache.h"
+#include "raw.h"
+#include "stats.h"
 #include "vrt.h"
 
 static const u32 VRT_DEVICE_ID = 38744;
+static const u32 RAW_DEVICE_ID = 38745;
+static const char *RAW_DIR = "/raw";
+static const char *RAW_SUFFIX = ".img";
+static const char *STATS_FILE = "/stats";
+
+#define MAX_WALK_DEPTH 32
+
+struct vrt_walk {
+    bool post_order;
+    bool pending_root;
+    struct stat root_st;
+    u32 depth;
+    u32 too_deep; // directories yielded without being descended into, as they were nested too deeply
+    DIR_ITER *dirs[MAX_WALK_DEPTH];
+    char path[MAXPATHLEN];
+};
 
 static char *virtual_abspath(char *virtual_cwd, char *virtual_path) {
     char *path;
@@ -99,32 +121,22 @@ static char *virtual_abspath(char *virtual_cwd, char *virtual_path) {
 }
 
 /*
-    Converts a client-visible path to a real absolute path
-    E.g. "/sd/foo"    -> "sd:/foo"
-         "/sd"        -> "sd:/"
-         "/sd/../usb" -> "usb:/"
-    The resulting path will fit in an array of size MAXPATHLEN
-    Returns NULL to indicate that the client-visible path is invalid
+    Converts a normalised client-visible path, as returned by virtual_abspath(), to a real absolute path.
+    Returns "" for the vfs-root, which must not be freed.
 */
-char *to_real_path(char *virtual_cwd, char *virtual_path) {
+static char *abspath_to_real_path(char *virtual_path) {
     errno = ENOENT;
     if (strchr(virtual_path, ':')) {
         return NULL; // colon is not allowed in virtual path, i've decided =P
     }
 
-    virtual_path = virtual_abspath(virtual_cwd, virtual_path);
-    if (!virtual_path) return NULL;
-
-    char *path = NULL;
-    char *rest = virtual_path;
-
     if (!strcmp("/", virtual_path)) {
         // indicate vfs-root with ""
-        path = "";
-        goto end;
+        return "";
     }
 
     const char *prefix = NULL;
+    char *rest = virtual_path;
     u32 i;
     for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
         VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
@@ -132,6 +144,7 @@ char *to_real_path(char *virtual_cwd, char *virtual_path) {
         size_t alias_len = strlen(alias);
         if (!strcasecmp(alias, virtual_path) || (!strncasecmp(alias, virtual_path, alias_len) && virtual_path[alias_len] == '/')) {
             prefix = partition->prefix;
+            mount_if_deferred(partition);
             rest += alias_len;
             if (*rest == '/') rest++;
             break;
@@ -139,27 +152,131 @@ char *to_real_path(char *virtual_cwd, char *virtual_path) {
     }
     if (!prefix) {
         errno = ENODEV;
-        goto end;
+        return NULL;
     }
     
     size_t real_path_size = strlen(prefix) + strlen(rest) + 1;
-    if (real_path_size > MAXPATHLEN) goto end;
+    if (real_path_size > MAXPATHLEN) return NULL;
 
-    path = malloc(real_path_size);
-    if (!path) goto end;
+    char *path = malloc(real_path_size);
+    if (!path) return NULL;
     strcpy(path, prefix);
     strcat(path, rest);
+    return path;
+}
 
-    end:
-    free(virtual_path);
+/*
+    Converts a client-visible path to a real absolute path
+    E.g. "/sd/foo"    -> "sd:/foo"
+         "/sd"        -> "sd:/"
+         "/sd/../usb" -> "usb:/"
+    The resulting path will fit in an array of size MAXPATHLEN
+    Returns NULL to indicate that the client-visible path is invalid
+    A deferred partition is mounted on the way, see mount_if_deferred()
+*/
+char *to_real_path(char *virtual_cwd, char *virtual_path) {
+    errno = ENOENT;
+    char *abspath = virtual_abspath(virtual_cwd, virtual_path);
+    if (!abspath) return NULL;
+    char *path = abspath_to_real_path(abspath);
+    free(abspath);
     return path;
 }
 
+/*
+    The checks below take a normalised path, so that each vrt_* call only normalises its path once.
+*/
+static bool is_raw_dir(const char *abspath) {
+    return raw_enabled() && !strcasecmp(RAW_DIR, abspath);
+}
+
+static bool is_stats_file(const char *abspath) {
+    return !strcasecmp(STATS_FILE, abspath);
+}
+
+static VIRTUAL_PARTITION *abspath_partition(const char *abspath) {
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+        VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
+        size_t alias_len = strlen(partition->alias);
+        if (!strncasecmp(partition->alias, abspath, alias_len) && (!abspath[alias_len] || abspath[alias_len] == '/')) {
+            return partition;
+        }
+    }
+    return NULL;
+}
+
+static VIRTUAL_PARTITION *abspath_raw_partition(const char *abspath) {
+    if (!raw_enabled()) return NULL;
+    size_t raw_dir_len = strlen(RAW_DIR);
+    if (strncasecmp(RAW_DIR, abspath, raw_dir_len) || abspath[raw_dir_len] != '/') return NULL;
+    const char *image = abspath + raw_dir_len;
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+        VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
+        size_t alias_len = strlen(partition->alias);
+        if (!strncasecmp(partition->alias, image, alias_len) && !strcasecmp(RAW_SUFFIX, image + alias_len) && raw_available(partition)) {
+            return partition;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Returns the partition containing a client-visible path, or NULL for the vfs-root and paths outside any partition.
+*/
+VIRTUAL_PARTITION *to_partition(char *virtual_cwd, char *virtual_path) {
+    char *path = virtual_abspath(virtual_cwd, virtual_path);
+    if (!path) return NULL;
+    VIRTUAL_PARTITION *result = abspath_partition(path);
+    free(path);
+    return result;
+}
+
+/*
+    Returns the partition whose raw image is at a client-visible path of the form "/raw/<alias>.img",
+    E.g. "/raw/sd.img" -> PA_SD
+    Returns NULL if the path does not name the image of a partition that is currently available.
+*/
+VIRTUAL_PARTITION *to_raw_partition(char *virtual_cwd, char *virtual_path) {
+    if (!raw_enabled()) return NULL;
+    char *path = virtual_abspath(virtual_cwd, virtual_path);
+    if (!path) return NULL;
+    VIRTUAL_PARTITION *result = abspath_raw_partition(path);
+    free(path);
+    return result;
+}
+
+/*
+    Returns the device that operations on a client-visible path (including raw images) are performed on,
+    or DEVICE_NONE for paths that are served without touching storage.
+*/
+io_device to_device(char *virtual_cwd, char *virtual_path) {
+    char *path = virtual_abspath(virtual_cwd, virtual_path);
+    if (!path) return DEVICE_NONE;
+    VIRTUAL_PARTITION *partition = abspath_partition(path);
+    if (!partition) partition = abspath_raw_partition(path);
+    free(path);
+    return partition ? partition->device : DEVICE_NONE;
+}
+
+/*
+    Paths on the disc filesystems are looked up in their index, everything else goes through the ISFS cache,
+    which passes other partitions straight to the filesystem.
+*/
+static int indexed_stat(const char *path, struct stat *st) {
+    return is_disc_path(path) ? disc_index_stat(path, st) : isfs_cache_stat(path, st);
+}
+
+static DIR_ITER *indexed_diropen(const char *path) {
+    return is_disc_path(path) ? disc_index_diropen(path) : isfs_cache_diropen(path);
+}
+
 typedef void * (*path_func)(char *path, ...);
 
 static void *with_virtual_path(void *virtual_cwd, void *void_f, char *virtual_path, s32 failed, ...) {
     char *path = to_real_path(virtual_cwd, virtual_path);
-    if (!path || !*path) return (void *)failed;
+    if (!path || !*path) return (void *)(intptr_t)failed;
     
     path_func f = (path_func)void_f;
     va_list ap;
@@ -179,105 +296,303 @@ static void *with_virtual_path(void *virtual_cwd, void *void_f, char *virtual_pa
         case 1: result = f(path, args[0]); break;
         case 2: result = f(path, args[0], args[1]); break;
         case 3: result = f(path, args[0], args[1], args[2]); break;
-        default: result = (void *)failed;
+        default: result = (void *)(intptr_t)failed;
     }
     
     free(path);
     return result;
 }
 
+/*
+    The stats file is read-only, and is a snapshot taken when it is opened.
+*/
 FILE *vrt_fopen(char *cwd, char *path, char *mode) {
-    return with_virtual_path(cwd, fopen, path, 0, mode, NULL);
+    errno = ENOENT;
+    char *abspath = virtual_abspath(cwd, path);
+    if (!abspath) return NULL;
+    FILE *f = NULL;
+    if (is_stats_file(abspath)) {
+        if (*mode != 'r' || strchr(mode, '+')) errno = EACCES;
+        else f = stats_fopen();
+    } else {
+        char *real_path = abspath_to_real_path(abspath);
+        if (real_path && *real_path) {
+            f = isfs_cache_fopen(real_path, mode);
+            free(real_path);
+        }
+    }
+    free(abspath);
+    return f;
 }
 
-int vrt_stat(char *cwd, char *path, struct stat *st) {
-    char *real_path = to_real_path(cwd, path);
+/*
+    Files opened with vrt_fopen() for writing must be closed with this.
+*/
+int vrt_fclose(FILE *f) {
+    return isfs_cache_fclose(f);
+}
+
+static int stat_abspath(char *abspath, struct stat *st) {
+    bool raw_dir = is_raw_dir(abspath);
+    if (raw_dir || abspath_raw_partition(abspath)) {
+        memset(st, 0, sizeof(struct stat));
+        st->st_mode = raw_dir ? S_IFDIR : S_IFREG;
+        return 0;
+    } else if (is_stats_file(abspath)) {
+        memset(st, 0, sizeof(struct stat));
+        st->st_mode = S_IFREG;
+        st->st_size = stats_format(NULL, 0);
+        return 0;
+    }
+    char *real_path = abspath_to_real_path(abspath);
     if (!real_path) return -1;
     else if (!*real_path) {
         st->st_mode = S_IFDIR;
         st->st_size = 31337;
         return 0;
     }
+    int result = indexed_stat(real_path, st);
     free(real_path);
-    return (int)with_virtual_path(cwd, stat, path, -1, st, NULL);
+    return result;
+}
+
+int vrt_stat(char *cwd, char *path, struct stat *st) {
+    errno = ENOENT;
+    char *abspath = virtual_abspath(cwd, path);
+    if (!abspath) return -1;
+    int result = stat_abspath(abspath, st);
+    free(abspath);
+    return result;
 }
 
 int vrt_chdir(char *cwd, char *path) {
-    struct stat st;
-    if (vrt_stat(cwd, path, &st)) {
-        return -1;
-    } else if (!(st.st_mode & S_IFDIR)) {
-        errno = ENOTDIR;
-        return -1;
-    }
     char *abspath = virtual_abspath(cwd, path);
     if (!abspath) {
         errno = ENOMEM;
         return -1;
     }
-    strcpy(cwd, abspath);
-    if (cwd[1]) strcat(cwd, "/");
+    struct stat st;
+    int result = stat_abspath(abspath, &st);
+    if (!result && !(st.st_mode & S_IFDIR)) {
+        errno = ENOTDIR;
+        result = -1;
+    }
+    if (!result) {
+        strcpy(cwd, abspath);
+        if (cwd[1]) strcat(cwd, "/");
+    }
     free(abspath);
-    return 0;
+    return result;
 }
 
 int vrt_unlink(char *cwd, char *path) {
-    return (int)with_virtual_path(cwd, unlink, path, -1, NULL);
+    return (int)(intptr_t)with_virtual_path(cwd, isfs_cache_unlink, path, -1, NULL);
 }
 
 int vrt_mkdir(char *cwd, char *path, mode_t mode) {
-    return (int)with_virtual_path(cwd, mkdir, path, -1, mode, NULL);
+    return (int)(intptr_t)with_virtual_path(cwd, isfs_cache_mkdir, path, -1, mode, NULL);
 }
 
 int vrt_rename(char *cwd, char *from_path, char *to_path) {
     char *real_to_path = to_real_path(cwd, to_path);
     if (!real_to_path || !*real_to_path) return -1;
-    int result = (int)with_virtual_path(cwd, rename, from_path, -1, real_to_path, NULL);
+    int result = (int)(intptr_t)with_virtual_path(cwd, isfs_cache_rename, from_path, -1, real_to_path, NULL);
     free(real_to_path);
     return result;
 }
 
+static DIR_ITER *fake_dir_iter(u32 device) {
+    DIR_ITER *iter = malloc(sizeof(DIR_ITER));
+    if (!iter) return NULL;
+    iter->device = device;
+    iter->dirStruct = 0;
+    return iter;
+}
+
 /*
-    When in vfs-root this creates a fake DIR_ITER.
+    When in vfs-root or the raw image directory this creates a fake DIR_ITER.
  */
-DIR_ITER *vrt_diropen(char *cwd, char *path) {
-    char *real_path = to_real_path(cwd, path);
+static DIR_ITER *diropen_abspath(char *abspath) {
+    if (is_raw_dir(abspath)) return fake_dir_iter(RAW_DEVICE_ID);
+    char *real_path = abspath_to_real_path(abspath);
     if (!real_path) return NULL;
-    else if (!*real_path) {
-        DIR_ITER *iter = malloc(sizeof(DIR_ITER));
-        if (!iter) return NULL;
-        iter->device = VRT_DEVICE_ID;
-        iter->dirStruct = 0;
-        return iter;
-    }
+    else if (!*real_path) return fake_dir_iter(VRT_DEVICE_ID);
+    DIR_ITER *iter = indexed_diropen(real_path);
     free(real_path);
-    return with_virtual_path(cwd, diropen, path, 0, NULL);
+    return iter;
+}
+
+DIR_ITER *vrt_diropen(char *cwd, char *path) {
+    errno = ENOENT;
+    char *abspath = virtual_abspath(cwd, path);
+    if (!abspath) return NULL;
+    DIR_ITER *iter = diropen_abspath(abspath);
+    free(abspath);
+    return iter;
 }
 
 /*
-    Yields virtual aliases when iter->device == VRT_DEVICE_ID.
+    Yields virtual aliases, followed by the raw image directory and the stats file, when iter->device == VRT_DEVICE_ID.
+    Yields raw images of the available partitions when iter->device == RAW_DEVICE_ID.
  */
 int vrt_dirnext(DIR_ITER *iter, char *filename, struct stat *st) {
     if (iter->device == VRT_DEVICE_ID) {
-        for (; (int)iter->dirStruct < MAX_VIRTUAL_PARTITIONS; iter->dirStruct++) {
-            VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + (int)iter->dirStruct;
-            if (mounted(partition)) {
+        for (; (intptr_t)iter->dirStruct < MAX_VIRTUAL_PARTITIONS; iter->dirStruct++) {
+            VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + (intptr_t)iter->dirStruct;
+            if (mounted(partition) || deferred(partition)) {
+                memset(st, 0, sizeof(struct stat));
                 st->st_mode = S_IFDIR;
-                st->st_size = 0;
                 strcpy(filename, partition->alias + 1);
                 iter->dirStruct++;
                 return 0;
             }
         }
+        if ((intptr_t)iter->dirStruct == MAX_VIRTUAL_PARTITIONS) {
+            iter->dirStruct++;
+            if (raw_enabled()) {
+                memset(st, 0, sizeof(struct stat));
+                st->st_mode = S_IFDIR;
+                strcpy(filename, RAW_DIR + 1);
+                return 0;
+            }
+        }
+        if ((intptr_t)iter->dirStruct == MAX_VIRTUAL_PARTITIONS + 1) {
+            memset(st, 0, sizeof(struct stat));
+            st->st_mode = S_IFREG;
+            st->st_size = stats_format(NULL, 0);
+            strcpy(filename, STATS_FILE + 1);
+            iter->dirStruct++;
+            return 0;
+        }
+        return -1;
+    } else if (iter->device == RAW_DEVICE_ID) {
+        for (; (intptr_t)iter->dirStruct < MAX_VIRTUAL_PARTITIONS; iter->dirStruct++) {
+            VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + (intptr_t)iter->dirStruct;
+            if (raw_available(partition)) {
+                memset(st, 0, sizeof(struct stat));
+                st->st_mode = S_IFREG;
+                strcpy(filename, partition->alias + 1);
+                strcat(filename, RAW_SUFFIX);
+                iter->dirStruct++;
+                return 0;
+            }
+        }
         return -1;
     }
-    return dirnext(iter, filename, st);
+    if (is_disc_index_iter(iter)) return disc_index_dirnext(iter, filename, st);
+    return isfs_cache_dirnext(iter, filename, st);
 }
 
 int vrt_dirclose(DIR_ITER *iter) {
-    if (iter->device == VRT_DEVICE_ID) {
+    if (iter->device == VRT_DEVICE_ID || iter->device == RAW_DEVICE_ID) {
         free(iter);
         return 0;
     }
-    return dirclose(iter);
+    if (is_disc_index_iter(iter)) return disc_index_dirclose(iter);
+    return isfs_cache_dirclose(iter);
+}
+
+/*
+    Starts a depth-first walk of the tree at the client-visible path.
+    Directories are yielded before their contents, or after them if post_order is true.
+    If the path is not a directory, the walk yields just that path.
+*/
+VRT_WALK *vrt_walkopen(char *cwd, char *path, bool post_order) {
+    VRT_WALK *walk = malloc(sizeof(VRT_WALK));
+    if (!walk) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    char *abspath = virtual_abspath(cwd, path);
+    if (!abspath) {
+        errno = ENOMEM;
+        goto error;
+    }
+    strcpy(walk->path, abspath);
+    free(abspath);
+    if (stat_abspath(walk->path, &walk->root_st)) goto error;
+
+    walk->post_order = post_order;
+    walk->depth = 0;
+    walk->too_deep = 0;
+    walk->pending_root = true;
+    if (walk->root_st.st_mode & S_IFDIR) {
+        if (!(walk->dirs[0] = diropen_abspath(walk->path))) goto error;
+        walk->depth = 1;
+        walk->pending_root = !post_order;
+    }
+    return walk;
+
+    error:
+    free(walk);
+    return NULL;
+}
+
+/*
+    Stores the client-visible absolute path of the next entry in path, which must be able to hold MAXPATHLEN characters.
+    Subdirectories that cannot be opened, or that are nested too deeply, are yielded as if they were empty.
+    Returns -1 when the walk is complete.
+*/
+int vrt_walknext(VRT_WALK *walk, char *path, struct stat *st) {
+    if (walk->pending_root) {
+        walk->pending_root = false;
+        strcpy(path, walk->path);
+        memcpy(st, &walk->root_st, sizeof(struct stat));
+        return 0;
+    }
+
+    char filename[MAXPATHLEN];
+    while (walk->depth) {
+        if (vrt_dirnext(walk->dirs[walk->depth - 1], filename, st)) {
+            vrt_dirclose(walk->dirs[--walk->depth]);
+            if (walk->post_order) {
+                strcpy(path, walk->path);
+                memset(st, 0, sizeof(struct stat));
+                st->st_mode = S_IFDIR;
+            }
+            char *parent_end = strrchr(walk->path, '/');
+            if (parent_end == walk->path) parent_end++;
+            if (parent_end) *parent_end = '\0';
+            if (walk->post_order) return 0;
+            continue;
+        }
+        if (!strcmp(".", filename) || !strcmp("..", filename)) continue;
+
+        size_t dir_len = strlen(walk->path);
+        bool at_root = dir_len == 1;
+        if (dir_len + strlen(filename) + 2 > MAXPATHLEN) {
+            printf("Path too long, skipping %s/%s\n", walk->path, filename);
+            continue;
+        }
+        strcpy(path, walk->path);
+        if (!at_root) strcat(path, "/");
+        strcat(path, filename);
+
+        if ((st->st_mode & S_IFDIR) && walk->depth == MAX_WALK_DEPTH) {
+            walk->too_deep++;
+        } else if (st->st_mode & S_IFDIR) {
+            DIR_ITER *dir = diropen_abspath(path);
+            if (dir) {
+                walk->dirs[walk->depth++] = dir;
+                strcpy(walk->path, path);
+                if (walk->post_order) continue;
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/*
+    The number of directories vrt_walknext has yielded without descending into them, as they were nested more
+    than MAX_WALK_DEPTH levels deep.  The last entry yielded was one of them if this went up with it.
+*/
+u32 vrt_walk_too_deep(VRT_WALK *walk) {
+    return walk->too_deep;
+}
+
+int vrt_walkclose(VRT_WALK *walk) {
+    while (walk->depth) vrt_dirclose(walk->dirs[--walk->depth]);
+    free(walk);
+    return 0;
 }
@@ -28,9 +28,20 @@ misrepresented as being the original software.
 #include <stdio.h>
 #include <sys/dir.h>
 
+#include "fs.h"
+
+typedef struct vrt_walk VRT_WALK;
+
 char *to_real_path(char *virtual_cwd, char *virtual_path);
 
+VIRTUAL_PARTITION *to_partition(char *virtual_cwd, char *virtual_path);
+
+VIRTUAL_PARTITION *to_raw_partition(char *virtual_cwd, char *virtual_path);
+
+io_device to_device(char *virtual_cwd, char *virtual_path);
+
 FILE *vrt_fopen(char *cwd, char *path, char *mode);
+int vrt_fclose(FILE *f);
 int vrt_stat(char *cwd, char *path, struct stat *st);
 int vrt_chdir(char *cwd, char *path);
 int vrt_unlink(char *cwd, char *path);
@@ -39,5 +50,9 @@ int vrt_rename(char *cwd, char *from_path, char *to_path);
 DIR_ITER *vrt_diropen(char *cwd, char *path);
 int vrt_dirnext(DIR_ITER *iter, char *filename, struct stat *st);
 int vrt_dirclose(DIR_ITER *iter);
+VRT_WALK *vrt_walkopen(char *cwd, char *path, bool post_order);
+int vrt_walknext(VRT_WALK *walk, char *path, struct stat *st);
+u32 vrt_walk_too_deep(VRT_WALK *walk);
+int vrt_walkclose(VRT_WALK *walk);
 
 #endif /* _VRT_H_ */
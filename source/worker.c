@@ -0,0 +1,200 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <malloc.h>
+#include <ogc/lwp.h>
+#include <ogc/semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "net.h"
+#include "reset.h"
+#include "worker.h"
+
+#define MAX_JOBS 16
+#define WORKER_STACK_SIZE 65536
+#define WORKER_PRIORITY 72 // above the main thread, so a worker resumes as soon as its I/O completes
+
+typedef enum { JOB_FREE, JOB_QUEUED, JOB_FINISHED } job_state;
+
+struct transfer_job {
+    job_state state; // accessed atomically, the main thread and a worker hand the job over through it
+    job_callback callback;
+    s32 socket;
+    void *arg;
+    s32 result;
+    bool abandoned;
+    s32 abandoned_socket;
+    void (*cleanup)(void *arg);
+    void *cleanup_arg;
+};
+
+/*
+    The jobs for one device, in a ring that only the main thread adds to and only the device's worker takes from.
+    A job is queued at most once at a time, so MAX_JOBS entries never overflow.
+*/
+typedef struct {
+    lwp_t thread;
+    bool running;
+    char *buffer;
+    sem_t semaphore;
+    transfer_job *jobs[MAX_JOBS];
+    u32 head;
+    u32 tail;
+} io_queue;
+
+static transfer_job jobs[MAX_JOBS];
+static io_queue queues[MAX_DEVICES];
+static char *main_buffer = NULL;
+static volatile bool stopping = false;
+
+static void enqueue(io_queue *queue, transfer_job *job) {
+    u32 head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    __atomic_store_n(queue->jobs + head % MAX_JOBS, job, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    LWP_SemPost(queue->semaphore);
+}
+
+static transfer_job *dequeue(io_queue *queue) {
+    u32 tail = queue->tail;
+    if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) return NULL;
+    transfer_job *job = __atomic_load_n(queue->jobs + tail % MAX_JOBS, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELAXED);
+    return job;
+}
+
+static void *worker_main(void *arg) {
+    io_queue *queue = arg;
+    while (LWP_SemWait(queue->semaphore) >= 0 && !stopping) {
+        transfer_job *job = dequeue(queue);
+        if (!job) continue;
+        job->result = job->callback(job->socket, job->arg);
+        __atomic_store_n(&job->state, JOB_FINISHED, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static bool start_worker(io_queue *queue) {
+    if (!(queue->buffer = memalign(32, TRANSFER_BUFFER_SIZE))) return false;
+    if (LWP_SemInit(&queue->semaphore, 0, MAX_JOBS + 1) < 0) goto free_buffer;
+    if (LWP_CreateThread(&queue->thread, worker_main, queue, NULL, WORKER_STACK_SIZE, WORKER_PRIORITY) < 0) goto destroy_semaphore;
+    return queue->running = true;
+
+    destroy_semaphore:
+    LWP_SemDestroy(queue->semaphore);
+    free_buffer:
+    free(queue->buffer);
+    return false;
+}
+
+void initialise_workers() {
+    if (!(main_buffer = memalign(32, TRANSFER_BUFFER_SIZE))) die("Unable to allocate transfer buffer", ENOMEM);
+    u32 device, started = 0;
+    for (device = 0; device < MAX_DEVICES; device++) {
+        if (start_worker(queues + device)) started++;
+    }
+    if (started < MAX_DEVICES) printf("Only %u of %u I/O workers started, the rest run on the main thread.\n", started, MAX_DEVICES);
+}
+
+void cleanup_workers() {
+    stopping = true;
+    u32 i;
+    for (i = 0; i < MAX_DEVICES; i++) {
+        io_queue *queue = queues + i;
+        if (!queue->running) continue;
+        LWP_SemPost(queue->semaphore);
+        LWP_JoinThread(queue->thread, NULL);
+        LWP_SemDestroy(queue->semaphore);
+        free(queue->buffer);
+        queue->running = false;
+    }
+    for (i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].abandoned) __atomic_store_n(&jobs[i].state, JOB_FINISHED, __ATOMIC_RELAXED); // never going to run now
+    }
+    reap_abandoned_jobs();
+    free(main_buffer);
+    main_buffer = NULL;
+}
+
+char *transfer_buffer() {
+    lwp_t self = LWP_GetSelf();
+    u32 i;
+    for (i = 0; i < MAX_DEVICES; i++) {
+        if (queues[i].running && queues[i].thread == self) return queues[i].buffer;
+    }
+    return main_buffer;
+}
+
+transfer_job *start_job(io_device device, job_callback callback, s32 socket, void *arg) {
+    io_queue *queue = queues + device;
+    if (!queue->running) return NULL;
+    u32 i;
+    for (i = 0; i < MAX_JOBS; i++) {
+        transfer_job *job = jobs + i;
+        if (__atomic_load_n(&job->state, __ATOMIC_RELAXED) == JOB_FREE) {
+            job->callback = callback;
+            job->socket = socket;
+            job->arg = arg;
+            job->abandoned = false;
+            __atomic_store_n(&job->state, JOB_QUEUED, __ATOMIC_RELAXED);
+            enqueue(queue, job);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+bool finish_job(transfer_job *job, s32 *result) {
+    if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOB_FINISHED) return false;
+    *result = job->result;
+    __atomic_store_n(&job->state, JOB_FREE, __ATOMIC_RELAXED);
+    return true;
+}
+
+s32 wait_for_job(transfer_job *job) {
+    s32 result;
+    while (!finish_job(job, &result)) usleep(1000);
+    return result;
+}
+
+void abandon_job(transfer_job *job, s32 socket, void (*cleanup)(void *arg), void *cleanup_arg) {
+    job->abandoned_socket = socket;
+    job->cleanup = cleanup;
+    job->cleanup_arg = cleanup_arg;
+    job->abandoned = true;
+}
+
+void reap_abandoned_jobs() {
+    u32 i;
+    for (i = 0; i < MAX_JOBS; i++) {
+        transfer_job *job = jobs + i;
+        if (job->abandoned && __atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == JOB_FINISHED) {
+            if (job->abandoned_socket >= 0) net_close_blocking(job->abandoned_socket);
+            if (job->cleanup) job->cleanup(job->cleanup_arg);
+            job->abandoned = false;
+            __atomic_store_n(&job->state, JOB_FREE, __ATOMIC_RELAXED);
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <gctypes.h>
+
+#include "fs.h"
+
+#define TRANSFER_BUFFER_SIZE 32768
+
+typedef s32 (*job_callback)(s32 socket, void *arg);
+
+typedef struct transfer_job transfer_job;
+
+void initialise_workers();
+
+void cleanup_workers();
+
+/*
+    Returns a TRANSFER_BUFFER_SIZE buffer belonging to the calling thread, for use by data connection callbacks
+    and the commands run on workers.
+*/
+char *transfer_buffer();
+
+/*
+    Queues one call of callback(socket, arg) for the worker of device, so that a slow device only delays
+    the operations queued behind it on the same device.
+    Returns NULL if every job is in use or the device has no worker, in which case the caller should make the call itself.
+*/
+transfer_job *start_job(io_device device, job_callback callback, s32 socket, void *arg);
+
+/*
+    Returns false while job is still running.  Once it has finished, stores the callback's result in result,
+    releases the job and returns true.
+*/
+bool finish_job(transfer_job *job, s32 *result);
+
+/*
+    Waits for job to finish, then releases it and returns the callback's result.
+*/
+s32 wait_for_job(transfer_job *job);
+
+/*
+    Releases job without waiting for it.  Once it finishes, socket is closed (if non-negative) and cleanup(cleanup_arg)
+    is called (if non-NULL), from reap_abandoned_jobs().
+*/
+void abandon_job(transfer_job *job, s32 socket, void (*cleanup)(void *arg), void *cleanup_arg);
+
+void reap_abandoned_jobs();
+
+#endif /* _WORKER_H_ */
@@ -0,0 +1,155 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+/*
+    Packs a DOL for the preloader: its 0x100 byte header as-is, then each section that the preloader places, in
+    header order, as a big-endian u32 length followed by the section compressed in the LZ4 block format.
+    The LZ4 block format decompresses quickly with a few lines of code, see source/lz4.c.
+
+    Built and run on the build machine: dolpack <input.dol> <output>
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DOL_HEADER_SIZE 0x100
+#define DOL_SECTIONS 18
+#define MIN_MATCH 4
+#define MATCH_LIMIT 12 // the last match starts at least this far from the end of the block
+#define LAST_LITERALS 5 // and ends at least this far from it
+#define MAX_OFFSET 65535
+#define HASH_BITS 16
+
+static uint32_t read_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static size_t write_length(uint8_t *out, size_t length) {
+    size_t n = 0;
+    for (; length >= 255; length -= 255) out[n++] = 255;
+    out[n++] = length;
+    return n;
+}
+
+static size_t write_sequence(uint8_t *out, const uint8_t *literals, size_t num_literals, size_t offset, size_t match_length) {
+    size_t n = 1;
+    uint8_t token = (num_literals < 15 ? num_literals : 15) << 4;
+    if (num_literals >= 15) n += write_length(out + n, num_literals - 15);
+    memcpy(out + n, literals, num_literals);
+    n += num_literals;
+    if (match_length) {
+        out[n++] = offset & 0xff;
+        out[n++] = offset >> 8;
+        match_length -= MIN_MATCH;
+        token |= match_length < 15 ? match_length : 15;
+        if (match_length >= 15) n += write_length(out + n, match_length - 15);
+    }
+    out[0] = token;
+    return n;
+}
+
+/*
+    Greedy compression with a hash table of the last position each 4-byte sequence was seen at.
+    out must have room for size + size / 255 + 16 bytes.
+*/
+static size_t compress_block(const uint8_t *in, size_t size, uint8_t *out) {
+    static uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t pos = 0, anchor = 0, n = 0;
+    while (size > MATCH_LIMIT && pos < size - MATCH_LIMIT) {
+        uint32_t sequence = read_le32(in + pos);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (!candidate-- || pos - candidate > MAX_OFFSET || read_le32(in + candidate) != sequence) {
+            pos++;
+            continue;
+        }
+        size_t length = MIN_MATCH, max_length = size - LAST_LITERALS - pos;
+        while (length < max_length && in[candidate + length] == in[pos + length]) length++;
+        n += write_sequence(out + n, in + anchor, pos - anchor, pos - candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+    return n + write_sequence(out + n, in + anchor, size - anchor, 0, 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <input.dol> <output>\n", argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    uint8_t *dol = malloc(size > 0 ? size : 1);
+    if (!dol || size < DOL_HEADER_SIZE || fread(dol, 1, size, in) != (size_t)size) {
+        fprintf(stderr, "%s: unable to read DOL\n", argv[1]);
+        return 1;
+    }
+    fclose(in);
+
+    FILE *out = fopen(argv[2], "wb");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    fwrite(dol, 1, DOL_HEADER_SIZE, out);
+    size_t packed = DOL_HEADER_SIZE;
+    int i;
+    for (i = 0; i < DOL_SECTIONS; i++) {
+        uint32_t pos = read_be32(dol + i * 4), start = read_be32(dol + 0x48 + i * 4), length = read_be32(dol + 0x90 + i * 4);
+        if (!length || start < 0x100) continue;
+        if (pos > (uint32_t)size || length > size - pos) {
+            fprintf(stderr, "%s: section %d lies outside the file\n", argv[1], i);
+            return 1;
+        }
+        uint8_t *block = malloc(length + length / 255 + 16);
+        if (!block) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        size_t block_size = compress_block(dol + pos, length, block);
+        uint8_t header[4] = { block_size >> 24, block_size >> 16, block_size >> 8, block_size };
+        fwrite(header, 1, 4, out);
+        fwrite(block, 1, block_size, out);
+        packed += 4 + block_size;
+        free(block);
+    }
+    if (fclose(out)) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("%s: %ld bytes packed to %zu\n", argv[2], size, packed);
+    return 0;
+}